@@ -0,0 +1,44 @@
+#include "header.h"
+
+// Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc so every heap
+// request made by the renderer passes through here first.
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+static __thread int tracing = 0;
+static long allocs = 0;
+
+void render_alloc_begin(void) {
+  tracing = 1;
+}
+
+void render_alloc_end(void) {
+  tracing = 0;
+}
+
+long render_alloc_count(void) {
+  return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+
+static void count_alloc(void) {
+  if (tracing) {
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void* __wrap_malloc(size_t size) {
+  count_alloc();
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  count_alloc();
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  count_alloc();
+  return __real_realloc(ptr, size);
+}
@@ -0,0 +1,209 @@
+#include "header.h"
+#include <pthread.h>
+
+// Rendering an animation. The scene is read and laid out once; each frame
+// only moves the camera, spheres and lights named by the track, then
+// refits the BVH if a sphere moved. A frame is written to its file on a
+// thread of its own while the next one renders, so the writing costs
+// nothing unless it takes longer than a render.
+
+// The keys of one animated thing, sorted by frame.
+typedef struct {
+  Keyframe* keys;
+  int count;
+  int slot;      // sphere array slot or light index, unused for the camera
+  double radius;
+} Channel;
+
+// A finished frame on its way to disk.
+typedef struct {
+  pthread_t thread;
+  Color* buff;
+  int width;
+  int height;
+  int ascii;
+  char* filename;
+} FrameWrite;
+
+static int key_order(const void* a, const void* b) {
+  const Keyframe* ka = a;
+  const Keyframe* kb = b;
+  if (ka->type != kb->type) return ka->type - kb->type;
+  if (ka->object != kb->object) return ka->object - kb->object;
+  return ka->frame - kb->frame;
+}
+
+static const char* kind_name(int type) {
+  return type == 0 ? "camera" : type == 1 ? "sphere" : "light";
+}
+
+// Value of the channel at frame: a straight line between the keys either
+// side of it, and the first or last key before or after the track.
+static void channel_at(Channel* c, int frame, double* position, double* lookAt) {
+  Keyframe* a = &c->keys[0];
+  Keyframe* b = a;
+  double s = 0;
+  int i, k;
+
+  if (frame >= c->keys[c->count - 1].frame) {
+    a = b = &c->keys[c->count - 1];
+  } else if (frame > a->frame) {
+    for (k = 1; c->keys[k].frame <= frame; k++);
+    a = &c->keys[k - 1];
+    b = &c->keys[k];
+    s = (double)(frame - a->frame) / (b->frame - a->frame);
+  }
+  for (i = 0; i < 3; i++) {
+    position[i] = a->position[i] + s * (b->position[i] - a->position[i]);
+    lookAt[i] = a->lookAt[i] + s * (b->lookAt[i] - a->lookAt[i]);
+  }
+}
+
+// Splits the sorted keys into channels and ties each to what it moves.
+static Channel* make_channels(Scene* scene, Track* track, int* count) {
+  Channel* channels = malloc(sizeof(Channel) * track->count);
+  int spheres = 0, lights = scene->lightCount;
+  int i, n = 0;
+
+  for (i = 0; scene->objs[i] != NULL; i++) {
+    if (scene->objs[i]->type == 1) spheres++;
+  }
+
+  qsort(track->keys, track->count, sizeof(Keyframe), key_order);
+  for (i = 0; i < track->count; i++) {
+    Keyframe* key = &track->keys[i];
+    if (n > 0 && channels[n - 1].keys->type == key->type &&
+        channels[n - 1].keys->object == key->object) {
+      Channel* c = &channels[n - 1];
+      if (c->keys[c->count - 1].frame == key->frame) {
+        fprintf(stderr, "Error: The track has two keys for %s %d at frame %d.\n",
+          kind_name(key->type), key->object, key->frame);
+        exit(1);
+      }
+      c->count++;
+      continue;
+    }
+
+    Channel* c = &channels[n++];
+    c->keys = key;
+    c->count = 1;
+    c->slot = 0;
+    c->radius = 0;
+    if (key->type == 1) {
+      if (key->object > spheres) {
+        fprintf(stderr, "Error: The track moves sphere %d, the scene has %d.\n", key->object,
+          spheres);
+        exit(1);
+      }
+      // The render arrays follow the BVH's leaf order when there is one.
+      int obj, seen = 0;
+      for (obj = 0; seen < key->object; obj++) {
+        if (scene->objs[obj]->type == 1) seen++;
+      }
+      obj--;
+      c->radius = scene->objs[obj]->Sphere.radius;
+      c->slot = key->object - 1;
+      if (scene->bvh != NULL) {
+        for (c->slot = 0; scene->bvh->prims[c->slot] != obj; c->slot++);
+      }
+    } else if (key->type == 3) {
+      if (key->object > lights) {
+        fprintf(stderr, "Error: The track moves light %d, the scene has %d.\n", key->object,
+          lights);
+        exit(1);
+      }
+      c->slot = key->object - 1;
+    }
+  }
+  *count = n;
+  return channels;
+}
+
+// Puts everything where it is at frame. Returns whether a sphere moved.
+static int pose_scene(Scene* scene, Channel* channels, int count, int frame) {
+  SphereSet* s = &scene->spheres;
+  double position[3], lookAt[3];
+  int i, moved = 0;
+
+  for (i = 0; i < count; i++) {
+    Channel* c = &channels[i];
+    channel_at(c, frame, position, lookAt);
+    if (c->keys->type == 0) {
+      scene_look_at(scene, position, lookAt);
+    } else if (c->keys->type == 3) {
+      scene_move_light(scene, c->slot, position);
+    } else if (s->cx[c->slot] != (real)position[0] || s->cy[c->slot] != (real)position[1] ||
+      s->cz[c->slot] != (real)position[2]) {
+      scene_move_sphere(scene, c->slot, position, c->radius);
+      moved = 1;
+    }
+  }
+  return moved;
+}
+
+static void* write_frame(void* data) {
+  FrameWrite* w = data;
+  FILE* output = fopen(w->filename, "wb");
+  if (output == NULL) {
+    fprintf(stderr, "Error: Failed to open file %s\n", w->filename);
+    exit(1);
+  }
+  ppmMaker(w->buff, w->width, w->height, w->ascii, output);
+  fclose(output);
+  free(w->buff);
+  return NULL;
+}
+
+// Renders frames 0 to frames - 1. output names the files: out.ppm becomes
+// out0000.ppm, out0001.ppm and so on. opts->rays ends up with the counts
+// of every frame together.
+void anim_render(Scene* scene, Track* track, RenderOptions* opts, int width, int height,
+  int frames, char* output, int ascii) {
+  RayCounts total;
+  FrameWrite writes[2];
+  int channelCount, frame;
+  size_t i;
+
+  Channel* channels = make_channels(scene, track, &channelCount);
+  size_t stem = strlen(output);
+  if (stem >= 4 && strcmp(output + stem - 4, ".ppm") == 0) {
+    stem -= 4;
+  }
+  memset(&total, 0, sizeof(RayCounts));
+
+  for (frame = 0; frame < frames; frame++) {
+    if (pose_scene(scene, channels, channelCount, frame)) {
+      bvh_refit(scene);
+    }
+    Color* buff = sceneMaker(scene, height, width, opts);
+    for (i = 0; i < sizeof(RayCounts) / sizeof(long); i++) {
+      ((long*)&total)[i] += ((long*)&opts->rays)[i];
+    }
+
+    // The frame before this one has had a whole render to finish writing.
+    FrameWrite* w = &writes[frame % 2];
+    if (frame > 0) {
+      FrameWrite* last = &writes[(frame - 1) % 2];
+      pthread_join(last->thread, NULL);
+      free(last->filename);
+    }
+    w->buff = buff;
+    w->width = width;
+    w->height = height;
+    w->ascii = ascii;
+    w->filename = malloc(stem + 16);
+    sprintf(w->filename, "%.*s%04d.ppm", (int)stem, output, frame);
+    if (pthread_create(&w->thread, NULL, write_frame, w) != 0) {
+      fprintf(stderr, "Error: Could not start the thread writing frame %d.\n", frame);
+      exit(1);
+    }
+  }
+  if (frames > 0) {
+    FrameWrite* last = &writes[(frames - 1) % 2];
+    pthread_join(last->thread, NULL);
+    free(last->filename);
+  }
+
+  opts->rays = total;
+  free(channels);
+}
@@ -0,0 +1,210 @@
+#include "../header.h"
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Compares closest-hit traversal over the parse-time Obj records, the way
+// rayCast() used to read them, against the render-time SphereSet arrays.
+// Both walk the same BVH with the same rays.
+//
+// Usage: bench_layout [spheres] [rays]
+
+// The old kernel, reading the center through the Obj's position pointer.
+static double obj_sphere(double *Ro, double *Rd, Obj* obj) {
+  double r = obj->Sphere.radius;
+  double* pos = obj->Sphere.position;
+
+  double valueA = (sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
+  double valueB = 2 * Rd[0] * (Ro[0] - pos[0]) + 2 * Rd[1] * (Ro[1] - pos[1]) + 2 * Rd[2] * (Ro[2] - pos[2]);
+  double valueC = sqr(pos[0]) + sqr(pos[1]) + sqr(pos[2]) + sqr(Ro[0]) + sqr(Ro[1]) + sqr(Ro[2]) -2 * (pos[0] * Ro[0] + pos[1] * Ro[1] + pos[2] * Ro[2]) - sqr(r);
+
+  double d = sqr(valueB) - 4 * valueA * valueC;
+  if(d < 0)
+    return -1;
+
+  double t0 = (-valueB - sqrt(d)) / (2*valueA);
+  if (t0 > 0)
+    return t0;
+
+  double t1 = (-valueB + sqrt(d)) / (2*valueA);
+  if (t1 > 0)
+    return t1;
+
+  return -1;
+}
+
+static double box_entry(BvhNode* n, double* Ro, double* invRd, double tMax) {
+  double tNear = -INFINITY, tFar = INFINITY;
+  int a;
+  for (a = 0; a < 3; a++) {
+    double t0 = (n->min[a] - Ro[a]) * invRd[a];
+    double t1 = (n->max[a] - Ro[a]) * invRd[a];
+    tNear = fmax(tNear, fmin(t0, t1));
+    tFar = fmin(tFar, fmax(t0, t1));
+  }
+  return (tFar < tNear || tFar < 0 || tNear > tMax) ? INFINITY : tNear;
+}
+
+// Same traversal as bvh_cast(), but every leaf test goes objs[prims[i]] ->
+// Sphere.position like the old Obj-based path did.
+static int obj_cast(Bvh* bvh, Obj** objs, double* Ro, double* Rd) {
+  double invRd[3] = {1.0 / Rd[0], 1.0 / Rd[1], 1.0 / Rd[2]};
+  double tBest = INFINITY;
+  int best = -1, stack[128], top = 0, i;
+
+  stack[top++] = 0;
+  while (top > 0) {
+    BvhNode* n = &bvh->nodes[stack[--top]];
+    if (box_entry(n, Ro, invRd, tBest) == INFINITY) {
+      continue;
+    }
+    if (n->count > 0) {
+      for (i = n->start; i < n->start + n->count; i++) {
+        double t = obj_sphere(Ro, Rd, objs[bvh->prims[i]]);
+        if (t < tBest && t != -1) {
+          tBest = t;
+          best = i;
+        }
+      }
+      continue;
+    }
+    stack[top++] = n->start + 1;
+    stack[top++] = n->start;
+  }
+  return best;
+}
+
+static int soa_cast(Scene* scene, double* Ro, double* Rd) {
+  real o[3] = {Ro[0], Ro[1], Ro[2]};
+  real d[3] = {Rd[0], Rd[1], Rd[2]};
+  real t;
+  return rayCast(&t, scene, -1, o, d);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Hardware cache-miss counter for this process, or -1 when the kernel or
+// the sandbox doesn't allow one.
+static int misses_open(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double frand(unsigned* seed) {
+  *seed = *seed * 1103515245u + 12345u;
+  return (*seed >> 8) / (double)(1u << 24);
+}
+
+typedef struct {
+  double seconds;
+  long long misses;
+  long hits;
+} Result;
+
+static Result run(int soa, Scene* scene, double* dirs, int rays, int fd) {
+  double Ro[3] = {0, 0, 0};
+  Result r = {0, -1, 0};
+  int i;
+
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  double start = now();
+  for (i = 0; i < rays; i++) {
+    int hit = soa ? soa_cast(scene, Ro, dirs + 3 * i)
+                  : obj_cast(scene->bvh, scene->objs, Ro, dirs + 3 * i);
+    r.hits += hit >= 0;
+  }
+  r.seconds = now() - start;
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &r.misses, sizeof(r.misses)) != sizeof(r.misses)) {
+      r.misses = -1;
+    }
+  }
+  return r;
+}
+
+static void report(const char* name, Result r, int rays) {
+  printf("%-8s %8.3f s %8.1f ns/ray %10ld hits", name, r.seconds, 1e9 * r.seconds / rays, r.hits);
+  if (r.misses >= 0) {
+    printf(" %14lld cache misses", r.misses);
+  } else {
+    printf("   cache misses n/a");
+  }
+  printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+  int count = argc > 1 ? atoi(argv[1]) : 1000000;
+  int rays = argc > 2 ? atoi(argv[2]) : 250000;
+  unsigned seed = 1;
+  Scene scene;
+  int i;
+
+  // Allocating the spheres the way the original parser did: one malloc for
+  // the Obj and one per vector, with unrelated allocations in between.
+  scene.objs = malloc(sizeof(Obj*) * (count + 2));
+  scene.light = malloc(sizeof(Obj*));
+  scene.light[0] = NULL;
+  scene.objs[0] = calloc(1, sizeof(Obj));
+  for (i = 1; i <= count; i++) {
+    Obj* obj = calloc(1, sizeof(Obj));
+    obj->type = 1;
+    obj->diffuse = malloc(3 * sizeof(double));
+    obj->specular = malloc(3 * sizeof(double));
+    obj->Sphere.position = malloc(3 * sizeof(double));
+    obj->Sphere.position[0] = frand(&seed) * 200 - 100;
+    obj->Sphere.position[1] = frand(&seed) * 200 - 100;
+    obj->Sphere.position[2] = frand(&seed) * 200 + 5;
+    obj->Sphere.radius = 0.05 + frand(&seed) * 0.2;
+    memcpy(obj->diffuse, obj->Sphere.position, 3 * sizeof(double));
+    memcpy(obj->specular, obj->Sphere.position, 3 * sizeof(double));
+    scene.objs[i] = obj;
+  }
+  scene.objs[count + 1] = NULL;
+
+  scene.bvh = bvh_build(scene.objs);
+  scene_build(&scene);
+
+  double* dirs = malloc(sizeof(double) * 3 * rays);
+  for (i = 0; i < rays; i++) {
+    dirs[3 * i] = frand(&seed) * 2 - 1;
+    dirs[3 * i + 1] = frand(&seed) * 2 - 1;
+    dirs[3 * i + 2] = 1;
+    double len = sqrt(dirs[3 * i] * dirs[3 * i] + dirs[3 * i + 1] * dirs[3 * i + 1] + 1);
+    dirs[3 * i] /= len;
+    dirs[3 * i + 1] /= len;
+    dirs[3 * i + 2] /= len;
+  }
+
+  int fd = misses_open();
+  printf("%d spheres, %d rays, BVH depth %d\n", count, rays, scene.bvh->depth);
+  // A warm-up pass of each so neither starts with cold caches.
+  run(0, &scene, dirs, rays / 10, -1);
+  Result obj = run(0, &scene, dirs, rays, fd);
+  run(1, &scene, dirs, rays / 10, -1);
+  Result soa = run(1, &scene, dirs, rays, fd);
+  report("Obj", obj, rays);
+  report("SoA", soa, rays);
+  printf("speedup  %.2fx", obj.seconds / soa.seconds);
+  if (obj.misses > 0 && soa.misses >= 0) {
+    printf(", %.1f%% fewer cache misses", 100.0 * (obj.misses - soa.misses) / obj.misses);
+  }
+  printf("\n");
+  return obj.hits == soa.hits ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+#include "../header.h"
+#include <time.h>
+
+// Primary-ray throughput of each packet kernel against tracing the same
+// rays one at a time with rayCast(), with and without the BVH. Rays come
+// from a size x size pixel grid in 2x2 blocks, the way renderTile() sends
+// them, and every kernel must agree with rayCast() on every hit.
+//
+// Usage: bench_packets [spheres] [size]
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double frand(unsigned* seed) {
+  *seed = *seed * 1103515245u + 12345u;
+  return (*seed >> 8) / (double)(1u << 24);
+}
+
+static void block_rays(RayPacket* p, real* dirs, int size, int x, int y) {
+  static const int laneX[PACKET_SIZE] = {0, 1, 0, 1};
+  static const int laneY[PACKET_SIZE] = {0, 0, 1, 1};
+  int lane;
+  for (lane = 0; lane < PACKET_SIZE; lane++) {
+    real* Rd = dirs + 3 * ((y + laneY[lane]) * size + x + laneX[lane]);
+    p->ox[lane] = p->oy[lane] = p->oz[lane] = 0;
+    p->dx[lane] = Rd[0];
+    p->dy[lane] = Rd[1];
+    p->dz[lane] = Rd[2];
+  }
+}
+
+// Traces the whole grid and fills prims. A NULL cast uses rayCast().
+static double run(PacketCast cast, Scene* scene, real* dirs, int size, int* prims) {
+  real Ro[3] = {0, 0, 0};
+  RayPacket packet;
+  int x, y;
+
+  double start = now();
+  if (cast == NULL) {
+    for (x = 0; x < size * size; x++) {
+      real t;
+      prims[x] = rayCast(&t, scene, -1, Ro, dirs + 3 * x);
+    }
+  } else {
+    for (y = 0; y < size; y += 2) {
+      for (x = 0; x < size; x += 2) {
+        block_rays(&packet, dirs, size, x, y);
+        cast(scene, &packet);
+        prims[y * size + x] = packet.prim[0];
+        prims[y * size + x + 1] = packet.prim[1];
+        prims[(y + 1) * size + x] = packet.prim[2];
+        prims[(y + 1) * size + x + 1] = packet.prim[3];
+      }
+    }
+  }
+  return now() - start;
+}
+
+static void bench(char* accel, Scene* scene, real* dirs, int size, int* expect, int* prims, int* failed) {
+  static char* kernels[] = {"scalar", "sse2", "avx2"};
+  int rays = size * size;
+  int k;
+
+  run(NULL, scene, dirs, size, expect);
+  double base = run(NULL, scene, dirs, size, expect);
+  printf("%-7s %-7s %8.3f s %8.2f Mrays/s\n", accel, "single", base, rays / base / 1e6);
+
+  for (k = 0; k < 3; k++) {
+    PacketCast cast = packet_kernel(kernels[k]);
+    if (cast == NULL) {
+      printf("%-7s %-7s not supported on this CPU\n", accel, kernels[k]);
+      continue;
+    }
+    run(cast, scene, dirs, size, prims);
+    double seconds = run(cast, scene, dirs, size, prims);
+    int same = memcmp(prims, expect, sizeof(int) * rays) == 0;
+    printf("%-7s %-7s %8.3f s %8.2f Mrays/s %6.2fx%s\n", accel, kernels[k], seconds,
+      rays / seconds / 1e6, base / seconds, same ? "" : "  MISMATCH");
+    if (!same) {
+      *failed = 1;
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int count = argc > 1 ? atoi(argv[1]) : 2000;
+  int size = argc > 2 ? atoi(argv[2]) : 256;
+  unsigned seed = 1;
+  Scene scene;
+  int failed = 0;
+  int i;
+
+  size += size & 1;
+  scene.objs = malloc(sizeof(Obj*) * (count + 3));
+  scene.light = malloc(sizeof(Obj*));
+  scene.light[0] = NULL;
+  scene.objs[0] = calloc(1, sizeof(Obj));
+  for (i = 1; i <= count; i++) {
+    Obj* obj = calloc(1, sizeof(Obj));
+    obj->type = 1;
+    obj->Sphere.position = malloc(3 * sizeof(double));
+    obj->Sphere.position[0] = frand(&seed) * 40 - 20;
+    obj->Sphere.position[1] = frand(&seed) * 40 - 20;
+    obj->Sphere.position[2] = frand(&seed) * 40 + 20;
+    obj->Sphere.radius = 0.2 + frand(&seed) * 0.8;
+    obj->diffuse = obj->specular = obj->Sphere.position;
+    scene.objs[i] = obj;
+  }
+  // A floor, so rays that miss every sphere still find something.
+  Obj* floor = calloc(1, sizeof(Obj));
+  floor->type = 2;
+  floor->Plane.normal = calloc(3, sizeof(double));
+  floor->Plane.position = calloc(3, sizeof(double));
+  floor->Plane.normal[1] = 1;
+  floor->Plane.position[1] = -25;
+  floor->diffuse = floor->specular = floor->Plane.normal;
+  scene.objs[count + 1] = floor;
+  scene.objs[count + 2] = NULL;
+
+  // A 60 degree field of view over the cloud.
+  real* dirs = malloc(sizeof(real) * 3 * size * size);
+  for (i = 0; i < size * size; i++) {
+    real* Rd = dirs + 3 * i;
+    Rd[0] = -0.577 + 1.155 * (i % size + 0.5) / size;
+    Rd[1] = 0.577 - 1.155 * (i / size + 0.5) / size;
+    Rd[2] = 1;
+    normalize(Rd);
+  }
+  int* expect = malloc(sizeof(int) * size * size);
+  int* prims = malloc(sizeof(int) * size * size);
+
+  printf("%d spheres, %dx%d primary rays\n", count, size, size);
+  scene.bvh = bvh_build(scene.objs);
+  scene_build(&scene);
+  bench("bvh", &scene, dirs, size, expect, prims, &failed);
+
+  // Same spheres, tested linearly. The arrays have to be rebuilt in objs
+  // order once the BVH is gone.
+  bvh_free(scene.bvh);
+  scene.bvh = NULL;
+  scene_build(&scene);
+  bench("linear", &scene, dirs, size, expect, prims, &failed);
+  return failed;
+}
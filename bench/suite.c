@@ -0,0 +1,497 @@
+#include "../header.h"
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Rendering benchmark over procedurally generated scenes. Each scene is
+// built in memory, rendered with sceneMaker() at 1, 2, 4, ... threads up to
+// --threads, and reported as wall time, rays per second, speedup over one
+// thread and the peak RSS of the process that rendered it. Every scene runs
+// in its own child process so its peak RSS isn't hidden by the ones before.
+//
+// Results are printed as a table and written as JSON to --out, so runs can
+// be compared between releases.
+//
+// Usage: bench_suite [--size WxH] [--threads N] [--out file] [scene[:count] ...]
+//        bench_suite --emit scene[:count]    writes the scene as JSON
+//
+// Scenes: grid, cloud, lights, stack, city. count scales each one; see the table
+// below for what it means and the default.
+
+// Scenes are built into one arena so a big cloud isn't a million mallocs.
+typedef struct {
+  char* data;
+  size_t used;
+  size_t size;
+} Arena;
+
+static void* arena_take(Arena* a, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (a->used + size > a->size) {
+    fprintf(stderr, "Error: Scene arena is full.\n");
+    exit(1);
+  }
+  void* p = a->data + a->used;
+  a->used += size;
+  return p;
+}
+
+static double* vec(Arena* a, double x, double y, double z) {
+  double* v = arena_take(a, 3 * sizeof(double));
+  v[0] = x;
+  v[1] = y;
+  v[2] = z;
+  return v;
+}
+
+typedef struct {
+  Arena arena;
+  Obj** objs;
+  Obj** light;
+  int objCount;
+  int lightCount;
+  int objMax;
+  int lightMax;
+  int maxDepth;
+} Gen;
+
+static double frand(unsigned* seed) {
+  *seed = *seed * 1103515245u + 12345u;
+  return (*seed >> 8) / (double)(1u << 24);
+}
+
+static void gen_init(Gen* g, int objs, int lights) {
+  g->arena.size = (size_t)(objs + lights + 1) * (sizeof(Obj) + 3 * 4 * sizeof(double) + 64);
+  g->arena.data = malloc(g->arena.size);
+  g->arena.used = 0;
+  g->objMax = objs + 1;
+  g->lightMax = lights;
+  g->objs = malloc(sizeof(Obj*) * (g->objMax + 1));
+  g->light = malloc(sizeof(Obj*) * (g->lightMax + 1));
+  g->objCount = 0;
+  g->lightCount = 0;
+  g->maxDepth = DEFAULT_DEPTH;
+  if (g->arena.data == NULL || g->objs == NULL || g->light == NULL) {
+    fprintf(stderr, "Error: Out of memory while generating the scene.\n");
+    exit(1);
+  }
+
+  Obj* camera = arena_take(&g->arena, sizeof(Obj));
+  memset(camera, 0, sizeof(Obj));
+  camera->Camera.width = 2;
+  camera->Camera.height = 1.5;
+  camera->Camera.maxDepth = -1;
+  camera->Camera.minWeight = -1;
+  g->objs[g->objCount++] = camera;
+  g->objs[g->objCount] = NULL;
+  g->light[0] = NULL;
+}
+
+static Obj* gen_obj(Gen* g, int type) {
+  Obj* obj = arena_take(&g->arena, sizeof(Obj));
+  memset(obj, 0, sizeof(Obj));
+  obj->type = type;
+  obj->refracIndex = 1;
+  if (type == 3) {
+    if (g->lightCount >= g->lightMax) {
+      fprintf(stderr, "Error: Too many lights generated.\n");
+      exit(1);
+    }
+    g->light[g->lightCount++] = obj;
+    g->light[g->lightCount] = NULL;
+  } else {
+    if (g->objCount >= g->objMax) {
+      fprintf(stderr, "Error: Too many objects generated.\n");
+      exit(1);
+    }
+    g->objs[g->objCount++] = obj;
+    g->objs[g->objCount] = NULL;
+  }
+  return obj;
+}
+
+static Obj* gen_sphere(Gen* g, double x, double y, double z, double r, unsigned* seed) {
+  Obj* s = gen_obj(g, 1);
+  s->Sphere.position = vec(&g->arena, x, y, z);
+  s->Sphere.radius = r;
+  s->diffuse = vec(&g->arena, 0.2 + 0.8 * frand(seed), 0.2 + 0.8 * frand(seed), 0.2 + 0.8 * frand(seed));
+  s->specular = vec(&g->arena, 1, 1, 1);
+  return s;
+}
+
+static Obj* gen_floor(Gen* g, double y) {
+  Obj* p = gen_obj(g, 2);
+  p->Plane.normal = vec(&g->arena, 0, 1, 0);
+  p->Plane.position = vec(&g->arena, 0, y, 0);
+  p->diffuse = vec(&g->arena, 0.6, 0.6, 0.6);
+  p->specular = vec(&g->arena, 0.3, 0.3, 0.3);
+  return p;
+}
+
+static Obj* gen_light(Gen* g, double x, double y, double z, double power) {
+  Obj* l = gen_obj(g, 3);
+  l->Light.position = vec(&g->arena, x, y, z);
+  l->diffuse = vec(&g->arena, power, power, power);
+  l->Light.radial_a0 = 0.125;
+  l->Light.radial_a1 = 0.125;
+  l->Light.radial_a2 = 0.0125;
+  return l;
+}
+
+// count spheres on a cube lattice in front of the camera, every other one
+// a little reflective, over a floor with two lights.
+static void make_grid(Gen* g, int count) {
+  unsigned seed = 1;
+  int side = (int)ceil(cbrt(count));
+  int i;
+
+  gen_init(g, count + 1, 2);
+  double z0 = side + 3;
+  for (i = 0; i < count; i++) {
+    int x = i % side, y = (i / side) % side, z = i / (side * side);
+    Obj* s = gen_sphere(g, x - (side - 1) / 2.0, y - (side - 1) / 2.0, z0 + z, 0.35, &seed);
+    s->reflectivity = (i & 1) ? 0.2 : 0;
+  }
+  gen_floor(g, -side / 2.0 - 1);
+  gen_light(g, side, side, 0, 4);
+  gen_light(g, -side, side / 2.0, 1, 2);
+}
+
+// count small spheres scattered through the view, out to a depth of 40.
+static void make_cloud(Gen* g, int count) {
+  unsigned seed = 2;
+  int i;
+
+  gen_init(g, count, 2);
+  for (i = 0; i < count; i++) {
+    double z = 4 + 36 * frand(&seed);
+    double x = (frand(&seed) * 2 - 1) * 0.8 * z;
+    double y = (frand(&seed) * 2 - 1) * 0.6 * z;
+    Obj* s = gen_sphere(g, x, y, z, 0.05 + 0.25 * frand(&seed), &seed);
+    s->reflectivity = frand(&seed) < 0.3 ? 0.3 : 0;
+  }
+  gen_light(g, 10, 20, 0, 20);
+  gen_light(g, -15, 10, 5, 10);
+}
+
+// count lights over 200 spheres and a floor. Every hit sends one shadow
+// ray per light, so this is the shadow ray workload.
+static void make_lights(Gen* g, int count) {
+  unsigned seed = 3;
+  int i;
+
+  gen_init(g, 201, count);
+  for (i = 0; i < 200; i++) {
+    gen_sphere(g, (frand(&seed) * 2 - 1) * 6, -2 + 4 * frand(&seed), 5 + 10 * frand(&seed),
+      0.2 + 0.4 * frand(&seed), &seed);
+  }
+  gen_floor(g, -3);
+  for (i = 0; i < count; i++) {
+    gen_light(g, (frand(&seed) * 2 - 1) * 10, 4 + 6 * frand(&seed), frand(&seed) * 15, 8.0 / count);
+  }
+}
+
+// count street lights with a steep falloff over a lattice of as many
+// buildings, spread out down the view. Each hit is in reach of only a few
+// dozen lights, so this is the light culling workload.
+static void make_city(Gen* g, int count) {
+  unsigned seed = 5;
+  int side = (int)ceil(sqrt(count));
+  int i;
+
+  gen_init(g, count + 1, count);
+  for (i = 0; i < count; i++) {
+    double x = 4 * (i % side - (side - 1) / 2.0), z = 6 + 4 * (i / side);
+    gen_sphere(g, x, -1, z, 1.5, &seed);
+    Obj* l = gen_light(g, x + 2, 1, z + 2, 2);
+    l->Light.radial_a0 = 1;
+    l->Light.radial_a1 = 0;
+    l->Light.radial_a2 = 4;
+  }
+  gen_floor(g, -2);
+}
+
+// count glassy mirror spheres in a ring, each reflecting and refracting
+// 45%, over a mirror floor, rendered 16 bounces deep. The ray tree is as
+// deep as it gets here.
+static void make_stack(Gen* g, int count) {
+  unsigned seed = 4;
+  int i;
+
+  gen_init(g, count + 1, 2);
+  g->maxDepth = 16;
+  for (i = 0; i < count; i++) {
+    double a = 2 * M_PI * i / count;
+    Obj* s = gen_sphere(g, 2.5 * cos(a), 1.5 * sin(a), 8 + sin(3 * a), 0.9, &seed);
+    s->reflectivity = 0.45;
+    s->refractivity = 0.45;
+    s->refracIndex = 1.5;
+  }
+  Obj* floor = gen_floor(g, -2.5);
+  floor->reflectivity = 0.5;
+  gen_light(g, 0, 6, 2, 6);
+  gen_light(g, -5, 2, 0, 3);
+}
+
+typedef struct {
+  const char* name;
+  void (*make)(Gen* g, int count);
+  int defaultCount;
+} SceneKind;
+
+static const SceneKind kinds[] = {
+  {"grid", make_grid, 4096},
+  {"cloud", make_cloud, 100000},
+  {"lights", make_lights, 64},
+  {"stack", make_stack, 12},
+  {"city", make_city, 4096},
+};
+
+#define KIND_COUNT (int)(sizeof(kinds) / sizeof(kinds[0]))
+
+// Parses "name" or "name:count".
+static const SceneKind* parse_scene(char* arg, int* count) {
+  char* colon = strchr(arg, ':');
+  size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+  int k;
+
+  for (k = 0; k < KIND_COUNT; k++) {
+    if (strlen(kinds[k].name) == len && strncmp(kinds[k].name, arg, len) == 0) {
+      *count = colon ? atoi(colon + 1) : kinds[k].defaultCount;
+      if (*count < 1) {
+        fprintf(stderr, "Error: Scene \"%s\" needs a positive count.\n", arg);
+        exit(1);
+      }
+      return &kinds[k];
+    }
+  }
+  fprintf(stderr, "Error: Unknown scene \"%s\". Use grid, cloud, lights, stack or city.\n", arg);
+  exit(1);
+}
+
+static void emit_vec(const char* key, double* v) {
+  printf(", \"%s\": [%.17g, %.17g, %.17g]", key, v[0], v[1], v[2]);
+}
+
+// Writes the generated scene as JSON that main can read.
+static void emit(Gen* g) {
+  int i;
+
+  printf("[{\"type\": \"camera\", \"width\": %g, \"height\": %g, \"max_depth\": %d}",
+    g->objs[0]->Camera.width, g->objs[0]->Camera.height, g->maxDepth);
+  for (i = 1; i < g->objCount; i++) {
+    Obj* o = g->objs[i];
+    if (o->type == 1) {
+      printf(",\n{\"type\": \"sphere\", \"radius\": %.17g", o->Sphere.radius);
+      emit_vec("position", o->Sphere.position);
+    } else {
+      printf(",\n{\"type\": \"plane\"");
+      emit_vec("normal", o->Plane.normal);
+      emit_vec("position", o->Plane.position);
+    }
+    emit_vec("diffuse_color", o->diffuse);
+    emit_vec("specular_color", o->specular);
+    printf(", \"reflectivity\": %g, \"refractivity\": %g, \"ior\": %g}",
+      o->reflectivity, o->refractivity, o->refracIndex);
+  }
+  for (i = 0; i < g->lightCount; i++) {
+    Obj* l = g->light[i];
+    printf(",\n{\"type\": \"light\", \"radial-a0\": %g, \"radial-a1\": %g, \"radial-a2\": %g",
+      l->Light.radial_a0, l->Light.radial_a1, l->Light.radial_a2);
+    emit_vec("color", l->diffuse);
+    emit_vec("position", l->Light.position);
+    printf("}");
+  }
+  printf("]\n");
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+  int width;
+  int height;
+  int maxThreads;
+  FILE* out;
+  int first;
+} Suite;
+
+// Thread counts double from 1, ending on the largest one asked for even
+// when that isn't a power of two.
+static int next_threads(int threads, int max) {
+  if (threads < max && threads * 2 > max) {
+    return max;
+  }
+  return threads * 2;
+}
+
+// Builds and renders one scene at every thread count. Runs in a child
+// process; the JSON record goes to suite->out, which the parent finishes
+// with the child's peak RSS.
+static void run_scene(Suite* suite, const SceneKind* kind, int count) {
+  Gen g;
+  Scene scene;
+  RenderOptions opts;
+  double base = 0;
+  int threads;
+
+  double start = now();
+  kind->make(&g, count);
+  scene.objs = g.objs;
+  scene.light = g.light;
+  scene_validate(scene.objs, scene.light);
+  scene.bvh = bvh_build(scene.objs);
+  scene_build(&scene);
+  double build = now() - start;
+
+  opts.workers = 0;
+  opts.gbuffer = NULL;
+  opts.reshade = 0;
+  opts.wavefront = 0;
+  opts.binning = 0;
+  opts.lightCutoff = DEFAULT_LIGHT_CUTOFF;
+  opts.packets = packet_kernel("auto");
+  opts.maxDepth = g.maxDepth;
+  opts.minWeight = DEFAULT_MIN_WEIGHT;
+
+  fprintf(suite->out, "    {\"scene\": \"%s\", \"count\": %d, \"objects\": %d, \"lights\": %d, "
+    "\"build_seconds\": %.6f, \"runs\": [", kind->name, count, g.objCount - 1, g.lightCount, build);
+  for (threads = 1; threads <= suite->maxThreads; threads = next_threads(threads, suite->maxThreads)) {
+    opts.threads = threads;
+    start = now();
+    Color* buff = sceneMaker(&scene, suite->height, suite->width, &opts);
+    double seconds = now() - start;
+    free(buff);
+    if (threads == 1) {
+      base = seconds;
+    }
+
+    long primary = (long)suite->width * suite->height;
+    long rays = primary + opts.rays.traced + opts.rays.shadow;
+    double mrays = rays / seconds / 1e6;
+    printf("%-7s %8d %3d thr %8.3f s %8.2f Mrays/s %6.2fx  (%ld primary, %ld secondary, %ld shadow)\n",
+      kind->name, count, threads, seconds, mrays, base / seconds, primary, opts.rays.traced, opts.rays.shadow);
+    fprintf(suite->out, "%s\n      {\"threads\": %d, \"seconds\": %.6f, \"mrays_per_second\": %.4f, "
+      "\"speedup\": %.4f, \"primary_rays\": %ld, \"secondary_rays\": %ld, \"shadow_rays\": %ld}",
+      threads == 1 ? "" : ",", threads, seconds, mrays, base / seconds, primary, opts.rays.traced,
+      opts.rays.shadow);
+  }
+  fprintf(suite->out, "\n    ]");
+  fflush(suite->out);
+}
+
+int main(int argc, char* argv[]) {
+  Suite suite;
+  char* outName = "bench_results.json";
+  char* scenes[64];
+  int sceneCount = 0;
+  int i;
+
+  suite.width = 320;
+  suite.height = 240;
+  suite.maxThreads = tile_thread_count(0);
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc) {
+      Gen g;
+      int count;
+      const SceneKind* kind = parse_scene(argv[++i], &count);
+      kind->make(&g, count);
+      emit(&g);
+      return 0;
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &suite.width, &suite.height) != 2 ||
+          suite.width < 1 || suite.height < 1) {
+        fprintf(stderr, "Error: --size wants WIDTHxHEIGHT.\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      suite.maxThreads = tile_thread_count(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+      outName = argv[++i];
+    } else if (argv[i][0] != '-' && sceneCount < 64) {
+      scenes[sceneCount++] = argv[i];
+    } else {
+      fprintf(stderr, "Usage: %s [--size WxH] [--threads N] [--out file] [scene[:count] ...]\n"
+        "       %s --emit scene[:count]\n", argv[0], argv[0]);
+      return 1;
+    }
+  }
+  if (sceneCount == 0) {
+    for (i = 0; i < KIND_COUNT; i++) {
+      scenes[sceneCount++] = (char*)kinds[i].name;
+    }
+  }
+
+  suite.out = fopen(outName, "w");
+  if (suite.out == NULL) {
+    fprintf(stderr, "Error: Failed to open file %s\n", outName);
+    return 1;
+  }
+
+  // Naming the kernel packet_kernel("auto") settles on.
+  static char* kernelNames[] = {"avx2", "sse2", "scalar"};
+  char* kernelName = "scalar";
+  for (i = 0; i < 3; i++) {
+    if (packet_kernel(kernelNames[i]) == packet_kernel("auto")) {
+      kernelName = kernelNames[i];
+      break;
+    }
+  }
+  printf("%dx%d, up to %d threads, %s packets, %s\n", suite.width, suite.height, suite.maxThreads,
+    kernelName, REAL_NAME);
+  fprintf(suite.out, "{\n  \"timestamp\": %ld,\n  \"width\": %d,\n  \"height\": %d,\n"
+    "  \"cores\": %d,\n  \"packets\": \"%s\",\n  \"precision\": \"%s\",\n  \"scenes\": [\n",
+    (long)time(NULL), suite.width, suite.height, tile_thread_count(0), kernelName, REAL_NAME);
+
+  int failed = 0;
+  for (i = 0; i < sceneCount; i++) {
+    long peak = 0;
+    int count;
+    const SceneKind* kind = parse_scene(scenes[i], &count);
+    struct rusage usage;
+    int status;
+
+    if (i > 0) {
+      fprintf(suite.out, ",\n");
+    }
+    fflush(stdout);
+    fflush(suite.out);
+    // Where this scene's record starts, so a child that dies halfway
+    // through writing it can be cut back out.
+    off_t start = ftello(suite.out);
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "Error: Could not start a benchmark process.\n");
+      return 1;
+    }
+    if (pid == 0) {
+      run_scene(&suite, kind, count);
+      fflush(stdout);
+      _exit(0);
+    }
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Error: Benchmark of \"%s\" failed.\n", scenes[i]);
+      if (ftruncate(fileno(suite.out), start) != 0 || fseeko(suite.out, start, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: Failed to write %s\n", outName);
+        return 1;
+      }
+      fprintf(suite.out, "    {\"scene\": \"%s\", \"failed\": true", kind->name);
+      failed = 1;
+    } else {
+      peak = usage.ru_maxrss;
+      printf("%-7s peak RSS %ld KiB\n", kind->name, peak);
+    }
+    // The child wrote through its own copy of the stream; catch up with it.
+    fseek(suite.out, 0, SEEK_END);
+    fprintf(suite.out, ", \"peak_rss_kib\": %ld}", peak);
+  }
+  fprintf(suite.out, "\n  ]\n}\n");
+  fclose(suite.out);
+  printf("Results written to %s\n", outName);
+  return failed;
+}
@@ -0,0 +1,232 @@
+#include "header.h"
+
+// Screen-space binning of the spheres for primary rays. Every primary ray
+// leaves the eye, so a sphere can only be hit by the pixels its outline
+// covers on the image plane. Before the frame renders, each sphere's outline
+// is bounded and the sphere is listed in every bin of BIN_SIZE x BIN_SIZE
+// pixels the bound touches. A primary ray then tests the planes and its own
+// bin's list instead of the whole scene or the BVH. Meshes aren't binned,
+// their instances go through their own trees after the planes.
+//
+// Each list is ordered by how near its spheres can come to the eye, so a
+// ray stops as soon as the next sphere can't be closer than its hit. Hits
+// come out as rayCast() without a BVH finds them: the nearest, and on a tie
+// the lowest sphere number, with a plane kept over a sphere at the same t
+// and a sphere over a triangle.
+
+#define BIN_SIZE 4
+
+// The outlines are padded by this many pixels, and the near distances
+// lowered by this fraction, so rounding never drops a sphere a ray hits.
+#define BIN_PAD 1
+#define BIN_NEAR_SLACK 1e-4
+
+// A sphere's entry while the lists are built.
+typedef struct {
+  double near;
+  int prim;
+  int bx0, by0, bx1, by1;  // bins covered, inclusive; bx0 > bx1 for none
+} BinSphere;
+
+static void* bins_array(size_t size) {
+  void* a = malloc(size > 0 ? size : 1);
+  if (a == NULL) {
+    fprintf(stderr, "Error: Out of memory while binning the spheres.\n");
+    exit(1);
+  }
+  return a;
+}
+
+static int near_order(const void* a, const void* b) {
+  const BinSphere* sa = a;
+  const BinSphere* sb = b;
+  if (sa->near != sb->near) return sa->near < sb->near ? -1 : 1;
+  return sa->prim - sb->prim;
+}
+
+// Range of x / z over a circle of radius r at (x, z), given z > r: the
+// slopes of the two tangents from the origin.
+static void tangent_range(double x, double z, double r, double* lo, double* hi) {
+  double den = z * z - r * r;
+  double root = r * sqrt(x * x + den);
+  *lo = (x * z - root) / den;
+  *hi = (x * z + root) / den;
+}
+
+static int clamp_bin(double v, int count) {
+  if (v < 0) return 0;
+  if (v >= count) return count - 1;
+  return (int)v;
+}
+
+// Radius of every sphere, in render order.
+static double* sphere_radii(Scene* scene) {
+  double* radii = bins_array(sizeof(double) * scene->spheres.count);
+  int i, n = 0;
+
+  if (scene->bvh != NULL) {
+    for (i = 0; i < scene->bvh->primCount; i++) {
+      radii[i] = fabs(scene->objs[scene->bvh->prims[i]]->Sphere.radius);
+    }
+  } else {
+    for (i = 0; scene->objs[i] != NULL; i++) {
+      if (scene->objs[i]->type == 1) {
+        radii[n++] = fabs(scene->objs[i]->Sphere.radius);
+      }
+    }
+  }
+  return radii;
+}
+
+// Bins the spheres as the camera sees them for the pixels of region of a
+// width x height frame. Spheres outside the region are left out.
+ScreenBins* bins_build(Scene* scene, int height, int width, Tile* region) {
+  SphereSet* s = &scene->spheres;
+  View* view = &scene->view;
+  double camW = scene->objs[0]->Camera.width;
+  double camH = scene->objs[0]->Camera.height;
+  double imgW = camW / width;
+  double imgH = camH / height;
+  int i, a, bx, by;
+
+  ScreenBins* bins = bins_array(sizeof(ScreenBins));
+  bins->x0 = region->x0;
+  bins->y0 = region->y0;
+  bins->cols = (region->x1 - region->x0 + BIN_SIZE - 1) / BIN_SIZE;
+  bins->rows = (region->y1 - region->y0 + BIN_SIZE - 1) / BIN_SIZE;
+  int binCount = bins->cols * bins->rows;
+
+  double* radii = sphere_radii(scene);
+  BinSphere* order = bins_array(sizeof(BinSphere) * s->count);
+  int n = 0;
+  for (i = 0; i < s->count; i++) {
+    double c[3] = {s->cx[i] - view->eye[0], s->cy[i] - view->eye[1], s->cz[i] - view->eye[2]};
+    double x = 0, y = 0, z = 0, r = radii[i];
+    for (a = 0; a < 3; a++) {
+      x += c[a] * view->right[a];
+      y += c[a] * view->up[a];
+      z += c[a] * view->forward[a];
+    }
+    // Primary rays only go forward, so a sphere wholly behind the eye
+    // can't be hit.
+    if (z + r < 0) {
+      continue;
+    }
+
+    BinSphere* b = &order[n];
+    b->prim = i;
+    b->near = (sqrt(x * x + y * y + z * z) - r) * (1 - BIN_NEAR_SLACK);
+    if (b->near < 0) {
+      b->near = 0;
+    }
+    if (z * z - r * r <= 1e-9 * z * z || z <= r) {
+      // Reaching back to the eye's plane, its outline is unbounded.
+      b->bx0 = 0;
+      b->by0 = 0;
+      b->bx1 = bins->cols - 1;
+      b->by1 = bins->rows - 1;
+    } else {
+      // Image plane coordinates to region pixels, as primaryRay() maps
+      // pixel centers the other way.
+      double sx0, sx1, sy0, sy1;
+      tangent_range(x, z, r, &sx0, &sx1);
+      tangent_range(y, z, r, &sy0, &sy1);
+      double px0 = (sx0 + camW / 2) / imgW - 0.5 - BIN_PAD - region->x0;
+      double px1 = (sx1 + camW / 2) / imgW - 0.5 + BIN_PAD - region->x0;
+      double py0 = (camH / 2 - sy1) / imgH - 0.5 - BIN_PAD - region->y0;
+      double py1 = (camH / 2 - sy0) / imgH - 0.5 + BIN_PAD - region->y0;
+      if (px1 < 0 || py1 < 0 || px0 >= bins->cols * BIN_SIZE || py0 >= bins->rows * BIN_SIZE) {
+        continue;
+      }
+      b->bx0 = clamp_bin(px0 / BIN_SIZE, bins->cols);
+      b->bx1 = clamp_bin(px1 / BIN_SIZE, bins->cols);
+      b->by0 = clamp_bin(py0 / BIN_SIZE, bins->rows);
+      b->by1 = clamp_bin(py1 / BIN_SIZE, bins->rows);
+    }
+    n++;
+  }
+  free(radii);
+
+  // Filling the lists from spheres sorted by near distance leaves every
+  // list sorted too.
+  qsort(order, n, sizeof(BinSphere), near_order);
+  bins->start = bins_array(sizeof(int) * (binCount + 1));
+  memset(bins->start, 0, sizeof(int) * (binCount + 1));
+  for (i = 0; i < n; i++) {
+    for (by = order[i].by0; by <= order[i].by1; by++) {
+      for (bx = order[i].bx0; bx <= order[i].bx1; bx++) {
+        bins->start[by * bins->cols + bx + 1]++;
+      }
+    }
+  }
+  for (i = 0; i < binCount; i++) {
+    bins->start[i + 1] += bins->start[i];
+  }
+
+  int entries = bins->start[binCount];
+  int* fill = bins_array(sizeof(int) * binCount);
+  memcpy(fill, bins->start, sizeof(int) * binCount);
+  bins->prims = bins_array(sizeof(int) * entries);
+  bins->near = bins_array(sizeof(real) * entries);
+  for (i = 0; i < n; i++) {
+    for (by = order[i].by0; by <= order[i].by1; by++) {
+      for (bx = order[i].bx0; bx <= order[i].bx1; bx++) {
+        int at = fill[by * bins->cols + bx]++;
+        bins->prims[at] = order[i].prim;
+        bins->near[at] = order[i].near;
+      }
+    }
+  }
+  free(fill);
+  free(order);
+  return bins;
+}
+
+void bins_free(ScreenBins* bins) {
+  if (bins == NULL) {
+    return;
+  }
+  free(bins->start);
+  free(bins->prims);
+  free(bins->near);
+  free(bins);
+}
+
+// rayCast() for the primary ray Rd from the eye through pixel (x, y) of
+// the frame.
+int bins_cast(ScreenBins* bins, Scene* scene, int x, int y, real* Ro, real* Rd, real* t) {
+  PlaneSet* planes = &scene->planes;
+  SphereSet* spheres = &scene->spheres;
+  real tNew = INFINITY, tVal;
+  int best = -1;
+  int i;
+
+  threadRays.planeTests += planes->count;
+  for (i = 0; i < planes->count; i++) {
+    tVal = plane_intersection(planes, i, Ro, Rd);
+    if (tVal < tNew && tVal != -1) {
+      tNew = tVal;
+      best = spheres->count + i;
+    }
+  }
+  bvh_cast_instances(scene, -1, Ro, Rd, &tNew, &best);
+
+  int bin = ((y - bins->y0) / BIN_SIZE) * bins->cols + (x - bins->x0) / BIN_SIZE;
+  int end = bins->start[bin + 1];
+  for (i = bins->start[bin]; i < end && bins->near[i] <= tNew; i++) {
+    int prim = bins->prims[i];
+    threadRays.sphereTests++;
+    tVal = sphere_intersection(spheres, prim, Ro, Rd);
+    if (tVal == -1) {
+      continue;
+    }
+    if (tVal < tNew || (tVal == tNew && (best < spheres->count ? prim < best :
+        prim_is_triangle(scene, best)))) {
+      tNew = tVal;
+      best = prim;
+    }
+  }
+
+  *t = (best < 0) ? -1 : tNew;
+  return best;
+}
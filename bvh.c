@@ -0,0 +1,719 @@
+#include "header.h"
+
+// Leaves hold at most this many primitives, spheres and triangles being
+// cheap to test next to each other. An instance is a whole tree of its own,
+// so those get a leaf each.
+#define BVH_LEAF_SIZE 4
+
+// Number of buckets used when searching for a split.
+#define BVH_BINS 12
+
+typedef struct {
+  double min[3];
+  double max[3];
+  double center[3];
+} BuildPrim;
+
+static void bounds_empty(double* min, double* max) {
+  min[0] = min[1] = min[2] = INFINITY;
+  max[0] = max[1] = max[2] = -INFINITY;
+}
+
+static void bounds_grow(double* min, double* max, double* pmin, double* pmax) {
+  int a;
+  for (a = 0; a < 3; a++) {
+    if (pmin[a] < min[a]) min[a] = pmin[a];
+    if (pmax[a] > max[a]) max[a] = pmax[a];
+  }
+}
+
+static double bounds_area(double* min, double* max) {
+  double dx = max[0] - min[0];
+  double dy = max[1] - min[1];
+  double dz = max[2] - min[2];
+  if (dx < 0 || dy < 0 || dz < 0) {
+    return 0;
+  }
+  return dx * dy + dy * dz + dz * dx;
+}
+
+// Stores a box in a node. Rounding to a float build's reals goes outward,
+// so the box never ends up smaller than the spheres it holds.
+static void node_bounds(BvhNode* n, double* min, double* max) {
+  int a;
+  for (a = 0; a < 3; a++) {
+    n->min[a] = (real)min[a];
+    n->max[a] = (real)max[a];
+    if (n->min[a] > min[a]) n->min[a] = real_nextafter(n->min[a], -INFINITY);
+    if (n->max[a] < max[a]) n->max[a] = real_nextafter(n->max[a], INFINITY);
+  }
+}
+
+static void swap_prims(BuildPrim* info, int* prims, int a, int b) {
+  BuildPrim tmpInfo = info[a];
+  int tmp = prims[a];
+  info[a] = info[b];
+  info[b] = tmpInfo;
+  prims[a] = prims[b];
+  prims[b] = tmp;
+}
+
+// Picks the split with the lowest surface area cost over BVH_BINS buckets
+// along the widest centroid axis. Returns the index of the first primitive
+// of the right half, or -1 when no split beats keeping the leaf.
+static int split_sah(BuildPrim* info, int* prims, int start, int end,
+  double* cmin, double* cmax, int axis) {
+  double binMin[BVH_BINS][3], binMax[BVH_BINS][3];
+  int binCount[BVH_BINS] = {0};
+  double rightArea[BVH_BINS];
+  int rightCount[BVH_BINS];
+  double extent = cmax[axis] - cmin[axis];
+  double min[3], max[3];
+  double bestCost = INFINITY;
+  int best = -1;
+  int count = 0;
+  int i, b;
+
+  for (b = 0; b < BVH_BINS; b++) {
+    bounds_empty(binMin[b], binMax[b]);
+  }
+  for (i = start; i < end; i++) {
+    b = (int)(BVH_BINS * (info[i].center[axis] - cmin[axis]) / extent);
+    if (b >= BVH_BINS) b = BVH_BINS - 1;
+    binCount[b]++;
+    bounds_grow(binMin[b], binMax[b], info[i].min, info[i].max);
+  }
+
+  bounds_empty(min, max);
+  for (b = BVH_BINS - 1; b > 0; b--) {
+    bounds_grow(min, max, binMin[b], binMax[b]);
+    count += binCount[b];
+    rightArea[b] = bounds_area(min, max);
+    rightCount[b] = count;
+  }
+
+  bounds_empty(min, max);
+  count = 0;
+  for (b = 0; b < BVH_BINS - 1; b++) {
+    bounds_grow(min, max, binMin[b], binMax[b]);
+    count += binCount[b];
+    double cost = count * bounds_area(min, max) + rightCount[b + 1] * rightArea[b + 1];
+    if (count > 0 && rightCount[b + 1] > 0 && cost < bestCost) {
+      bestCost = cost;
+      best = b;
+    }
+  }
+
+  if (best < 0) {
+    return -1;
+  }
+
+  // Partitioning the range around the chosen bucket boundary.
+  int mid = start;
+  for (i = start; i < end; i++) {
+    b = (int)(BVH_BINS * (info[i].center[axis] - cmin[axis]) / extent);
+    if (b >= BVH_BINS) b = BVH_BINS - 1;
+    if (b <= best) {
+      swap_prims(info, prims, i, mid++);
+    }
+  }
+  return mid;
+}
+
+// Splits the range in half by centroid along the given axis.
+static int split_median(BuildPrim* info, int* prims, int start, int end, int axis) {
+  int lo = start, hi = end - 1;
+  int mid = start + (end - start) / 2;
+
+  // Quickselect the median centroid into place.
+  while (lo < hi) {
+    double pivot = info[(lo + hi) / 2].center[axis];
+    int i = lo, j = hi;
+    while (i <= j) {
+      while (info[i].center[axis] < pivot) i++;
+      while (info[j].center[axis] > pivot) j--;
+      if (i <= j) {
+        swap_prims(info, prims, i++, j--);
+      }
+    }
+    if (mid <= j) {
+      hi = j;
+    } else if (mid >= i) {
+      lo = i;
+    } else {
+      break;
+    }
+  }
+  return mid;
+}
+
+static int build_node(Bvh* bvh, BuildPrim* info, int node, int start, int end, int depth,
+  int leafSize) {
+  BvhNode* n = &bvh->nodes[node];
+  double min[3], max[3], cmin[3], cmax[3];
+  int i, axis = 0;
+
+  bounds_empty(min, max);
+  bounds_empty(cmin, cmax);
+  for (i = start; i < end; i++) {
+    bounds_grow(min, max, info[i].min, info[i].max);
+    bounds_grow(cmin, cmax, info[i].center, info[i].center);
+  }
+  node_bounds(n, min, max);
+
+  n->start = start;
+  n->count = end - start;
+  if (n->count <= leafSize) {
+    return depth;
+  }
+
+  for (i = 1; i < 3; i++) {
+    if (cmax[i] - cmin[i] > cmax[axis] - cmin[axis]) {
+      axis = i;
+    }
+  }
+
+  int mid = -1;
+  if (cmax[axis] > cmin[axis] && depth < BVH_MAX_DEPTH) {
+    mid = split_sah(info, bvh->prims, start, end, cmin, cmax, axis);
+  }
+  if (mid < 0) {
+    mid = split_median(info, bvh->prims, start, end, axis);
+  }
+
+  // Children are stored next to each other so a node only needs one index.
+  int left = bvh->nodeCount;
+  bvh->nodeCount += 2;
+  n->start = left;
+  n->count = 0;
+
+  int dl = build_node(bvh, info, left, start, mid, depth + 1, leafSize);
+  int dr = build_node(bvh, info, left + 1, mid, end, depth + 1, leafSize);
+  return dl > dr ? dl : dr;
+}
+
+static Bvh* bvh_alloc(int count) {
+  Bvh* bvh = malloc(sizeof(Bvh));
+  if (bvh != NULL) {
+    bvh->primCount = count;
+    bvh->prims = malloc(sizeof(int) * (count > 0 ? count : 1));
+    bvh->nodes = malloc(sizeof(BvhNode) * (count > 0 ? 2 * count - 1 : 1));
+    bvh->nodeCount = 1;
+    bvh->mapped = 0;
+  }
+  if (bvh == NULL || bvh->prims == NULL || bvh->nodes == NULL) {
+    fprintf(stderr, "Error: Out of memory while building the BVH.\n");
+    exit(1);
+  }
+  return bvh;
+}
+
+// Builds the tree over the count primitives described by info, reordering
+// bvh->prims along with them.
+static void build_tree(Bvh* bvh, BuildPrim* info, int count, int leafSize) {
+  if (count > 0) {
+    bvh->depth = build_node(bvh, info, 0, 0, count, 0, leafSize);
+  } else {
+    bvh->depth = 0;
+    bvh->nodes[0].count = 0;
+    bvh->nodes[0].start = 0;
+    double min[3], max[3];
+    bounds_empty(min, max);
+    node_bounds(&bvh->nodes[0], min, max);
+  }
+}
+
+// Builds the hierarchy over every sphere in objs. Planes have no bounds, so
+// they stay out of the tree and rayCast() tests them against every ray.
+Bvh* bvh_build(Obj** objs) {
+  int i, count = 0;
+
+  for (i = 0; objs[i] != NULL; i++) {
+    if (objs[i]->type == 1) {
+      count++;
+    }
+  }
+
+  Bvh* bvh = bvh_alloc(count);
+  BuildPrim* info = malloc(sizeof(BuildPrim) * (count > 0 ? count : 1));
+  count = 0;
+  for (i = 0; objs[i] != NULL; i++) {
+    if (objs[i]->type == 1) {
+      double* pos = objs[i]->Sphere.position;
+      double r = fabs(objs[i]->Sphere.radius);
+      int a;
+      for (a = 0; a < 3; a++) {
+        info[count].min[a] = pos[a] - r;
+        info[count].max[a] = pos[a] + r;
+        info[count].center[a] = pos[a];
+      }
+      bvh->prims[count++] = i;
+    }
+  }
+
+  build_tree(bvh, info, count, BVH_LEAF_SIZE);
+  free(info);
+  return bvh;
+}
+
+// Builds a mesh's hierarchy over its count triangles. prims comes back
+// holding the triangle numbers in leaf order, for the caller to lay the
+// index array out by.
+Bvh* bvh_build_triangles(real* verts, uint32_t* index, int count) {
+  Bvh* bvh = bvh_alloc(count);
+  BuildPrim* info = malloc(sizeof(BuildPrim) * (count > 0 ? count : 1));
+  int i, a, k;
+
+  if (info == NULL) {
+    fprintf(stderr, "Error: Out of memory while building the BVH.\n");
+    exit(1);
+  }
+  for (i = 0; i < count; i++) {
+    bounds_empty(info[i].min, info[i].max);
+    for (k = 0; k < 3; k++) {
+      real* v = &verts[3 * (size_t)index[3 * (size_t)i + k]];
+      double p[3] = {v[0], v[1], v[2]};
+      bounds_grow(info[i].min, info[i].max, p, p);
+    }
+    for (a = 0; a < 3; a++) {
+      info[i].center[a] = (info[i].min[a] + info[i].max[a]) / 2;
+    }
+    bvh->prims[i] = i;
+  }
+
+  build_tree(bvh, info, count, BVH_LEAF_SIZE);
+  free(info);
+  return bvh;
+}
+
+// Builds a tree with one primitive per leaf over count boxes, each six
+// numbers in bounds: the low corner, then the high one. prims comes back
+// holding the box numbers in leaf order.
+Bvh* bvh_build_boxes(double* bounds, int count) {
+  Bvh* bvh = bvh_alloc(count);
+  BuildPrim* info = malloc(sizeof(BuildPrim) * (count > 0 ? count : 1));
+  int i, a;
+
+  if (info == NULL) {
+    fprintf(stderr, "Error: Out of memory while building the BVH.\n");
+    exit(1);
+  }
+  for (i = 0; i < count; i++) {
+    for (a = 0; a < 3; a++) {
+      info[i].min[a] = bounds[6 * (size_t)i + a];
+      info[i].max[a] = bounds[6 * (size_t)i + 3 + a];
+      info[i].center[a] = (info[i].min[a] + info[i].max[a]) / 2;
+    }
+    bvh->prims[i] = i;
+  }
+
+  build_tree(bvh, info, count, 1);
+  free(info);
+  return bvh;
+}
+
+void bvh_free(Bvh* bvh) {
+  if (bvh == NULL) {
+    return;
+  }
+  if (!bvh->mapped) {
+    free(bvh->nodes);
+    free(bvh->prims);
+  }
+  free(bvh);
+}
+
+// Whether nodeCount nodes read from a file make a tree the traversals can
+// walk over primCount primitives: leaves in range, children after their
+// parent and inside the array, and no deeper than the traversal stacks.
+// Children come after their parent, so one pass in order knows every
+// node's depth before reaching it.
+int bvh_nodes_valid(BvhNode* nodes, uint32_t nodeCount, uint32_t primCount) {
+  uint32_t i;
+  int ok = 1;
+
+  if (nodeCount == 0) {
+    return 0;
+  }
+  if (primCount == 0) {
+    return 1;
+  }
+  int* depth = malloc(sizeof(int) * nodeCount);
+  if (depth == NULL) {
+    fprintf(stderr, "Error: Out of memory while checking the BVH.\n");
+    exit(1);
+  }
+  depth[0] = 0;
+  for (i = 0; i < nodeCount && ok; i++) {
+    BvhNode* n = &nodes[i];
+    if (n->count > 0) {
+      ok = n->start >= 0 && (uint32_t)n->start + (uint32_t)n->count <= primCount;
+    } else {
+      ok = n->start >= 0 && (uint32_t)n->start > i && (uint32_t)n->start + 1 < nodeCount &&
+        depth[i] + 1 < BVH_STACK_SIZE;
+      if (ok) {
+        depth[n->start] = depth[n->start + 1] = depth[i] + 1;
+      }
+    }
+  }
+  free(depth);
+  return ok;
+}
+
+// Recomputes every box after spheres have moved, keeping the tree's shape.
+// Much cheaper than a rebuild, though the tree gets looser the further the
+// spheres stray from where it was built. Children always come after their
+// parent, so walking the nodes backwards finishes both children of a node
+// before the node itself. A tree mapped from a compiled scene is copied
+// first, since the mapping is read only.
+void bvh_refit(Scene* scene) {
+  Bvh* bvh = scene->bvh;
+  SphereSet* s = &scene->spheres;
+  int i, j;
+
+  if (bvh == NULL || bvh->primCount == 0) {
+    return;
+  }
+  if (bvh->mapped) {
+    BvhNode* nodes = malloc(sizeof(BvhNode) * bvh->nodeCount);
+    int* prims = malloc(sizeof(int) * bvh->primCount);
+    if (nodes == NULL || prims == NULL) {
+      fprintf(stderr, "Error: Out of memory while refitting the BVH.\n");
+      exit(1);
+    }
+    memcpy(nodes, bvh->nodes, sizeof(BvhNode) * bvh->nodeCount);
+    memcpy(prims, bvh->prims, sizeof(int) * bvh->primCount);
+    bvh->nodes = nodes;
+    bvh->prims = prims;
+    bvh->mapped = 0;
+  }
+
+  for (i = bvh->nodeCount - 1; i >= 0; i--) {
+    BvhNode* n = &bvh->nodes[i];
+    double min[3], max[3];
+    bounds_empty(min, max);
+    if (n->count > 0) {
+      for (j = n->start; j < n->start + n->count; j++) {
+        double r = fabs(scene->objs[bvh->prims[j]]->Sphere.radius);
+        double c[3] = {s->cx[j], s->cy[j], s->cz[j]};
+        double pmin[3] = {c[0] - r, c[1] - r, c[2] - r};
+        double pmax[3] = {c[0] + r, c[1] + r, c[2] + r};
+        bounds_grow(min, max, pmin, pmax);
+      }
+    } else {
+      int a;
+      for (j = n->start; j < n->start + 2; j++) {
+        double cmin[3], cmax[3];
+        for (a = 0; a < 3; a++) {
+          cmin[a] = bvh->nodes[j].min[a];
+          cmax[a] = bvh->nodes[j].max[a];
+        }
+        bounds_grow(min, max, cmin, cmax);
+      }
+    }
+    node_bounds(n, min, max);
+  }
+}
+
+// Slab test. Returns the entry distance, or INFINITY when the box is missed
+// or lies entirely beyond tMax. A ray with a NaN direction misses every box,
+// rather than getting every leaf tested.
+static inline real box_hit(BvhNode* n, real* Ro, real* invRd, real tMax) {
+  real t0 = (n->min[0] - Ro[0]) * invRd[0];
+  real t1 = (n->max[0] - Ro[0]) * invRd[0];
+  real tNear = real_fmin(t0, t1);
+  real tFar = real_fmax(t0, t1);
+
+  t0 = (n->min[1] - Ro[1]) * invRd[1];
+  t1 = (n->max[1] - Ro[1]) * invRd[1];
+  tNear = real_fmax(tNear, real_fmin(t0, t1));
+  tFar = real_fmin(tFar, real_fmax(t0, t1));
+
+  t0 = (n->min[2] - Ro[2]) * invRd[2];
+  t1 = (n->max[2] - Ro[2]) * invRd[2];
+  tNear = real_fmax(tNear, real_fmin(t0, t1));
+  tFar = real_fmin(tFar, real_fmax(t0, t1));
+
+  if (!(tFar >= tNear) || tFar < 0 || tNear > tMax) {
+    return INFINITY;
+  }
+  return tNear;
+}
+
+// Closest hit over the spheres through the hierarchy. tBest and best come
+// in holding the closest hit found so far (the planes) and are narrowed in
+// place.
+void bvh_cast(Scene* scene, int skip, real* Ro, real* Rd, real* tBest, int* best) {
+  Bvh* bvh = scene->bvh;
+  SphereSet* spheres = &scene->spheres;
+  real tVal;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  int i;
+
+  if (bvh->primCount == 0) {
+    return;
+  }
+
+  real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+
+  threadRays.boxTests++;
+  if (box_hit(&bvh->nodes[0], Ro, invRd, *tBest) != INFINITY) {
+    stack[top++] = 0;
+  }
+  while (top > 0) {
+    BvhNode* n = &bvh->nodes[stack[--top]];
+
+    if (n->count > 0) {
+      // Leaves are contiguous runs of the sphere arrays.
+      threadRays.sphereTests += n->count;
+      for (i = n->start; i < n->start + n->count; i++) {
+        tVal = sphere_intersection(spheres, i, Ro, Rd);
+        if (tVal < *tBest && tVal != -1 && i != skip) {
+          *tBest = tVal;
+          *best = i;
+        }
+      }
+      continue;
+    }
+
+    // Visiting the nearer child first so tBest shrinks early.
+    threadRays.boxTests += 2;
+    real tl = box_hit(&bvh->nodes[n->start], Ro, invRd, *tBest);
+    real tr = box_hit(&bvh->nodes[n->start + 1], Ro, invRd, *tBest);
+    if (tl <= tr) {
+      if (tr != INFINITY) stack[top++] = n->start + 1;
+      if (tl != INFINITY) stack[top++] = n->start;
+    } else {
+      if (tl != INFINITY) stack[top++] = n->start;
+      stack[top++] = n->start + 1;
+    }
+  }
+}
+
+// Any-hit query over the spheres. Returns 1 as soon as one sphere other than
+// skip is hit closer than maxT. Children are visited in stored order, since
+// any blocker will do.
+int bvh_occluded(Scene* scene, int skip, real* Ro, real* Rd, real maxT) {
+  Bvh* bvh = scene->bvh;
+  SphereSet* spheres = &scene->spheres;
+  real tVal;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  int i;
+
+  if (bvh->primCount == 0) {
+    return 0;
+  }
+
+  real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+
+  stack[top++] = 0;
+  while (top > 0) {
+    BvhNode* n = &bvh->nodes[stack[--top]];
+
+    threadRays.boxTests++;
+    if (box_hit(n, Ro, invRd, maxT) == INFINITY) {
+      continue;
+    }
+    if (n->count > 0) {
+      for (i = n->start; i < n->start + n->count; i++) {
+        threadRays.sphereTests++;
+        tVal = sphere_intersection(spheres, i, Ro, Rd);
+        if (tVal < maxT && tVal != -1 && i != skip) {
+          return 1;
+        }
+      }
+      continue;
+    }
+    stack[top++] = n->start + 1;
+    stack[top++] = n->start;
+  }
+  return 0;
+}
+
+// Closest hit over a mesh's triangles, narrowing tBest and best in place
+// like bvh_cast(). The mesh's triangles are numbered from firstPrim.
+void bvh_cast_mesh(Mesh* mesh, int firstPrim, int skip, real* Ro, real* Rd, real* tBest,
+  int* best) {
+  Bvh* bvh = mesh->bvh;
+  real tVal;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  int i;
+
+  if (mesh->triCount == 0) {
+    return;
+  }
+
+  real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+
+  threadRays.boxTests++;
+  if (box_hit(&bvh->nodes[0], Ro, invRd, *tBest) != INFINITY) {
+    stack[top++] = 0;
+  }
+  while (top > 0) {
+    BvhNode* n = &bvh->nodes[stack[--top]];
+
+    if (n->count > 0) {
+      threadRays.triangleTests += n->count;
+      for (i = n->start; i < n->start + n->count; i++) {
+        tVal = triangle_intersection(mesh, i, Ro, Rd);
+        if (tVal < *tBest && tVal != -1 && firstPrim + i != skip) {
+          *tBest = tVal;
+          *best = firstPrim + i;
+        }
+      }
+      continue;
+    }
+
+    threadRays.boxTests += 2;
+    real tl = box_hit(&bvh->nodes[n->start], Ro, invRd, *tBest);
+    real tr = box_hit(&bvh->nodes[n->start + 1], Ro, invRd, *tBest);
+    if (tl <= tr) {
+      if (tr != INFINITY) stack[top++] = n->start + 1;
+      if (tl != INFINITY) stack[top++] = n->start;
+    } else {
+      if (tl != INFINITY) stack[top++] = n->start;
+      stack[top++] = n->start + 1;
+    }
+  }
+}
+
+// Any-hit query over a mesh's triangles, like bvh_occluded().
+int bvh_occluded_mesh(Mesh* mesh, int firstPrim, int skip, real* Ro, real* Rd, real maxT) {
+  Bvh* bvh = mesh->bvh;
+  real tVal;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  int i;
+
+  if (mesh->triCount == 0) {
+    return 0;
+  }
+
+  real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+
+  stack[top++] = 0;
+  while (top > 0) {
+    BvhNode* n = &bvh->nodes[stack[--top]];
+
+    threadRays.boxTests++;
+    if (box_hit(n, Ro, invRd, maxT) == INFINITY) {
+      continue;
+    }
+    if (n->count > 0) {
+      for (i = n->start; i < n->start + n->count; i++) {
+        threadRays.triangleTests++;
+        tVal = triangle_intersection(mesh, i, Ro, Rd);
+        if (tVal < maxT && tVal != -1 && firstPrim + i != skip) {
+          return 1;
+        }
+      }
+      continue;
+    }
+    stack[top++] = n->start + 1;
+    stack[top++] = n->start;
+  }
+  return 0;
+}
+
+// The ray in the instance's mesh space. Rd isn't renormalized, so distances
+// along it are the same as along the world ray and hits compare directly.
+static inline void instance_ray(Instance* inst, real* Ro, real* Rd, real* oRo, real* oRd) {
+  real* m = inst->toObject;
+  int a;
+  for (a = 0; a < 3; a++) {
+    oRo[a] = m[4 * a] * Ro[0] + m[4 * a + 1] * Ro[1] + m[4 * a + 2] * Ro[2] + m[4 * a + 3];
+    oRd[a] = m[4 * a] * Rd[0] + m[4 * a + 1] * Rd[1] + m[4 * a + 2] * Rd[2];
+  }
+}
+
+// Closest hit over every mesh instance, narrowing tBest and best in place.
+// The top tree's leaves are single instances, whose meshes are searched
+// with the ray moved into their space.
+void bvh_cast_instances(Scene* scene, int skip, real* Ro, real* Rd, real* tBest, int* best) {
+  MeshSet* meshes = &scene->meshes;
+  Bvh* bvh = meshes->bvh;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+
+  if (meshes->instanceCount == 0) {
+    return;
+  }
+
+  real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+
+  threadRays.boxTests++;
+  if (box_hit(&bvh->nodes[0], Ro, invRd, *tBest) != INFINITY) {
+    stack[top++] = 0;
+  }
+  while (top > 0) {
+    BvhNode* n = &bvh->nodes[stack[--top]];
+
+    if (n->count > 0) {
+      Instance* inst = &meshes->instances[n->start];
+      if (inst->identity) {
+        bvh_cast_mesh(inst->mesh, inst->firstPrim, skip, Ro, Rd, tBest, best);
+      } else {
+        real oRo[3], oRd[3];
+        instance_ray(inst, Ro, Rd, oRo, oRd);
+        bvh_cast_mesh(inst->mesh, inst->firstPrim, skip, oRo, oRd, tBest, best);
+      }
+      continue;
+    }
+
+    threadRays.boxTests += 2;
+    real tl = box_hit(&bvh->nodes[n->start], Ro, invRd, *tBest);
+    real tr = box_hit(&bvh->nodes[n->start + 1], Ro, invRd, *tBest);
+    if (tl <= tr) {
+      if (tr != INFINITY) stack[top++] = n->start + 1;
+      if (tl != INFINITY) stack[top++] = n->start;
+    } else {
+      if (tl != INFINITY) stack[top++] = n->start;
+      stack[top++] = n->start + 1;
+    }
+  }
+}
+
+// Any-hit query over every mesh instance, like bvh_occluded().
+int bvh_occluded_instances(Scene* scene, int skip, real* Ro, real* Rd, real maxT) {
+  MeshSet* meshes = &scene->meshes;
+  Bvh* bvh = meshes->bvh;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+
+  if (meshes->instanceCount == 0) {
+    return 0;
+  }
+
+  real invRd[3] = {1 / Rd[0], 1 / Rd[1], 1 / Rd[2]};
+
+  stack[top++] = 0;
+  while (top > 0) {
+    BvhNode* n = &bvh->nodes[stack[--top]];
+
+    threadRays.boxTests++;
+    if (box_hit(n, Ro, invRd, maxT) == INFINITY) {
+      continue;
+    }
+    if (n->count > 0) {
+      Instance* inst = &meshes->instances[n->start];
+      int hit;
+      if (inst->identity) {
+        hit = bvh_occluded_mesh(inst->mesh, inst->firstPrim, skip, Ro, Rd, maxT);
+      } else {
+        real oRo[3], oRd[3];
+        instance_ray(inst, Ro, Rd, oRo, oRd);
+        hit = bvh_occluded_mesh(inst->mesh, inst->firstPrim, skip, oRo, oRd, maxT);
+      }
+      if (hit) {
+        return 1;
+      }
+      continue;
+    }
+    stack[top++] = n->start + 1;
+    stack[top++] = n->start;
+  }
+  return 0;
+}
@@ -0,0 +1,160 @@
+#include "header.h"
+
+// Saved G-buffers are a header and then the prim and t arrays as they sit
+// in memory. Reshading only makes sense against the geometry and camera
+// the buffer was rendered with, so the header carries a hash of both;
+// materials and lights are left out of it since they are what gets edited.
+#define GBUFFER_MAGIC "RTGB"
+#define GBUFFER_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t scalarSize;  // sizeof(real) of the build, which t uses
+  uint32_t width;
+  uint32_t height;
+  uint32_t pad;
+  uint64_t geometry;
+} GBufferHeader;
+
+GBuffer* gbuffer_create(int width, int height) {
+  GBuffer* g = malloc(sizeof(GBuffer));
+  size_t pixels = (size_t)width * height;
+  if (g != NULL) {
+    g->width = width;
+    g->height = height;
+    g->prim = malloc(sizeof(int) * pixels);
+    g->t = malloc(sizeof(real) * pixels);
+  }
+  if (g == NULL || g->prim == NULL || g->t == NULL) {
+    fprintf(stderr, "Error: Not enough memory for a %ix%i G-buffer.\n", width, height);
+    exit(1);
+  }
+  return g;
+}
+
+// FNV-1a, folding in size bytes at data.
+static uint64_t hash_bytes(uint64_t h, const void* data, size_t size) {
+  const unsigned char* p = data;
+  size_t i;
+  for (i = 0; i < size; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+// Everything that decides which primitive a primary ray hits and where.
+// The arrays are hashed in their render order, so a scene laid out for the
+// BVH doesn't match one laid out without it.
+static uint64_t geometry_hash(Scene* scene) {
+  SphereSet* s = &scene->spheres;
+  PlaneSet* p = &scene->planes;
+  MeshSet* meshes = &scene->meshes;
+  uint64_t h = 0xcbf29ce484222325ull;
+  int i;
+
+  h = hash_bytes(h, &scene->objs[0]->Camera.width, sizeof(double));
+  h = hash_bytes(h, &scene->objs[0]->Camera.height, sizeof(double));
+  h = hash_bytes(h, &scene->view, sizeof(View));
+  h = hash_bytes(h, &s->count, sizeof(int));
+  h = hash_bytes(h, s->cx, sizeof(real) * s->count);
+  h = hash_bytes(h, s->cy, sizeof(real) * s->count);
+  h = hash_bytes(h, s->cz, sizeof(real) * s->count);
+  h = hash_bytes(h, s->cc, sizeof(real) * s->count);
+  h = hash_bytes(h, &p->count, sizeof(int));
+  h = hash_bytes(h, p->nx, sizeof(real) * p->count);
+  h = hash_bytes(h, p->ny, sizeof(real) * p->count);
+  h = hash_bytes(h, p->nz, sizeof(real) * p->count);
+  h = hash_bytes(h, p->d, sizeof(real) * p->count);
+  h = hash_bytes(h, &meshes->count, sizeof(int));
+  for (i = 0; i < meshes->count; i++) {
+    Mesh* mesh = &meshes->items[i];
+    h = hash_bytes(h, &mesh->triCount, sizeof(int));
+    h = hash_bytes(h, mesh->verts, sizeof(real) * 3 * (size_t)mesh->vertCount);
+    h = hash_bytes(h, mesh->index, sizeof(uint32_t) * 3 * (size_t)mesh->triCount);
+  }
+  h = hash_bytes(h, &meshes->instanceCount, sizeof(int));
+  for (i = 0; i < meshes->instanceCount; i++) {
+    Instance* inst = &meshes->instances[i];
+    int mesh = (int)(inst->mesh - meshes->items);
+    h = hash_bytes(h, &mesh, sizeof(int));
+    h = hash_bytes(h, inst->toObject, sizeof(inst->toObject));
+  }
+  return h;
+}
+
+void gbuffer_save(GBuffer* g, Scene* scene, char* filename) {
+  GBufferHeader header;
+  size_t pixels = (size_t)g->width * g->height;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, GBUFFER_MAGIC, 4);
+  header.version = GBUFFER_VERSION;
+  header.scalarSize = sizeof(real);
+  header.width = g->width;
+  header.height = g->height;
+  header.geometry = geometry_hash(scene);
+
+  FILE* out = fopen(filename, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Error: Failed to open file %s\n", filename);
+    exit(1);
+  }
+  if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+      fwrite(g->prim, sizeof(int), pixels, out) != pixels ||
+      fwrite(g->t, sizeof(real), pixels, out) != pixels || fclose(out) != 0) {
+    fprintf(stderr, "Error: Failed to write the G-buffer.\n");
+    exit(1);
+  }
+}
+
+// Reads a G-buffer saved by gbuffer_save() and checks that it was rendered
+// from this scene's geometry and camera at width x height.
+GBuffer* gbuffer_load(char* filename, Scene* scene, int width, int height) {
+  GBufferHeader header;
+  size_t i;
+
+  FILE* in = fopen(filename, "rb");
+  if (in == NULL) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, GBUFFER_MAGIC, 4) != 0) {
+    fprintf(stderr, "Error: \"%s\" is not a G-buffer.\n", filename);
+    exit(1);
+  }
+  if (header.version != GBUFFER_VERSION || header.scalarSize != sizeof(real)) {
+    fprintf(stderr, "Error: G-buffer \"%s\" was saved by a different build. Render it again.\n",
+      filename);
+    exit(1);
+  }
+  if ((int)header.width != width || (int)header.height != height) {
+    fprintf(stderr, "Error: G-buffer \"%s\" is %ux%u, not %ix%i.\n", filename, header.width,
+      header.height, width, height);
+    exit(1);
+  }
+  if (header.geometry != geometry_hash(scene)) {
+    fprintf(stderr, "Error: G-buffer \"%s\" was saved for different geometry or camera. "
+      "Render it again.\n", filename);
+    exit(1);
+  }
+
+  GBuffer* g = gbuffer_create(width, height);
+  size_t pixels = (size_t)width * height;
+  if (fread(g->prim, sizeof(int), pixels, in) != pixels ||
+      fread(g->t, sizeof(real), pixels, in) != pixels) {
+    fprintf(stderr, "Error: G-buffer \"%s\" is truncated.\n", filename);
+    exit(1);
+  }
+  fclose(in);
+
+  // The hash can't catch a corrupt prim, and shading would index with it.
+  int prims = prim_count(scene);
+  for (i = 0; i < pixels; i++) {
+    if (g->prim[i] < -1 || g->prim[i] >= prims) {
+      fprintf(stderr, "Error: G-buffer \"%s\" is corrupt.\n", filename);
+      exit(1);
+    }
+  }
+  return g;
+}
@@ -15,11 +15,17 @@
 // const uint8_t SPHERE = 1;
 // const uint8_t PLANE = 2;
 // const uint8_t LIGHT = 3;
+// const uint8_t MESH = 4;
+// const uint8_t INSTANCE = 5;
 
+// One packed RGB8 pixel. Frames are flat width x height arrays of these, so
+// a frame can go to disk as P6 in a single write.
 typedef struct {
   unsigned char r, g, b;
 } Color;
 
+_Static_assert(sizeof(Color) == 3, "Color must stay packed RGB8");
+
 typedef struct {
   int type;
   double* diffuse;
@@ -32,6 +38,8 @@ typedef struct {
     struct {
       double width;
       double height;
+      double maxDepth;   // -1 when the scene leaves it to the command line
+      double minWeight;  // likewise
     } Camera;
 
     struct {
@@ -44,6 +52,17 @@ typedef struct {
       double* position;
     } Plane;
 
+    // Meshes and instances. file is the mesh's OBJ or compiled mesh,
+    // relative paths already resolved against the scene file's directory.
+    // An instance places it scaled, then rotated about x, y and z in turn
+    // (degrees), then moved to position; unset vectors leave it as is.
+    struct {
+      char* file;
+      double* position;
+      double* rotation;
+      double* scale;
+    } Mesh;
+
     struct {
       double theta;
       double angular_a0;
@@ -56,10 +75,579 @@ typedef struct {
   };
 } Obj;
 
-static double* renderColor(int dp, double* Ro, double* Rd, Obj** objs, Obj** light);
-Obj **read_scene(char *, Obj** light);
-void normalize(double *v);
-double intersection_dist(V3 Ro, V3 Rd, Obj* obj);
-void specular(double* specColor, double* norm, double* lightDirect, Obj* obj, double* lightCol, double* Rd);
-void diffuse(double* totalDiffuse, double* norm, double* lightDirect, Obj* obj, double* lightCol);
+// Bounding volume hierarchy over the spheres of a scene. Interior nodes keep
+// their two children next to each other at nodes[start]; leaves (count > 0)
+// cover spheres start .. start + count - 1 of the render-time layout. prims
+// records which entry of objs ended up in each of those slots. A mesh's tree
+// is the same over its triangles, with no prims once the mesh is laid out.
+typedef struct {
+  real min[3];
+  real max[3];
+  int start;
+  int count;
+} BvhNode;
+
+// Past this depth the builder stops looking for a good split and just halves
+// the range, so the traversal stack can never overflow.
+#define BVH_MAX_DEPTH 48
+
+// Median splits below BVH_MAX_DEPTH add at most another 31 levels.
+#define BVH_STACK_SIZE (BVH_MAX_DEPTH + 32)
+
+// mapped is set when nodes and prims point into a mapped compiled scene
+// rather than memory of the tree's own.
+typedef struct {
+  BvhNode* nodes;
+  int nodeCount;
+  int depth;
+  int* prims;
+  int primCount;
+  int mapped;
+} Bvh;
+
+// Render-time layout. Each primitive type keeps its fields in separate
+// contiguous, cache-line aligned arrays, so the intersection loops stream
+// through exactly the data they test instead of chasing Obj pointers.
+// cc holds |center|^2 - radius^2, the part of the intersection quadratic
+// that doesn't depend on the ray.
+typedef struct {
+  real* cx;
+  real* cy;
+  real* cz;
+  real* cc;
+  int count;
+} SphereSet;
+
+// Planes are stored as a unit normal n and offset d, with n . p = d on the
+// plane.
+typedef struct {
+  real* nx;
+  real* ny;
+  real* nz;
+  real* d;
+  int count;
+} PlaneSet;
+
+typedef struct {
+  real diffuse[3];
+  real specular[3];
+  real reflectivity;
+  real refractivity;
+  real refracIndex;
+} Material;
+
+// A triangle mesh, see mesh.c. verts holds x, y, z of every vertex and
+// index the three vertex numbers of every triangle, in the order of the
+// leaves of bvh, whose start and count number triangles. mapped is set when
+// verts, index and the tree point into a mapped compiled mesh rather than
+// memory of the mesh's own.
+typedef struct {
+  real* verts;
+  uint32_t* index;
+  int vertCount;
+  int triCount;
+  Bvh* bvh;
+  int mapped;
+} Mesh;
+
+// One placement of a mesh. toObject holds the rows of the 3x4 affine map
+// taking world space to the mesh's own; rays are moved through it rather
+// than the mesh through its inverse, so every copy shares the one mesh.
+// identity is set when the map changes nothing and can be skipped. The
+// mesh's triangle i is primitive firstPrim + i of this placement.
+typedef struct {
+  Mesh* mesh;
+  real toObject[12];
+  int identity;
+  int firstPrim;
+} Instance;
+
+// Every mesh file the scene uses, loaded once however many objects name
+// it, and the mesh and instance objects placing them. instances follow the
+// leaf order of bvh, a tree with one instance per leaf over their world
+// space bounds.
+typedef struct {
+  Mesh* items;
+  int count;
+  Instance* instances;
+  int instanceCount;
+  int triCount;
+  Bvh* bvh;
+} MeshSet;
+
+// Render-time light. Spotlights (spot set) light a point only when the
+// cosine between direct and the ray from the light reaches spotCutoff,
+// the sine of theta.
+typedef struct {
+  real position[3];
+  real color[3];
+  real direct[3];
+  int spot;
+  real spotCutoff;
+  real radial_a0;
+  real radial_a1;
+  real radial_a2;
+} SceneLight;
+
+// Where the camera sits and which way it faces, as unit vectors. Primary
+// rays leave eye through forward plus the pixel's offsets along right and
+// up.
+typedef struct {
+  real eye[3];
+  real right[3];
+  real up[3];
+  real forward[3];
+} View;
+
+// Lights sorted into a grid by how far each reaches, see lights.c. range[i]
+// is the distance past which light i is below the cutoff, INFINITY for one
+// that never is. Cell c, numbered x fastest and then y and z, lists the
+// lights list[start[c]] to list[start[c + 1] - 1]; a point outside the
+// dims cells of edge cell from min can only be reached by the everywhere
+// lights.
+typedef struct {
+  real* range;
+  real min[3];
+  real cell;
+  int dims[3];
+  int* start;
+  int* list;
+  int* everywhere;
+  int everywhereCount;
+} LightGrid;
+
+// Everything a ray needs to know about the scene. Primitives are numbered
+// spheres first, then planes, then the triangles of each instance in turn.
+// mats is indexed by that number up to the planes and then holds one
+// material per instance; prim_material() finds any primitive's. objs and
+// light keep the parsed Obj records; lights is the render-time copy of
+// light. A NULL bvh means rays are tested against every sphere, and a NULL
+// lightGrid that every hit looks at every light; the render makes the grid
+// for each frame it draws.
+// scene_build() derives everything but objs, light and bvh, and puts the
+// camera at the origin looking down +z. Nothing changes while a frame
+// renders; between frames an animation moves the view, spheres and lights.
+typedef struct {
+  Obj** objs;
+  Obj** light;
+  Bvh* bvh;
+  SphereSet spheres;
+  PlaneSet planes;
+  MeshSet meshes;
+  Material* mats;
+  SceneLight* lights;
+  int lightCount;
+  LightGrid* lightGrid;
+  View view;
+} Scene;
+
+static inline int prim_is_sphere(Scene* scene, int prim) {
+  return prim < scene->spheres.count;
+}
+
+static inline int prim_is_triangle(Scene* scene, int prim) {
+  return prim >= scene->spheres.count + scene->planes.count;
+}
+
+static inline int prim_count(Scene* scene) {
+  return scene->spheres.count + scene->planes.count + scene->meshes.triCount;
+}
+
+// The instance a triangle primitive belongs to.
+static inline Instance* prim_instance(Scene* scene, int prim) {
+  Instance* instances = scene->meshes.instances;
+  int lo = 0, hi = scene->meshes.instanceCount - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (instances[mid].firstPrim <= prim) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return &instances[lo];
+}
+
+static inline Material* prim_material(Scene* scene, int prim) {
+  int first = scene->spheres.count + scene->planes.count;
+  if (prim < first) {
+    return &scene->mats[prim];
+  }
+  return &scene->mats[first + (int)(prim_instance(scene, prim) - scene->meshes.instances)];
+}
+
+// Distance along the ray to sphere i, or -1 on a miss.
+static inline real sphere_intersection(SphereSet* s, int i, real *Ro, real *Rd) {
+  real pos[3] = {s->cx[i], s->cy[i], s->cz[i]};
+
+  real valueA = (sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
+  real valueB = 2 * Rd[0] * (Ro[0] - pos[0]) + 2 * Rd[1] * (Ro[1] - pos[1]) + 2 * Rd[2] * (Ro[2] - pos[2]);
+  real valueC = s->cc[i] + (sqr(Ro[0]) + sqr(Ro[1]) + sqr(Ro[2])) -2 * (pos[0] * Ro[0] + pos[1] * Ro[1] + pos[2] * Ro[2]);
+
+  real d = sqr(valueB) - 4 * valueA * valueC;
+  if(d < 0)
+    return -1;
+
+  real t0 = (-valueB - real_sqrt(d)) / (2*valueA);
+  if (t0 > 0)
+    return t0;
+
+  real t1 = (-valueB + real_sqrt(d)) / (2*valueA);
+  if (t1 > 0)
+    return t1;
+
+  return -1;
+}
+
+// Distance along the ray to plane i, or -1 on a miss.
+static inline real plane_intersection(PlaneSet* p, int i, real *Ro, real *Rd) {
+  real dist = p->nx[i] * Ro[0] + p->ny[i] * Ro[1] + p->nz[i] * Ro[2] - p->d[i];
+  real denom = p->nx[i] * Rd[0] + p->ny[i] * Rd[1] + p->nz[i] * Rd[2];
+
+  dist = -(dist / denom);
+  if (dist > 0)
+    return dist;
+
+  return -1;
+}
+
+// Distance along the ray to triangle i of the mesh, or -1 on a miss.
+// Moller-Trumbore: the hit is solved for directly in the triangle's
+// barycentric coordinates, with no plane equation stored. Triangles have
+// two sides.
+static inline real triangle_intersection(Mesh* m, int i, real* Ro, real* Rd) {
+  uint32_t* v = &m->index[3 * (size_t)i];
+  real* a = &m->verts[3 * (size_t)v[0]];
+  real* b = &m->verts[3 * (size_t)v[1]];
+  real* c = &m->verts[3 * (size_t)v[2]];
+  real e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+  real e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+  real p[3] = {Rd[1] * e2[2] - Rd[2] * e2[1], Rd[2] * e2[0] - Rd[0] * e2[2],
+    Rd[0] * e2[1] - Rd[1] * e2[0]};
+
+  real det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+  if (det == 0)
+    return -1;
+  real inv = 1 / det;
+
+  real s[3] = {Ro[0] - a[0], Ro[1] - a[1], Ro[2] - a[2]};
+  real u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv;
+  if (u < 0 || u > 1)
+    return -1;
+
+  real q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2],
+    s[0] * e1[1] - s[1] * e1[0]};
+  real w = (Rd[0] * q[0] + Rd[1] * q[1] + Rd[2] * q[2]) * inv;
+  if (w < 0 || u + w > 1)
+    return -1;
+
+  real t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv;
+  if (t > 0)
+    return t;
+
+  return -1;
+}
+
+// Four coherent rays traced together, one lane per ray. t and prim come
+// back holding each lane's closest hit, or -1 for a miss. Lanes that have
+// no ray of their own carry a copy of lane 0 and their results are ignored.
+#define PACKET_SIZE 4
+
+typedef struct {
+  real ox[PACKET_SIZE] __attribute__((aligned(32)));
+  real oy[PACKET_SIZE] __attribute__((aligned(32)));
+  real oz[PACKET_SIZE] __attribute__((aligned(32)));
+  real dx[PACKET_SIZE] __attribute__((aligned(32)));
+  real dy[PACKET_SIZE] __attribute__((aligned(32)));
+  real dz[PACKET_SIZE] __attribute__((aligned(32)));
+  real ix[PACKET_SIZE] __attribute__((aligned(32)));
+  real iy[PACKET_SIZE] __attribute__((aligned(32)));
+  real iz[PACKET_SIZE] __attribute__((aligned(32)));
+  real t[PACKET_SIZE] __attribute__((aligned(32)));
+  int prim[PACKET_SIZE];
+} RayPacket;
+
+// Closest-hit query for a whole packet, same answer per lane as rayCast().
+typedef void (*PacketCast)(Scene* scene, RayPacket* packet);
+
+// Deepest ray tree a frame may ask for. Sizes the shading stack.
+#define MAX_TRACE_DEPTH 64
+
+// Used when neither the command line nor the scene's camera says otherwise.
+// A ray carrying under a thousandth of its pixel can't move it by a level.
+#define DEFAULT_DEPTH 7
+#define DEFAULT_MIN_WEIGHT 0.001
+
+// Lights are culled where their brightest channel, attenuated, falls below
+// this. One light that dim can't move a level; thousands of them summed
+// can move a few, which --light-cutoff 0 avoids.
+#define DEFAULT_LIGHT_CUTOFF 0.001
+
+// Work done over a frame. traced is every secondary ray cast, reflected or
+// refracted, and pruned the ones skipped because their weight fell to the
+// threshold. Intersection tests count one per ray and primitive or box, so
+// a packet testing a sphere adds PACKET_SIZE. depth[d] is the number of
+// rays shaded d bounces below the camera, so depth[0] is the primary rays.
+// culled counts the lights skipped at a hit, out of range or outside their
+// spot cone, which cost no shadow ray.
+// Every field is a long, which lets the counts be summed field by field.
+typedef struct {
+  long traced;
+  long pruned;
+  long shadow;
+  long reflection;
+  long refraction;
+  long shadowHits;
+  long culled;
+  long sphereTests;
+  long planeTests;
+  long triangleTests;
+  long boxTests;
+  long depth[MAX_TRACE_DEPTH + 1];
+} RayCounts;
+
+// Each render thread counts into its own copy, so the hot path never
+// touches shared memory. A thread's copy is added into the frame's total,
+// and cleared, once the thread has run out of tiles.
+extern __thread RayCounts threadRays;
+
+// The first hit of every primary ray of a frame: the primitive (-1 for a
+// miss) and its distance, row after row. The hit point and normal follow
+// from t and the pixel's ray exactly as they do in a full render.
+typedef struct {
+  int width;
+  int height;
+  int* prim;
+  real* t;
+} GBuffer;
+
+// Spheres listed by the screen bins they can be seen in, see binning.c.
+// Bins cover the pixels from (x0, y0), cols across and rows down. Bin b's
+// spheres are prims[start[b]] to prims[start[b + 1] - 1], in order of
+// near, the least distance from the eye each can be hit at.
+typedef struct {
+  int x0, y0;
+  int cols, rows;
+  int* start;
+  int* prims;
+  real* near;
+} ScreenBins;
+
+// Settings shared by every pixel of a frame. A NULL packets traces every
+// primary ray on its own. Reflected and refracted rays stop after maxDepth
+// bounces or once they carry no more than minWeight of the pixel. workers
+// above 0 has sceneMaker() farm the frame out to that many processes. A
+// gbuffer gets every first hit written into it, or with reshade set the
+// first hits are read from it and no primary ray is cast. wavefront traces
+// each tile a bounce at a time, see wavefront.c. binning casts primary
+// rays against screen bins of the spheres instead. rays is filled in by
+// the render. Lights whose attenuated brightness falls below lightCutoff
+// are culled; 0 looks at every light everywhere.
+typedef struct {
+  int threads;
+  int workers;
+  PacketCast packets;
+  int maxDepth;
+  double minWeight;
+  GBuffer* gbuffer;
+  int reshade;
+  int wavefront;
+  int binning;
+  double lightCutoff;
+  RayCounts rays;
+} RenderOptions;
+
+// A reflected or refracted ray waiting to be traced, carrying weight of
+// its pixel's color, with dp bounces left.
+typedef struct {
+  real Ro[3];
+  real Rd[3];
+  real weight;
+  int dp;
+} RayTask;
+
+// One ray of a wavefront queue, for the pixel-th pixel of the batch. prim
+// and t are its closest hit once the queue has been cast; acc gathers the
+// light reaching that hit.
+typedef struct {
+  real Ro[3];
+  real Rd[3];
+  real weight;
+  real t;
+  real acc[3];
+  int pixel;
+  int dp;
+  int prim;
+} WaveRay;
+
+// A shadow ray of a wavefront, lighting rays[ray] with share unless
+// something lies closer than maxT.
+typedef struct {
+  real Ro[3];
+  real Rd[3];
+  real maxT;
+  real share[3];
+  int ray;
+  int light;
+} WaveShadow;
+
+// Working memory of one render thread's wavefront, for batches of up to
+// maxPixels pixels. The caller fills rays with count primary rays and color
+// holds each pixel's result afterwards. capacity bounds every queue; rays
+// that don't fit in the next bounce are traced depth first instead.
+typedef struct {
+  int maxPixels;
+  int capacity;
+  int count;
+  WaveRay* rays;
+  WaveRay* next;
+  WaveShadow* shadows;
+  WaveShadow* shadowsSorted;
+  uint64_t* keys;
+  uint64_t* keysTemp;
+  real* color;
+} Wavefront;
+
+// Pixel rectangle [x0, x1) x [y0, y1) handed to a render thread.
+typedef struct {
+  int x0, y0;
+  int x1, y1;
+} Tile;
+
+// Renders a tile into out, which points at the tile's top-left pixel and
+// advances stride pixels per row.
+typedef void (*TileFunc)(Tile* tile, Color* out, int stride, void* data);
+
+// Runs once on every render thread after its last tile, with the same data.
+typedef void (*TileDone)(void* data);
+
+// Receives count finished rows, in order, starting with row y.
+typedef void (*RowSink)(Color* rows, int y, int count, void* data);
+
+// Row-at-a-time PPM writer.
+typedef struct {
+  FILE* output;
+  int width;
+  int height;
+  int ascii;
+  int nextRow;
+  char* text;
+} PpmSink;
+
+// One key of an animation track: where the camera (type 0), a sphere (1)
+// or a light (3) is at a frame. object numbers spheres and lights from 1
+// per kind, in scene file order; lookAt is only used by the camera.
+typedef struct {
+  int type;
+  int object;
+  int frame;
+  double position[3];
+  double lookAt[3];
+} Keyframe;
+
+typedef struct {
+  Keyframe* keys;
+  int count;
+} Track;
+
+// Edge length in pixels of the square tiles the frame is split into.
+#define TILE_SIZE 16
+
+// Edge length of a tile traced as one wavefront batch.
+#define WAVE_TILE_SIZE 64
+
+// The alloccheck build wraps malloc and counts every call a thread makes
+// between these two marks. Other builds compile them away.
+#ifdef ALLOC_CHECK
+void render_alloc_begin(void);
+void render_alloc_end(void);
+long render_alloc_count(void);
+#define RENDER_ALLOC_BEGIN() render_alloc_begin()
+#define RENDER_ALLOC_END() render_alloc_end()
+#else
+#define RENDER_ALLOC_BEGIN()
+#define RENDER_ALLOC_END()
+#endif
+
+void renderColor(RenderOptions* opts, Scene* scene, real* Ro, real* Rd, real* col);
+void shadeColor(RenderOptions* opts, Scene* scene, real* Ro, real* Rd, int prim, real t,
+  real* col);
+void shadeRay(RenderOptions* opts, Scene* scene, RayTask* start, int prim, real t, real* col);
+void lightRay(SceneLight* light, real* intersect, real* lightDirect, real* mag);
+void lightShare(SceneLight* light, Material* mat, real* Norm, real* lightDirect, real mag,
+  real* Rd, real* diffColor, real* specColor);
+void reflection(RayTask* ray, real* reflectObjNorm, real* Ro, real* Rd, real t);
+void refraction(RayTask* ray, real ior, real* refractNorm, int check,
+  real* Ro, real* Rd, Scene* scene, real t);
+void currentIntersect(real* intersect, real* Ro, real* Rd, real t);
+int rayCast(real* t, Scene* scene, int skip, real* Ro, real* Rd);
+int rayOccluded(Scene* scene, int skip, real* Ro, real* Rd, real maxT);
+Obj **read_scene(char *, Obj*** light);
+Track* read_track(char* filename);
+void normalize(real *v);
+void get_sphere_normal(SphereSet* s, int i, real* val_intersect, real* norm);
+void get_plane_normal(PlaneSet* p, int i, real* norm);
+void prim_normal(Scene* scene, int prim, real* intersect, real* Rd, real* norm);
+void specular(real* specColor, real* norm, real* lightDirect, Material* mat, real* lightCol, real* Rd);
+void diffuse(real* totalDiffuse, real* norm, real* lightDirect, Material* mat, real* lightCol);
+Bvh* bvh_build(Obj** objs);
+void bvh_free(Bvh* bvh);
+int bvh_nodes_valid(BvhNode* nodes, uint32_t nodeCount, uint32_t primCount);
+void bvh_refit(Scene* scene);
+void bvh_cast(Scene* scene, int skip, real* Ro, real* Rd, real* tBest, int* best);
+int bvh_occluded(Scene* scene, int skip, real* Ro, real* Rd, real maxT);
+Bvh* bvh_build_triangles(real* verts, uint32_t* index, int count);
+Bvh* bvh_build_boxes(double* bounds, int count);
+void bvh_cast_mesh(Mesh* mesh, int firstPrim, int skip, real* Ro, real* Rd, real* tBest, int* best);
+int bvh_occluded_mesh(Mesh* mesh, int firstPrim, int skip, real* Ro, real* Rd, real maxT);
+void bvh_cast_instances(Scene* scene, int skip, real* Ro, real* Rd, real* tBest, int* best);
+int bvh_occluded_instances(Scene* scene, int skip, real* Ro, real* Rd, real maxT);
+void mesh_load(Mesh* mesh, char* filename);
+void mesh_free(Mesh* mesh);
+void mesh_compile(char* input, char* output);
+const char* scan_number(const char** cur, const char* end, double* value);
+void scene_validate(Obj** objs, Obj** light);
+void scene_build(Scene* scene);
+void scene_look_at(Scene* scene, double* eye, double* target);
+void scene_move_sphere(Scene* scene, int slot, double* position, double radius);
+void scene_move_light(Scene* scene, int i, double* position);
+void scene_compile(char* input, char* output, int withBvh);
+void scene_load(char* filename, Scene* scene, int useBvh);
+void ppm_begin(PpmSink* sink, FILE* output, int width, int height, int ascii);
+void ppm_rows(PpmSink* sink, Color* rows, int count);
+void ppm_end(PpmSink* sink);
+void ppmMaker(Color* buff, int width, int height, int ascii, FILE *output);
+Color* sceneMaker(Scene* scene, int height, int width, RenderOptions* opts);
+void sceneTile(Scene* scene, int height, int width, RenderOptions* opts, ScreenBins* bins,
+  Tile* tile, Color* out);
+void sceneRegion(Scene* scene, int height, int width, RenderOptions* opts, Tile* region,
+  Color* out);
+Color* workers_render(Scene* scene, int height, int width, RenderOptions* opts);
+void sceneStreamer(Scene* scene, int height, int width, RenderOptions* opts, PpmSink* sink);
+void regions_crop(Scene* scene, int height, int width, RenderOptions* opts, Tile* regions,
+  int count, int ascii, FILE* output);
+void regions_patch(Scene* scene, int height, int width, RenderOptions* opts, Tile* regions,
+  int count, char* filename);
+Wavefront* wavefront_create(int pixels);
+void wavefront_free(Wavefront* w);
+void wavefront_run(Wavefront* w, Scene* scene, RenderOptions* opts, int known);
+ScreenBins* bins_build(Scene* scene, int height, int width, Tile* region);
+void bins_free(ScreenBins* bins);
+int bins_cast(ScreenBins* bins, Scene* scene, int x, int y, real* Ro, real* Rd, real* t);
+LightGrid* lights_build(Scene* scene, double cutoff);
+void lights_free(LightGrid* grid);
+int* lights_near(Scene* scene, real* p, int* count);
+int lights_reach(Scene* scene, int i, real* lightDirect, real mag);
+GBuffer* gbuffer_create(int width, int height);
+void gbuffer_save(GBuffer* gbuffer, Scene* scene, char* filename);
+GBuffer* gbuffer_load(char* filename, Scene* scene, int width, int height);
+void serve(char* address, RenderOptions* opts, int useBvh);
+void anim_render(Scene* scene, Track* track, RenderOptions* opts, int width, int height,
+  int frames, char* output, int ascii);
+PacketCast packet_kernel(char* name);
+int tile_thread_count(int requested);
+void tile_pool_run(int width, int height, int tileSize, int threads, Color* buff,
+  TileFunc fn, TileDone done, void* data);
+void tile_stream_run(int width, int height, int bandHeight, int threads, TileFunc fn,
+  TileDone done, void* data, RowSink sink, void* sinkData);
 #endif
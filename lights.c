@@ -0,0 +1,230 @@
+#include "header.h"
+
+// Culling lights that can't reach a hit. A light's radial attenuation
+// 1 / (a2 d^2 + a1 d + a0) gives it a range: past that distance its
+// brightest channel is below the cutoff, so it can't light anything enough
+// to matter and needs no shadow ray. Lights with a range are put in a
+// uniform grid, each listed in every cell its range reaches; a hit only
+// looks at the lights of the cell it falls in. Lights whose attenuation
+// never falls to the cutoff are listed in every cell and also make up the
+// list for hits outside the grid.
+
+// The grid aims for about this many cells per ranged light, and is never
+// more than LIGHT_GRID_MAX cells along an axis.
+#define LIGHT_GRID_DENSITY 8
+#define LIGHT_GRID_MAX 128
+
+static void* lights_array(size_t size) {
+  void* a = malloc(size > 0 ? size : 1);
+  if (a == NULL) {
+    fprintf(stderr, "Error: Out of memory while sorting the lights.\n");
+    exit(1);
+  }
+  return a;
+}
+
+// Distance past which the light stays below cutoff, or INFINITY when its
+// attenuation doesn't fall off that far.
+static real light_range(SceneLight* light, double cutoff) {
+  double a0 = light->radial_a0, a1 = light->radial_a1, a2 = light->radial_a2;
+  double peak = fmax(light->color[0], fmax(light->color[1], light->color[2]));
+  double limit = peak / cutoff;
+
+  if (peak <= 0) {
+    return 0;
+  }
+  if (a0 < 0 || a1 < 0 || a2 < 0) {
+    return INFINITY;
+  }
+  if (a0 >= limit) {
+    return 0;
+  }
+  if (a2 > 0) {
+    return (-a1 + sqrt(a1 * a1 - 4 * a2 * (a0 - limit))) / (2 * a2);
+  }
+  if (a1 > 0) {
+    return (limit - a0) / a1;
+  }
+  return INFINITY;
+}
+
+// Whether any point of the cell lies within range of center.
+static int cell_reached(LightGrid* g, int x, int y, int z, real* center, real range) {
+  int cell[3] = {x, y, z};
+  double dist = 0;
+  int a;
+  for (a = 0; a < 3; a++) {
+    double lo = g->min[a] + cell[a] * g->cell;
+    double d = fmax(lo - center[a], fmax(center[a] - (lo + g->cell), 0));
+    dist += d * d;
+  }
+  return dist <= (double)range * range;
+}
+
+// Cells along axis a that the light's range overlaps, clamped to the grid.
+static void cell_span(LightGrid* g, int a, real* center, real range, int* lo, int* hi) {
+  *lo = (int)floor((center[a] - range - g->min[a]) / g->cell);
+  *hi = (int)floor((center[a] + range - g->min[a]) / g->cell);
+  if (*lo < 0) *lo = 0;
+  if (*hi >= g->dims[a]) *hi = g->dims[a] - 1;
+}
+
+// Works out every light's range for cutoff and grids the lights of scene.
+// Returns NULL, culling nothing, when cutoff isn't above 0.
+LightGrid* lights_build(Scene* scene, double cutoff) {
+  SceneLight* lights = scene->lights;
+  int n = scene->lightCount;
+  int i, a, x, y, z;
+
+  if (cutoff <= 0) {
+    return NULL;
+  }
+  LightGrid* g = lights_array(sizeof(LightGrid));
+  g->range = lights_array(sizeof(real) * n);
+  g->everywhere = lights_array(sizeof(int) * n);
+  g->everywhereCount = 0;
+
+  // Bounds of every ranged light's reach.
+  double min[3] = {INFINITY, INFINITY, INFINITY};
+  double max[3] = {-INFINITY, -INFINITY, -INFINITY};
+  double sumRange = 0;
+  int ranged = 0;
+  for (i = 0; i < n; i++) {
+    real range = g->range[i] = light_range(&lights[i], cutoff);
+    if (range == INFINITY) {
+      g->everywhere[g->everywhereCount++] = i;
+    } else if (range > 0) {
+      for (a = 0; a < 3; a++) {
+        min[a] = fmin(min[a], lights[i].position[a] - range);
+        max[a] = fmax(max[a], lights[i].position[a] + range);
+      }
+      sumRange += range;
+      ranged++;
+    }
+  }
+
+  // Cubic cells, about LIGHT_GRID_DENSITY of them per ranged light, but no
+  // smaller than half the mean range so one light doesn't fill hundreds.
+  g->cell = 1;
+  g->dims[0] = g->dims[1] = g->dims[2] = 0;
+  if (ranged > 0) {
+    double volume = 1;
+    for (a = 0; a < 3; a++) {
+      volume *= fmax(max[a] - min[a], 1e-9);
+    }
+    double cell = fmax(cbrt(volume / ((double)ranged * LIGHT_GRID_DENSITY)),
+      sumRange / ranged / 2);
+    for (a = 0; a < 3; a++) {
+      cell = fmax(cell, (max[a] - min[a]) / LIGHT_GRID_MAX);
+    }
+    g->cell = cell;
+    for (a = 0; a < 3; a++) {
+      g->min[a] = min[a];
+      g->dims[a] = (int)ceil((max[a] - min[a]) / cell);
+      if (g->dims[a] < 1) g->dims[a] = 1;
+    }
+  }
+
+  // Two passes over the lights in order, counting and then filling, keep
+  // every cell's list in light order, the order the loop without a grid
+  // adds them up in.
+  int cells = g->dims[0] * g->dims[1] * g->dims[2];
+  g->start = lights_array(sizeof(int) * (cells + 1));
+  memset(g->start, 0, sizeof(int) * (cells + 1));
+  int* fill = NULL;
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < n; i++) {
+      real range = g->range[i];
+      real* p = lights[i].position;
+      int x0 = 0, x1 = g->dims[0] - 1, y0 = 0, y1 = g->dims[1] - 1, z0 = 0, z1 = g->dims[2] - 1;
+      if (range <= 0) {
+        continue;
+      }
+      if (range != INFINITY) {
+        cell_span(g, 0, p, range, &x0, &x1);
+        cell_span(g, 1, p, range, &y0, &y1);
+        cell_span(g, 2, p, range, &z0, &z1);
+      }
+      for (z = z0; z <= z1; z++) {
+        for (y = y0; y <= y1; y++) {
+          for (x = x0; x <= x1; x++) {
+            if (range != INFINITY && !cell_reached(g, x, y, z, p, range)) {
+              continue;
+            }
+            int c = (z * g->dims[1] + y) * g->dims[0] + x;
+            if (pass == 0) {
+              g->start[c + 1]++;
+            } else {
+              g->list[fill[c]++] = i;
+            }
+          }
+        }
+      }
+    }
+    if (pass == 0) {
+      for (i = 0; i < cells; i++) {
+        g->start[i + 1] += g->start[i];
+      }
+      g->list = lights_array(sizeof(int) * g->start[cells]);
+      fill = lights_array(sizeof(int) * (cells > 0 ? cells : 1));
+      memcpy(fill, g->start, sizeof(int) * cells);
+    }
+  }
+  free(fill);
+  return g;
+}
+
+void lights_free(LightGrid* g) {
+  if (g == NULL) {
+    return;
+  }
+  free(g->range);
+  free(g->everywhere);
+  free(g->start);
+  free(g->list);
+  free(g);
+}
+
+// The lights that may reach point p, in light order. Sets *count and
+// returns the list, or returns NULL when every light of the scene has to be
+// looked at.
+int* lights_near(Scene* scene, real* p, int* count) {
+  LightGrid* g = scene->lightGrid;
+  int cell[3], a;
+
+  if (g == NULL) {
+    *count = scene->lightCount;
+    return NULL;
+  }
+  for (a = 0; a < 3; a++) {
+    real f = (p[a] - g->min[a]) / g->cell;
+    if (!(f >= 0 && f < g->dims[a])) {
+      *count = g->everywhereCount;
+      return g->everywhere;
+    }
+    cell[a] = (int)f;
+  }
+  int c = (cell[2] * g->dims[1] + cell[1]) * g->dims[0] + cell[0];
+  *count = g->start[c + 1] - g->start[c];
+  return &g->list[g->start[c]];
+}
+
+// Whether light i can light point p, with lightDirect and mag the unit
+// direction and distance from p to the light: p must be in its range, and
+// for a spotlight inside its cone.
+int lights_reach(Scene* scene, int i, real* lightDirect, real mag) {
+  SceneLight* light = &scene->lights[i];
+
+  if (scene->lightGrid != NULL && mag > scene->lightGrid->range[i]) {
+    return 0;
+  }
+  if (light->spot) {
+    real lightObj[3];
+    v3_scale(lightDirect, -1, lightObj);
+    if (v3_dot(lightObj, light->direct) < light->spotCutoff) {
+      return 0;
+    }
+  }
+  return 1;
+}
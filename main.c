@@ -1,273 +1,431 @@
 #include "header.h"
+#include <time.h>
 
-float clamp(float v) {
-  if (v < 0.0) {
-    return 0;
-  }
-  else if (v > 1) {
-    return 1.0;
-  }
-  else {
-    return v;
-  }
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-// Creates the output.ppm file.
-void ppmMaker(Color** buff, int x, int y, FILE *output) {
-  fprintf(output, "P%i\n%i %i\n%i\n", 6, x, y, 255);
-  int i;
-  for(i = 0; i < (x*y); i++) {
-    Color* buffer = buff[i];
-    fprintf(output, "%i\n%i\n%i\n", buffer->r, buffer->g, buffer->b);
+// Writes the frame's counters and stage times to stderr as one JSON object.
+// With --stream the image is written while it renders, so the render time
+// includes the writing and write only covers the last flush.
+static void printStats(RenderOptions* opts, int width, int height, double* seconds) {
+  RayCounts* rays = &opts->rays;
+  int d;
+
+  fprintf(stderr, "{\n");
+  fprintf(stderr, "  \"width\": %d,\n  \"height\": %d,\n  \"threads\": %d,\n", width, height,
+    opts->threads);
+  fprintf(stderr, "  \"precision\": \"%s\",\n", REAL_NAME);
+  fprintf(stderr, "  \"rays\": {\"primary\": %ld, \"reflection\": %ld, \"refraction\": %ld, "
+    "\"shadow\": %ld, \"pruned\": %ld},\n", rays->depth[0], rays->reflection, rays->refraction,
+    rays->shadow, rays->pruned);
+  fprintf(stderr, "  \"shadow\": {\"hits\": %ld, \"misses\": %ld, \"culled\": %ld},\n",
+    rays->shadowHits, rays->shadow - rays->shadowHits, rays->culled);
+  fprintf(stderr, "  \"tests\": {\"sphere\": %ld, \"plane\": %ld, \"triangle\": %ld, \"box\": %ld},\n",
+    rays->sphereTests, rays->planeTests, rays->triangleTests, rays->boxTests);
+  fprintf(stderr, "  \"depth\": [");
+  for (d = 0; d <= opts->maxDepth; d++) {
+    fprintf(stderr, "%s%ld", d == 0 ? "" : ", ", rays->depth[d]);
   }
+  fprintf(stderr, "],\n");
+  fprintf(stderr, "  \"seconds\": {\"parse\": %.6f, \"render\": %.6f, \"write\": %.6f}\n",
+    seconds[0], seconds[1], seconds[2]);
+  fprintf(stderr, "}\n");
 }
 
-void currentIntersect(double* intersect, double* Ro, double* Rd, double t) {
-  intersect[0] = t*Rd[0] + Ro[0];
-  intersect[1] = t*Rd[1] + Ro[1];
-  intersect[2] = t*Rd[2] + Ro[2];
-}
-
-Obj* rayCast(double* t, Obj** objs, Obj* skip, double* Ro, double* Rd) {
-
-  double tNew = INFINITY, tVal;
-  Obj* newObj = NULL;
+int main(int argc, char *argv[]) {
+  char* args[4];
+  int argCount = 0;
+  int useBvh = 1;
+  int threads = 1;
+  int workers = 0;
+  int ascii = 0;
+  int stream = 0;
+  int compile = 0;
+  int compileMesh = 0;
+  int stats = 0;
+  int wavefront = 0;
+  int binning = 0;
+  char* simd = "auto";
+  char* trackFile = NULL;
+  char* serveAddress = NULL;
+  Tile* regions = malloc(sizeof(Tile) * argc);
+  int regionCount = 0;
+  int patch = 0;
+  char* saveGbuffer = NULL;
+  char* reshadeGbuffer = NULL;
+  int frames = -1;
+  int maxDepth = -1;
+  double minWeight = -1;
+  double lightCutoff = DEFAULT_LIGHT_CUTOFF;
   int i;
 
-  for(i = 0; objs[i] != NULL; i++) {
-    if(objs[i] == skip) {
-      continue;
-    } else if(objs[i]->type == 2) {
-      tVal = plane_intersection(Ro, Rd, objs[i]);
-    } else if(objs[i]->type == 1) {
-      tVal = sphere_intersection(Ro, Rd, objs[i]);
-    } else if(objs[i]->type == 0 || objs[i]->type == 3) {
-      continue;
+  // Pulling the option flags out from between the positional arguments.
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--accel") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --accel needs a value (bvh or linear).\n");
+        exit(1);
+      }
+      i++;
+      if (strcmp(argv[i], "bvh") == 0) {
+        useBvh = 1;
+      } else if (strcmp(argv[i], "linear") == 0) {
+        useBvh = 0;
+      } else {
+        fprintf(stderr, "Error: Unknown acceleration \"%s\", use bvh or linear.\n", argv[i]);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --threads needs a count (0 uses every core).\n");
+        exit(1);
+      }
+      threads = strtol(argv[++i], (char **)NULL, 10);
+      if (threads < 0) {
+        fprintf(stderr, "Error: --threads must not be negative.\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--workers") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --workers needs a number of processes.\n");
+        exit(1);
+      }
+      workers = strtol(argv[++i], (char **)NULL, 10);
+      if (workers < 0) {
+        fprintf(stderr, "Error: --workers must not be negative.\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--simd") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --simd needs a value (auto, avx2, sse2, scalar or off).\n");
+        exit(1);
+      }
+      simd = argv[++i];
+    } else if (strcmp(argv[i], "--depth") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --depth needs a number of bounces.\n");
+        exit(1);
+      }
+      maxDepth = strtol(argv[++i], (char **)NULL, 10);
+      if (maxDepth < 0 || maxDepth > MAX_TRACE_DEPTH) {
+        fprintf(stderr, "Error: --depth must be between 0 and %d.\n", MAX_TRACE_DEPTH);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--min-weight") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --min-weight needs a value.\n");
+        exit(1);
+      }
+      minWeight = strtod(argv[++i], (char **)NULL);
+      if (minWeight < 0) {
+        fprintf(stderr, "Error: --min-weight must not be negative.\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--light-cutoff") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --light-cutoff needs a value.\n");
+        exit(1);
+      }
+      lightCutoff = strtod(argv[++i], (char **)NULL);
+      if (lightCutoff < 0) {
+        fprintf(stderr, "Error: --light-cutoff must not be negative.\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--animate") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --animate needs a track file.\n");
+        exit(1);
+      }
+      trackFile = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --frames needs a number of frames.\n");
+        exit(1);
+      }
+      frames = strtol(argv[++i], (char **)NULL, 10);
+      if (frames < 1) {
+        fprintf(stderr, "Error: --frames must be at least 1.\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--serve") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --serve needs a socket path, or - for stdin.\n");
+        exit(1);
+      }
+      serveAddress = argv[++i];
+    } else if (strcmp(argv[i], "--region") == 0) {
+      Tile* r = &regions[regionCount++];
+      char end;
+      if (i + 1 >= argc ||
+          sscanf(argv[++i], "%d,%d,%d,%d%c", &r->x0, &r->y0, &r->x1, &r->y1, &end) != 4) {
+        fprintf(stderr, "Error: --region needs a rectangle, x0,y0,x1,y1.\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--save-gbuffer") == 0 || strcmp(argv[i], "--reshade") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: %s needs a G-buffer file.\n", argv[i]);
+        exit(1);
+      }
+      if (strcmp(argv[i], "--reshade") == 0) {
+        reshadeGbuffer = argv[++i];
+      } else {
+        saveGbuffer = argv[++i];
+      }
+    } else if (strcmp(argv[i], "--patch") == 0) {
+      patch = 1;
+    } else if (strcmp(argv[i], "--ascii") == 0) {
+      ascii = 1;
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      stream = 1;
+    } else if (strcmp(argv[i], "--wavefront") == 0) {
+      wavefront = 1;
+    } else if (strcmp(argv[i], "--bin") == 0) {
+      binning = 1;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = 1;
+    } else if (strcmp(argv[i], "--compile-scene") == 0) {
+      compile = 1;
+    } else if (strcmp(argv[i], "--compile-mesh") == 0) {
+      compileMesh = 1;
+    } else if (argCount < 4) {
+      args[argCount++] = argv[i];
     } else {
-      fprintf(stderr, "Error: Encountered an Unknown Type.\n");
+      fprintf(stderr, "Error: Unexpected argument \"%s\".\n", argv[i]);
       exit(1);
     }
+  }
 
-    if(tVal < tNew && tVal != -1) {
-     tNew = tVal;
-     newObj = objs[i];
+  // Compiling only needs the scene and where to put it.
+  if (compile) {
+    if (argCount != 2) {
+      fprintf(stderr, "Usage: %s --compile-scene [--accel bvh|linear] input.json output.rtsc\n", argv[0]);
+      exit(1);
     }
+    scene_compile(args[0], args[1], useBvh);
+    return 0;
   }
-    if(tNew == INFINITY) {
-      tNew = -1;
+  if (compileMesh) {
+    if (argCount != 2) {
+      fprintf(stderr, "Usage: %s --compile-mesh input.obj output.rtmesh\n", argv[0]);
+      exit(1);
     }
-   *t = tNew;
-    return newObj;
-}
-
-void reflection(double** reflectColor, double* reflectObjNorm, int dp, double* Ro, double* Rd,
-  Obj** objs, Obj** light, double t) {
-    double reflectObj[3];
-    double tempRo[3];
-
-    currentIntersect(tempRo, Ro, Rd, t - 0.00001);
-    reflection_vector(Rd, reflectObjNorm, reflectObj);
-    *reflectColor = renderColor(dp - 1, tempRo, reflectObj, objs, light);
-
-}
-
-void refraction(double ior, double** refractColor, double* refractNorm, Obj* check, int dp,
-  double* Ro, double* Rd, Obj** objs,  Obj** light, double t) {
+    mesh_compile(args[0], args[1]);
+    return 0;
+  }
 
-  // Used to store new values of Ro, Rd, and t
-  double tempRo[3] = {0};
-  double tempRd[3] = {0};
-  double tNew;
+  // Primary rays go out in packets unless --simd off asks for one at a time.
+  RenderOptions opts;
+  opts.threads = tile_thread_count(threads);
+  opts.workers = workers;
+  opts.packets = NULL;
+  opts.gbuffer = NULL;
+  opts.reshade = 0;
+  opts.wavefront = wavefront;
+  opts.binning = binning;
+  opts.lightCutoff = lightCutoff;
+  if (strcmp(simd, "off") != 0) {
+    opts.packets = packet_kernel(simd);
+    if (opts.packets == NULL) {
+      fprintf(stderr, "Error: Packet kernel \"%s\" is unknown or not supported by this CPU.\n", simd);
+      exit(1);
+    }
+  }
 
-  currentIntersect(tempRo, Ro, Rd, t + 0.00001);
-  refraction_vector(Rd, refractNorm, tempRd, ior);
+  // A server loads its scenes on request and never renders on its own.
+  if (serveAddress != NULL) {
+    if (argCount != 0 || workers > 0 || stream || trackFile != NULL || regionCount > 0 || patch ||
+        saveGbuffer != NULL || reshadeGbuffer != NULL) {
+      fprintf(stderr, "Usage: %s --serve socket|- [--accel bvh|linear] [--threads N] [--simd auto|avx2|sse2|scalar|off] [--depth N] [--min-weight W] [--light-cutoff C] [--wavefront] [--bin]\n", argv[0]);
+      exit(1);
+    }
+    opts.maxDepth = maxDepth;
+    opts.minWeight = minWeight;
+    serve(serveAddress, &opts, useBvh);
+    return 0;
+  }
 
-  if(check->type == 2) {
-    tNew = plane_intersection(tempRo, tempRd, check);
-  } else if(check->type == 1) {
-    tNew = sphere_intersection(tempRo, tempRd, check);
-  } else {
-    fprintf(stderr, "Error: Something went wrong with Refraction.\n");
+  // Error checking the proper amount of arguments
+  if (argCount < 4) {
+    fprintf(stderr, "Error: Need 4 arguments for this project.\n");
+    fprintf(stderr, "Usage: %s [--accel bvh|linear] [--threads N] [--workers N] [--simd auto|avx2|sse2|scalar|off] [--depth N] [--min-weight W] [--light-cutoff C] [--ascii] [--stream] [--stats] [--wavefront] [--bin] [--animate track.json [--frames N]] [--region x0,y0,x1,y1 ...] [--patch] [--save-gbuffer file | --reshade file] width height input.json|input.rtsc output.ppm|-\n", argv[0]);
     exit(1);
   }
 
-  if(tNew != -1 && tNew != INFINITY) {
-    currentIntersect(tempRo, tempRo, tempRd, tNew + 0.00001);
-    v3_subtract(check->Sphere.position, tempRo, refractNorm);
-    normalize(refractNorm);
-    refraction_vector(tempRd, refractNorm, tempRd, (1.0 / ior));
+  // The G-buffer is filled and read by this process's render threads, one
+  // whole frame at a time.
+  if (saveGbuffer != NULL || reshadeGbuffer != NULL) {
+    if (saveGbuffer != NULL && reshadeGbuffer != NULL) {
+      fprintf(stderr, "Error: --save-gbuffer and --reshade can't be used together.\n");
+      exit(1);
+    }
+    if (workers > 0 || trackFile != NULL) {
+      fprintf(stderr, "Error: G-buffers can't be combined with --workers or --animate.\n");
+      exit(1);
+    }
+    if (saveGbuffer != NULL && regionCount > 0) {
+      fprintf(stderr, "Error: --save-gbuffer needs the whole frame, not a --region.\n");
+      exit(1);
+    }
   }
 
-  *refractColor = renderColor(dp - 1, tempRo, tempRd, objs, light);
-}
-
-double* renderColor(int dp, double* Ro, double* Rd, Obj** objs, Obj** light) {
-  double t = 0;
-
-  // Initializing variables and color array
-  double* col = malloc(sizeof(double)*3);
-  col[0] = 0;
-  col[1] = 0;
-  col[2] = 0;
-
-  Obj* obj = rayCast(&t, objs, NULL, Ro, Rd);
+  // Worker processes send whole tiles back in any order.
+  if (workers > 0 && stream) {
+    fprintf(stderr, "Error: --workers can't be combined with --stream.\n");
+    exit(1);
+  }
 
-  if(t == -1) {
-    return col;
+  // An animation writes one numbered file per frame, after its frame.
+  Track* track = NULL;
+  if (trackFile != NULL) {
+    if (stream) {
+      fprintf(stderr, "Error: --animate can't be combined with --stream.\n");
+      exit(1);
     }
-  double intersect[3] = {0, 0, 0};
-  double Norm[3] = {0, 0 ,0};
-  currentIntersect(intersect, Ro, Rd, t);
-
-  if(obj->type == 1) {
-    get_sphere_normal(obj, intersect, Norm);
-  } else if(obj->type == 2) {
-    get_plane_normal(obj, Norm);
+    if (strcmp(args[3], "-") == 0) {
+      fprintf(stderr, "Error: --animate writes numbered files, it needs an output name.\n");
+      exit(1);
+    }
+    track = read_track(trackFile);
+    // By default the animation runs until the last key.
+    if (frames < 0) {
+      frames = 1;
+      for (i = 0; i < track->count; i++) {
+        if (track->keys[i].frame + 1 > frames) {
+          frames = track->keys[i].frame + 1;
+        }
+      }
+    }
+  } else if (frames > 0) {
+    fprintf(stderr, "Error: --frames only applies with --animate.\n");
+    exit(1);
   }
 
-  // Setting up the lighting for diffuse and specular
-  double diffColor[3] = {0, 0, 0};
-  double totalDiff[3] = {0, 0, 0};
-  double specColor[3] = {0, 0, 0};
-  double totalSpec[3] = {0, 0, 0};
-  int i;
-
-  for(i = 0; light[i] !=  NULL; i++) {
-    double lightDirect[3] = {0, 0, 0};
-    double lightColor[3] = {0, 0, 0};
-    double lightObj[3] = {0, 0, 0};
-
-    v3_subtract(light[i]->Light.position, intersect, lightDirect);
-    double mag = sqrt(sqr(lightDirect[0]) + sqr(lightDirect[1]) + sqr(lightDirect[2]));
-    normalize(lightDirect);
-
-    // Testing the shadows
-    Obj* temp = rayCast(&t, objs, obj, intersect, lightDirect);
+  // Getting height and width values from the arguments.
+  int imgW = strtol(args[0], (char **)NULL, 10);
+  int imgH = strtol(args[1], (char **)NULL, 10);
 
-    if(t >= 0 && t < mag && temp->type != 2) {
-      continue;
+  // Regions are traced as parts of the full image, so they have to fit in
+  // it.
+  if (patch && regionCount == 0) {
+    fprintf(stderr, "Error: --patch needs at least one --region.\n");
+    exit(1);
+  }
+  if (regionCount > 0) {
+    if (stream || workers > 0 || track != NULL) {
+      fprintf(stderr, "Error: --region can't be combined with --stream, --workers or --animate.\n");
+      exit(1);
+    }
+    if (patch && (strcmp(args[3], "-") == 0 || ascii)) {
+      fprintf(stderr, "Error: --patch writes into an existing binary PPM file.\n");
+      exit(1);
     }
-    v3_scale(lightDirect, -1, lightObj);
-    if(light[i]->Light.direct != NULL) {
-      double dot = v3_dot(lightObj, light[i]->Light.direct);
-      if((dot) < sin(light[i]->Light.theta*M_PI/180)) {
-        continue;
+    for (i = 0; i < regionCount; i++) {
+      Tile* r = &regions[i];
+      if (r->x0 < 0 || r->y0 < 0 || r->x1 > imgW || r->y1 > imgH || r->x0 >= r->x1 ||
+          r->y0 >= r->y1) {
+        fprintf(stderr, "Error: Region %d,%d,%d,%d doesn't fit in the %ix%i image.\n", r->x0,
+          r->y0, r->x1, r->y1, imgW, imgH);
+        exit(1);
       }
-      v3_scale(lightColor, pow(dot, light[i]->Light.radial_a0), lightColor);
     }
-    // Less light as it is farther away
-    double radA = 1/(sqr(mag)*(light[i]->Light.radial_a2) + (light[i]->Light.radial_a1)*mag + light[i]->Light.radial_a0);
-    v3_scale(light[i]->diffuse, radA, lightColor);
-
-    // Getting the diffuse color
-    diffuse(diffColor, Norm, lightDirect, obj, lightColor);
-    v3_add(diffColor, totalDiff, totalDiff);
-
-    // Getting the specular color
-    specular(specColor, Norm, lightDirect, obj, lightColor, Rd);
-    v3_add(specColor, totalSpec, totalSpec);
-
   }
 
-  v3_add(col, totalDiff, col);
-  v3_add(col, totalSpec, col);
-
-
-  if(dp <= 0) {
-    return col;
+  // Error checking for the output file. "-" writes the image to stdout.
+  int toStdout = strcmp(args[3], "-") == 0;
+  FILE *output = toStdout ? stdout : track != NULL || patch ? NULL : fopen(args[3], "wb");
+  if (!output && track == NULL && !patch) {
+    fprintf(stderr, "Error: Failed to open file %s\n", args[3]);
+    return -1;
   }
 
-  double refractivity = obj->refractivity;
-  double reflectivity = obj->reflectivity;
-  double refracIndex = obj->refracIndex;
-  double* newCol;
-
-  v3_scale(col, 1.0 - (reflectivity + refractivity), col);
-
-
-
-  // Getting the reflection
-  reflection(&newCol, Norm, dp, Ro, Rd, objs, light, t);
-  v3_scale(newCol, reflectivity, newCol);
-  v3_add(col, newCol, col);
-
-  // Getting the refraction
-  refraction(refracIndex, &newCol, Norm, obj, dp, Ro, Rd, objs, light, t);
-  v3_scale(newCol, refractivity, newCol);
-  v3_add(col, newCol, col);
-
-  return col;
-}
-
-Color** sceneMaker(Obj** objs, Obj** light, int height, int width) {
-  // Coordinates of the camera
-  double cx = 0;
-  double cy = 0;
-
-  // Getting the color width and height
-  double h = objs[0]->Camera.height;
-  double w = objs[0]->Camera.width;
-  double* col;
-
-  int M = height;
-  int N = width;
-
-  Color** buff = malloc(M * N * sizeof(Color*));
-
-  double imgH = h / M;
-  double imgW = w / N;
-
-
-  int y, x;
-  for (y = 0; y < M; y++) {
-    for (x = 0; x < N; x++) {
-      double Ro[3] = {0, 0, 0};
-      double Rd[3] = {cx - (w / 2) + imgW * (x + 0.5),
-                      -(cy - (h / 2) + imgH * (y + 0.5)), 1};
-      normalize(Rd);
-      col = renderColor(7, Ro, Rd, objs, light);
-
-      // Setting the color and getting it's values
-      Color* color = malloc(sizeof(Color));
-      color->r = (unsigned char)clamp(col[0]*255);
-      color->g = (unsigned char)clamp(col[1]*255);
-      color->b = (unsigned char)clamp(col[2]*255);
-      buff[y*N + x] = color;
+  // Parse, render and write times for --stats.
+  double seconds[3];
+  double start = now();
+
+  Color* buff;
+  Scene scene;
+  scene_load(args[2], &scene, useBvh);
+  seconds[0] = now() - start;
+
+  // The command line wins over the scene's camera, which wins over the
+  // defaults.
+  Obj* camera = scene.objs[0];
+  if (maxDepth < 0) {
+    maxDepth = camera->Camera.maxDepth >= 0 ? (int)camera->Camera.maxDepth : DEFAULT_DEPTH;
+    if (maxDepth > MAX_TRACE_DEPTH) {
+      fprintf(stderr, "Error: The scene's max_depth must be at most %d.\n", MAX_TRACE_DEPTH);
+      exit(1);
     }
   }
-  return buff;
-}
-
-int main(int argc, char *argv[]) {
-
-  // Error checking the proper amount of arguments
-  if (argc < 5) {
-    fprintf(stderr, "Error: Need 4 arguments for this project.\n");
-    exit(1);
+  if (minWeight < 0) {
+    minWeight = camera->Camera.minWeight >= 0 ? camera->Camera.minWeight : DEFAULT_MIN_WEIGHT;
+  }
+  opts.maxDepth = maxDepth;
+  opts.minWeight = minWeight;
+
+  // Reshading skips every primary ray; only shadows and bounces are traced.
+  if (reshadeGbuffer != NULL) {
+    opts.gbuffer = gbuffer_load(reshadeGbuffer, &scene, imgW, imgH);
+    opts.reshade = 1;
+  } else if (saveGbuffer != NULL) {
+    opts.gbuffer = gbuffer_create(imgW, imgH);
   }
 
-  // Getting height and width values from the arguments.
-  int imgW = strtol(argv[1], (char **)NULL, 10);
-  int imgH = strtol(argv[2], (char **)NULL, 10);
-
-  char *fput = argv[3];
+  start = now();
+  if (track != NULL) {
+    // Writing overlaps the next frame, so it all counts as rendering.
+    anim_render(&scene, track, &opts, imgW, imgH, frames, args[3], ascii);
+    seconds[1] = now() - start;
+    start = now();
+  } else if (patch) {
+    // Each region's rows go into the file as soon as the region is done.
+    regions_patch(&scene, imgH, imgW, &opts, regions, regionCount, args[3]);
+    seconds[1] = now() - start;
+    start = now();
+  } else if (regionCount > 0) {
+    regions_crop(&scene, imgH, imgW, &opts, regions, regionCount, ascii, output);
+    seconds[1] = now() - start;
+    start = now();
+  } else if (stream) {
+    PpmSink sink;
+    ppm_begin(&sink, output, imgW, imgH, ascii);
+    sceneStreamer(&scene, imgH, imgW, &opts, &sink);
+    seconds[1] = now() - start;
+    start = now();
+    ppm_end(&sink);
+  } else {
+    buff = sceneMaker(&scene, imgH, imgW, &opts);
+    seconds[1] = now() - start;
+    start = now();
+    // Creates the PPM picture in the output file
+    ppmMaker(buff, imgW, imgH, ascii, output);
+  }
+  if (saveGbuffer != NULL) {
+    gbuffer_save(opts.gbuffer, &scene, saveGbuffer);
+  }
+  seconds[2] = now() - start;
 
-  // Error checking for the output file.
-  FILE *output = fopen(argv[4], "wb");
-  if (!output) {
-    fprintf(stderr, "Error: Failed to open file %s\n", argv[4]);
+  if (!toStdout) {
+    printf("We made it here.\n");
+  }
+  fprintf(toStdout ? stderr : stdout, "Secondary rays: %ld traced, %ld skipped below weight %g (depth %d)\n",
+    opts.rays.traced, opts.rays.pruned, opts.minWeight, opts.maxDepth);
+  if (stats) {
+    printStats(&opts, imgW, imgH, seconds);
+  }
+#ifdef ALLOC_CHECK
+  // The shading path must never touch the heap.
+  long allocs = render_alloc_count();
+  fprintf(toStdout ? stderr : stdout, "Heap allocations while tracing: %ld\n", allocs);
+  if (allocs != 0) {
+    return 1;
+  }
+#endif
+  if (output != NULL) {
     fclose(output);
-    return -1;
   }
-
-  Color** buff;
-  Obj** objs;
-  Obj** light = malloc(sizeof(Obj*)*128);
-
-  objs = read_scene(argv[3], light);
-  buff = sceneMaker(objs, light, imgH, imgW);
-  printf("We made it here.\n");
-  // Creates the PPM picture in the output file
-  ppmMaker(buff, imgH, imgW, output);
   return 0;
 }
@@ -0,0 +1,365 @@
+#include "header.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Triangle meshes, read from a Wavefront OBJ file or from a compiled mesh.
+// Either way a mesh ends up as two flat arrays, the vertices and three
+// vertex numbers per triangle, with the triangles in the leaf order of the
+// mesh's own BVH so every leaf is a contiguous run of them. An OBJ is
+// parsed and gets its tree built on every load; a compiled mesh holds the
+// arrays and the tree exactly as they sit in memory and is mapped in place,
+// so loading one costs no more than checking it.
+#define MESH_MAGIC "RTMS"
+#define MESH_VERSION 1
+#define MESH_BYTE_ORDER 0x01020304u
+
+// Sections start on this boundary so the mapped arrays are aligned.
+#define MESH_ALIGN 64
+
+// Triangle numbers become primitive numbers, which are ints.
+#define MESH_MAX_TRIANGLES (INT_MAX / 4)
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t scalarSize;  // sizeof(real) of the build, which verts and the nodes use
+  uint32_t vertCount;
+  uint32_t triCount;
+  uint32_t nodeCount;
+  uint32_t bvhDepth;
+  uint64_t vertOffset;
+  uint64_t indexOffset;
+  uint64_t nodeOffset;
+  uint64_t size;
+} MeshHeader;
+
+// Maps filename read-only and returns the mapping, with its size in *size.
+static char* map_mesh(char* filename, size_t* size) {
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  if (st.st_size == 0) {
+    fprintf(stderr, "Error: Mesh file \"%s\" is empty.\n", filename);
+    exit(1);
+  }
+  char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not map file \"%s\"\n", filename);
+    exit(1);
+  }
+  *size = st.st_size;
+  return data;
+}
+
+// Growable array of count elements of elem bytes.
+static void* mesh_grow(void* items, size_t* capacity, size_t count, size_t elem) {
+  if (count < *capacity) {
+    return items;
+  }
+  *capacity = *capacity > 0 ? *capacity * 2 : 1024;
+  items = realloc(items, *capacity * elem);
+  if (items == NULL) {
+    fprintf(stderr, "Error: Out of memory while reading the mesh.\n");
+    exit(1);
+  }
+  return items;
+}
+
+static void obj_error(char* filename, int line, const char* what) {
+  fprintf(stderr, "Error: %s on line %d of mesh \"%s\".\n", what, line, filename);
+  exit(1);
+}
+
+static inline int is_blank(int c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Reads the vertex number of a face corner, skipping any "/texture/normal"
+// numbers after it. Negative numbers count back from the last vertex read.
+static uint32_t obj_corner(const char** cur, const char* end, size_t vertCount, char* filename,
+  int line) {
+  const char* s = *cur;
+  int neg = 0;
+  uint64_t n = 0;
+
+  if (s < end && *s == '-') {
+    neg = 1;
+    s++;
+  }
+  if (s >= end || (unsigned)(*s - '0') >= 10) {
+    obj_error(filename, line, "Expected a vertex number");
+  }
+  while (s < end && (unsigned)(*s - '0') < 10) {
+    if (n <= vertCount) {
+      n = n * 10 + (*s - '0');
+    }
+    s++;
+  }
+  while (s < end && !is_blank(*s)) {
+    s++;
+  }
+  *cur = s;
+
+  if (n == 0 || n > vertCount) {
+    obj_error(filename, line, "Bad vertex number");
+  }
+  return neg ? (uint32_t)(vertCount - n) : (uint32_t)(n - 1);
+}
+
+// Reads the vertices (v) and faces (f) of an OBJ file; everything else in
+// it, normals and texture coordinates included, is skipped. Faces with more
+// than three corners are split into a fan of triangles.
+static void read_obj(Mesh* mesh, char* filename, const char* data, size_t size) {
+  const char* s = data;
+  const char* end = data + size;
+  size_t vertCap = 0, indexCap = 0, vertCount = 0, triCount = 0;
+  real* verts = NULL;
+  uint32_t* index = NULL;
+  int line = 0;
+
+  while (s < end) {
+    const char* eol = memchr(s, '\n', end - s);
+    if (eol == NULL) {
+      eol = end;
+    }
+    line++;
+    while (s < eol && is_blank(*s)) {
+      s++;
+    }
+
+    if (eol - s >= 2 && s[0] == 'v' && is_blank(s[1])) {
+      int a;
+      verts = mesh_grow(verts, &vertCap, vertCount * 3 + 2, sizeof(real));
+      s++;
+      for (a = 0; a < 3; a++) {
+        double v;
+        while (s < eol && is_blank(*s)) {
+          s++;
+        }
+        const char* error = scan_number(&s, eol, &v);
+        if (error != NULL) {
+          obj_error(filename, line, error);
+        }
+        verts[vertCount * 3 + a] = v;
+      }
+      if (++vertCount > INT_MAX) {
+        obj_error(filename, line, "Too many vertices");
+      }
+    } else if (eol - s >= 2 && s[0] == 'f' && is_blank(s[1])) {
+      uint32_t first = 0, prev = 0;
+      int corners = 0;
+      s++;
+      while (1) {
+        while (s < eol && is_blank(*s)) {
+          s++;
+        }
+        if (s >= eol) {
+          break;
+        }
+        uint32_t v = obj_corner(&s, eol, vertCount, filename, line);
+        if (corners == 0) {
+          first = v;
+        } else if (corners >= 2) {
+          index = mesh_grow(index, &indexCap, triCount * 3 + 2, sizeof(uint32_t));
+          index[triCount * 3] = first;
+          index[triCount * 3 + 1] = prev;
+          index[triCount * 3 + 2] = v;
+          if (++triCount > MESH_MAX_TRIANGLES) {
+            obj_error(filename, line, "Too many triangles");
+          }
+        }
+        prev = v;
+        corners++;
+      }
+      if (corners < 3) {
+        obj_error(filename, line, "Face with fewer than three corners");
+      }
+    }
+    s = eol + 1;
+  }
+
+  if (triCount == 0) {
+    fprintf(stderr, "Error: Mesh \"%s\" has no faces.\n", filename);
+    exit(1);
+  }
+  mesh->verts = verts;
+  mesh->index = index;
+  mesh->vertCount = vertCount;
+  mesh->triCount = triCount;
+}
+
+// Builds the mesh's tree and puts the triangles in its leaf order.
+static void build_mesh(Mesh* mesh) {
+  Bvh* bvh = bvh_build_triangles(mesh->verts, mesh->index, mesh->triCount);
+  uint32_t* index = malloc(sizeof(uint32_t) * 3 * (size_t)mesh->triCount);
+  int i;
+
+  if (index == NULL) {
+    fprintf(stderr, "Error: Out of memory while reading the mesh.\n");
+    exit(1);
+  }
+  for (i = 0; i < mesh->triCount; i++) {
+    memcpy(&index[3 * (size_t)i], &mesh->index[3 * (size_t)bvh->prims[i]], 3 * sizeof(uint32_t));
+  }
+  free(mesh->index);
+  mesh->index = index;
+
+  // The order is in index now, the tree doesn't need its own copy.
+  free(bvh->prims);
+  bvh->prims = NULL;
+  mesh->bvh = bvh;
+  mesh->mapped = 0;
+}
+
+static void mesh_check(int ok, char* filename, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "Error: Compiled mesh \"%s\" %s.\n", filename, what);
+    exit(1);
+  }
+}
+
+// Points mesh into a mapped compiled mesh. Vertex numbers and the tree are
+// checked before use: a bad index would read outside the mapping and a
+// node pointing backwards would loop the traversal forever.
+static void load_compiled(Mesh* mesh, char* filename, char* data, size_t size) {
+  MeshHeader* h = (MeshHeader*)data;
+  uint32_t i;
+
+  mesh_check(size >= sizeof(MeshHeader), filename, "is truncated");
+  mesh_check(h->byteOrder == MESH_BYTE_ORDER, filename, "was compiled for a different machine");
+  if (h->version != MESH_VERSION) {
+    fprintf(stderr, "Error: Compiled mesh \"%s\" is version %u, expected %u. Compile it again.\n",
+      filename, h->version, MESH_VERSION);
+    exit(1);
+  }
+  if (h->scalarSize != sizeof(real)) {
+    fprintf(stderr, "Error: Compiled mesh \"%s\" is for a %s build, this one is %s. Compile it again.\n",
+      filename, h->scalarSize == sizeof(float) ? "float" : "double", REAL_NAME);
+    exit(1);
+  }
+  mesh_check(h->size == size, filename, "is truncated");
+  mesh_check(h->triCount > 0 && h->triCount <= MESH_MAX_TRIANGLES && h->nodeCount > 0 &&
+    h->vertOffset + (uint64_t)h->vertCount * 3 * sizeof(real) <= size &&
+    h->indexOffset + (uint64_t)h->triCount * 3 * sizeof(uint32_t) <= size &&
+    h->nodeOffset + (uint64_t)h->nodeCount * sizeof(BvhNode) <= size,
+    filename, "is corrupt");
+
+  mesh->verts = (real*)(data + h->vertOffset);
+  mesh->index = (uint32_t*)(data + h->indexOffset);
+  mesh->vertCount = h->vertCount;
+  mesh->triCount = h->triCount;
+  for (i = 0; i < 3 * h->triCount; i++) {
+    mesh_check(mesh->index[i] < h->vertCount, filename, "has a bad vertex number");
+  }
+
+  BvhNode* nodes = (BvhNode*)(data + h->nodeOffset);
+  mesh_check(bvh_nodes_valid(nodes, h->nodeCount, h->triCount), filename, "has a corrupt BVH");
+
+  mesh->bvh = malloc(sizeof(Bvh));
+  if (mesh->bvh == NULL) {
+    fprintf(stderr, "Error: Out of memory while loading the mesh.\n");
+    exit(1);
+  }
+  mesh->bvh->nodes = nodes;
+  mesh->bvh->nodeCount = h->nodeCount;
+  mesh->bvh->depth = h->bvhDepth;
+  mesh->bvh->prims = NULL;
+  mesh->bvh->primCount = h->triCount;
+  mesh->bvh->mapped = 1;
+  mesh->mapped = 1;
+}
+
+// Loads a mesh from an OBJ file or a compiled mesh, whichever filename is.
+void mesh_load(Mesh* mesh, char* filename) {
+  size_t size;
+  char* data = map_mesh(filename, &size);
+
+  if (size >= sizeof(MeshHeader) && memcmp(data, MESH_MAGIC, 4) == 0) {
+    load_compiled(mesh, filename, data, size);
+    return;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  read_obj(mesh, filename, data, size);
+  munmap(data, size);
+  build_mesh(mesh);
+}
+
+// Frees a loaded mesh. A compiled mesh's mapping is left alone, the way a
+// compiled scene's is.
+void mesh_free(Mesh* mesh) {
+  if (!mesh->mapped) {
+    free(mesh->verts);
+    free(mesh->index);
+  }
+  bvh_free(mesh->bvh);
+}
+
+static void mesh_write(FILE* out, uint64_t* offset, const void* data, size_t size) {
+  if (size > 0 && fwrite(data, 1, size, out) != size) {
+    fprintf(stderr, "Error: Failed to write the compiled mesh.\n");
+    exit(1);
+  }
+  *offset += size;
+}
+
+static uint64_t mesh_align(FILE* out, uint64_t* offset) {
+  static const char zeros[MESH_ALIGN] = {0};
+  mesh_write(out, offset, zeros, (MESH_ALIGN - *offset % MESH_ALIGN) % MESH_ALIGN);
+  return *offset;
+}
+
+// Reads a mesh, OBJ or already compiled, and writes it out compiled for
+// this build's reals.
+void mesh_compile(char* input, char* output) {
+  MeshHeader header;
+  Mesh mesh;
+  uint64_t offset = 0;
+
+  mesh_load(&mesh, input);
+  FILE* out = fopen(output, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Error: Failed to open file %s\n", output);
+    exit(1);
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MESH_MAGIC, 4);
+  header.version = MESH_VERSION;
+  header.byteOrder = MESH_BYTE_ORDER;
+  header.scalarSize = sizeof(real);
+  header.vertCount = mesh.vertCount;
+  header.triCount = mesh.triCount;
+  header.nodeCount = mesh.bvh->nodeCount;
+  header.bvhDepth = mesh.bvh->depth;
+
+  // The header goes out twice: once to reserve its space, and again at the
+  // end once every offset is known.
+  mesh_write(out, &offset, &header, sizeof(header));
+  header.vertOffset = mesh_align(out, &offset);
+  mesh_write(out, &offset, mesh.verts, sizeof(real) * 3 * (size_t)mesh.vertCount);
+  header.indexOffset = mesh_align(out, &offset);
+  mesh_write(out, &offset, mesh.index, sizeof(uint32_t) * 3 * (size_t)mesh.triCount);
+  header.nodeOffset = mesh_align(out, &offset);
+  mesh_write(out, &offset, mesh.bvh->nodes, sizeof(BvhNode) * mesh.bvh->nodeCount);
+  header.size = offset;
+
+  if (fseek(out, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Error: Failed to write the compiled mesh.\n");
+    exit(1);
+  }
+  mesh_write(out, &offset, &header, sizeof(header));
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Error: Failed to write the compiled mesh.\n");
+    exit(1);
+  }
+  mesh_free(&mesh);
+}
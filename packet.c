@@ -0,0 +1,528 @@
+#include "header.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACKET_X86 1
+#endif
+
+// Packet tracing for primary rays. A packet walks the BVH as one: a node is
+// entered when any lane's ray hits its box, and every leaf it reaches is
+// tested against all four rays at once. Each lane keeps its own closest hit,
+// so the answer per ray is the one rayCast() gives, just computed with one
+// instruction per group of lanes. The vector kernels do the exact same
+// operations as sphere_intersection() and plane_intersection(), in the same
+// order and without fused multiply-adds, so images match the scalar path
+// bit for bit.
+//
+// Three sets of kernels exist: plain C, SSE2 (two lanes per instruction)
+// and AVX2 (four lanes). packet_kernel() picks one at run time. In a float
+// build (-DRT_FLOAT) SSE2 already covers all four lanes at once.
+
+// Lanes whose ray hits the box before its current t, as a bitmask. *tNear
+// gets the nearest entry distance among them.
+typedef int (*BoxKernel)(BvhNode* n, RayPacket* p, real* tNear);
+
+// Narrows every lane's closest hit over spheres [start, end).
+typedef void (*SphereKernel)(SphereSet* s, int start, int end, RayPacket* p);
+
+// Narrows every lane's closest hit over all planes.
+typedef void (*PlaneKernel)(PlaneSet* planes, int first, RayPacket* p);
+
+// Shared traversal. Always inlined into each kernel set's entry point, so
+// the kernel calls below become direct and get inlined as well.
+static inline __attribute__((always_inline)) void packet_traverse(Scene* scene, RayPacket* p,
+  BoxKernel box, SphereKernel spheres, PlaneKernel planes) {
+  Bvh* bvh = scene->bvh;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  int lane;
+
+  for (lane = 0; lane < PACKET_SIZE; lane++) {
+    p->ix[lane] = 1 / p->dx[lane];
+    p->iy[lane] = 1 / p->dy[lane];
+    p->iz[lane] = 1 / p->dz[lane];
+    p->t[lane] = INFINITY;
+    p->prim[lane] = -1;
+  }
+
+  // Planes first, like rayCast(), so ties resolve the same way. Every
+  // kernel works on all lanes, so each call counts as PACKET_SIZE tests.
+  threadRays.planeTests += PACKET_SIZE * scene->planes.count;
+  planes(&scene->planes, scene->spheres.count, p);
+
+  if (bvh == NULL) {
+    threadRays.sphereTests += PACKET_SIZE * scene->spheres.count;
+    spheres(&scene->spheres, 0, scene->spheres.count, p);
+  } else if (bvh->primCount > 0) {
+    real tl, tr;
+    threadRays.boxTests += PACKET_SIZE;
+    if (box(&bvh->nodes[0], p, &tl)) {
+      stack[top++] = 0;
+    }
+    while (top > 0) {
+      BvhNode* n = &bvh->nodes[stack[--top]];
+
+      if (n->count > 0) {
+        threadRays.sphereTests += PACKET_SIZE * n->count;
+        spheres(&scene->spheres, n->start, n->start + n->count, p);
+        continue;
+      }
+
+      // The child the packet reaches first goes on top of the stack.
+      threadRays.boxTests += 2 * PACKET_SIZE;
+      int hitL = box(&bvh->nodes[n->start], p, &tl);
+      int hitR = box(&bvh->nodes[n->start + 1], p, &tr);
+      if (!hitL) tl = INFINITY;
+      if (!hitR) tr = INFINITY;
+      if (tl <= tr) {
+        if (hitR) stack[top++] = n->start + 1;
+        if (hitL) stack[top++] = n->start;
+      } else {
+        if (hitL) stack[top++] = n->start;
+        if (hitR) stack[top++] = n->start + 1;
+      }
+    }
+  }
+
+  // Mesh instances go one lane at a time through their own trees.
+  if (scene->meshes.instanceCount > 0) {
+    for (lane = 0; lane < PACKET_SIZE; lane++) {
+      real Ro[3] = {p->ox[lane], p->oy[lane], p->oz[lane]};
+      real Rd[3] = {p->dx[lane], p->dy[lane], p->dz[lane]};
+      bvh_cast_instances(scene, -1, Ro, Rd, &p->t[lane], &p->prim[lane]);
+    }
+  }
+
+  for (lane = 0; lane < PACKET_SIZE; lane++) {
+    if (p->prim[lane] < 0) {
+      p->t[lane] = -1;
+    }
+  }
+}
+
+// Plain C kernels, one lane at a time.
+
+static int box_scalar(BvhNode* n, RayPacket* p, real* tNear) {
+  int lane, mask = 0;
+  *tNear = INFINITY;
+  for (lane = 0; lane < PACKET_SIZE; lane++) {
+    real t0 = (n->min[0] - p->ox[lane]) * p->ix[lane];
+    real t1 = (n->max[0] - p->ox[lane]) * p->ix[lane];
+    real lo = real_fmin(t0, t1);
+    real hi = real_fmax(t0, t1);
+
+    t0 = (n->min[1] - p->oy[lane]) * p->iy[lane];
+    t1 = (n->max[1] - p->oy[lane]) * p->iy[lane];
+    lo = real_fmax(lo, real_fmin(t0, t1));
+    hi = real_fmin(hi, real_fmax(t0, t1));
+
+    t0 = (n->min[2] - p->oz[lane]) * p->iz[lane];
+    t1 = (n->max[2] - p->oz[lane]) * p->iz[lane];
+    lo = real_fmax(lo, real_fmin(t0, t1));
+    hi = real_fmin(hi, real_fmax(t0, t1));
+
+    if (hi < lo || hi < 0 || lo > p->t[lane]) {
+      continue;
+    }
+    mask |= 1 << lane;
+    if (lo < *tNear) {
+      *tNear = lo;
+    }
+  }
+  return mask;
+}
+
+static void spheres_scalar(SphereSet* s, int start, int end, RayPacket* p) {
+  int lane, i;
+  for (lane = 0; lane < PACKET_SIZE; lane++) {
+    real Ro[3] = {p->ox[lane], p->oy[lane], p->oz[lane]};
+    real Rd[3] = {p->dx[lane], p->dy[lane], p->dz[lane]};
+    for (i = start; i < end; i++) {
+      real tVal = sphere_intersection(s, i, Ro, Rd);
+      if (tVal < p->t[lane] && tVal != -1) {
+        p->t[lane] = tVal;
+        p->prim[lane] = i;
+      }
+    }
+  }
+}
+
+static void planes_scalar(PlaneSet* planes, int first, RayPacket* p) {
+  int lane, i;
+  for (lane = 0; lane < PACKET_SIZE; lane++) {
+    real Ro[3] = {p->ox[lane], p->oy[lane], p->oz[lane]};
+    real Rd[3] = {p->dx[lane], p->dy[lane], p->dz[lane]};
+    for (i = 0; i < planes->count; i++) {
+      real tVal = plane_intersection(planes, i, Ro, Rd);
+      if (tVal < p->t[lane] && tVal != -1) {
+        p->t[lane] = tVal;
+        p->prim[lane] = first + i;
+      }
+    }
+  }
+}
+
+static void packet_cast_scalar(Scene* scene, RayPacket* p) {
+  packet_traverse(scene, p, box_scalar, spheres_scalar, planes_scalar);
+}
+
+#ifdef PACKET_X86
+
+// SSE2 kernels. Every x86-64 CPU has SSE2, so these need no target switch.
+// Each works on lanes [base, base + SSE_LANES): two doubles per register,
+// or the whole packet at once in a float build. The sse_ names below pick
+// the _pd or _ps form of each instruction.
+
+#ifdef RT_FLOAT
+typedef __m128 vsse;
+#define SSE_LANES 4
+#define sse_load _mm_load_ps
+#define sse_store _mm_store_ps
+#define sse_storeu _mm_storeu_ps
+#define sse_set1 _mm_set1_ps
+#define sse_setzero _mm_setzero_ps
+#define sse_add _mm_add_ps
+#define sse_sub _mm_sub_ps
+#define sse_mul _mm_mul_ps
+#define sse_div _mm_div_ps
+#define sse_sqrt _mm_sqrt_ps
+#define sse_min _mm_min_ps
+#define sse_max _mm_max_ps
+#define sse_and _mm_and_ps
+#define sse_andnot _mm_andnot_ps
+#define sse_or _mm_or_ps
+#define sse_xor _mm_xor_ps
+#define sse_cmplt _mm_cmplt_ps
+#define sse_cmpgt _mm_cmpgt_ps
+#define sse_cmpge _mm_cmpge_ps
+#define sse_cmpneq _mm_cmpneq_ps
+#define sse_movemask _mm_movemask_ps
+#else
+typedef __m128d vsse;
+#define SSE_LANES 2
+#define sse_load _mm_load_pd
+#define sse_store _mm_store_pd
+#define sse_storeu _mm_storeu_pd
+#define sse_set1 _mm_set1_pd
+#define sse_setzero _mm_setzero_pd
+#define sse_add _mm_add_pd
+#define sse_sub _mm_sub_pd
+#define sse_mul _mm_mul_pd
+#define sse_div _mm_div_pd
+#define sse_sqrt _mm_sqrt_pd
+#define sse_min _mm_min_pd
+#define sse_max _mm_max_pd
+#define sse_and _mm_and_pd
+#define sse_andnot _mm_andnot_pd
+#define sse_or _mm_or_pd
+#define sse_xor _mm_xor_pd
+#define sse_cmplt _mm_cmplt_pd
+#define sse_cmpgt _mm_cmpgt_pd
+#define sse_cmpge _mm_cmpge_pd
+#define sse_cmpneq _mm_cmpneq_pd
+#define sse_movemask _mm_movemask_pd
+#endif
+
+#define SSE_ALL ((1 << SSE_LANES) - 1)
+
+// minpd/maxpd return the second operand when either side is NaN, where
+// fmin/fmax return the number. The only NaN here is 0 * inf, for a ray that
+// runs exactly along a slab face, and dropping it can only widen the
+// [near, far] interval, so the vector box test never rejects a box the
+// scalar one accepts.
+static int box_sse2(BvhNode* n, RayPacket* p, real* tNear) {
+  int base, mask = 0;
+  *tNear = INFINITY;
+  for (base = 0; base < PACKET_SIZE; base += SSE_LANES) {
+    vsse o = sse_load(p->ox + base), inv = sse_load(p->ix + base);
+    vsse t0 = sse_mul(sse_sub(sse_set1(n->min[0]), o), inv);
+    vsse t1 = sse_mul(sse_sub(sse_set1(n->max[0]), o), inv);
+    vsse lo = sse_min(t0, t1);
+    vsse hi = sse_max(t0, t1);
+
+    o = sse_load(p->oy + base);
+    inv = sse_load(p->iy + base);
+    t0 = sse_mul(sse_sub(sse_set1(n->min[1]), o), inv);
+    t1 = sse_mul(sse_sub(sse_set1(n->max[1]), o), inv);
+    lo = sse_max(lo, sse_min(t0, t1));
+    hi = sse_min(hi, sse_max(t0, t1));
+
+    o = sse_load(p->oz + base);
+    inv = sse_load(p->iz + base);
+    t0 = sse_mul(sse_sub(sse_set1(n->min[2]), o), inv);
+    t1 = sse_mul(sse_sub(sse_set1(n->max[2]), o), inv);
+    lo = sse_max(lo, sse_min(t0, t1));
+    hi = sse_min(hi, sse_max(t0, t1));
+
+    vsse miss = sse_or(sse_cmplt(hi, lo),
+      sse_or(sse_cmplt(hi, sse_setzero()), sse_cmpgt(lo, sse_load(p->t + base))));
+    int hit = ~sse_movemask(miss) & SSE_ALL;
+    if (hit) {
+      real near[SSE_LANES];
+      int lane;
+      sse_storeu(near, lo);
+      for (lane = 0; lane < SSE_LANES; lane++) {
+        if ((hit & (1 << lane)) && near[lane] < *tNear) *tNear = near[lane];
+      }
+      mask |= hit << base;
+    }
+  }
+  return mask;
+}
+
+static void spheres_sse2(SphereSet* s, int start, int end, RayPacket* p) {
+  vsse two = sse_set1(2), four = sse_set1(4);
+  vsse none = sse_set1(-1), zero = sse_setzero();
+  vsse sign = sse_set1(-0.0);
+  int base, i, lane;
+
+  for (base = 0; base < PACKET_SIZE; base += SSE_LANES) {
+    vsse ox = sse_load(p->ox + base), oy = sse_load(p->oy + base), oz = sse_load(p->oz + base);
+    vsse dx = sse_load(p->dx + base), dy = sse_load(p->dy + base), dz = sse_load(p->dz + base);
+    vsse best = sse_load(p->t + base);
+
+    // The parts of the quadratic that only depend on the ray.
+    vsse a = sse_add(sse_add(sse_mul(dx, dx), sse_mul(dy, dy)), sse_mul(dz, dz));
+    vsse twoA = sse_mul(two, a), fourA = sse_mul(four, a);
+    vsse tdx = sse_mul(two, dx), tdy = sse_mul(two, dy), tdz = sse_mul(two, dz);
+    vsse oo = sse_add(sse_add(sse_mul(ox, ox), sse_mul(oy, oy)), sse_mul(oz, oz));
+
+    for (i = start; i < end; i++) {
+      vsse px = sse_set1(s->cx[i]), py = sse_set1(s->cy[i]), pz = sse_set1(s->cz[i]);
+      vsse b = sse_add(sse_add(sse_mul(tdx, sse_sub(ox, px)),
+        sse_mul(tdy, sse_sub(oy, py))), sse_mul(tdz, sse_sub(oz, pz)));
+      vsse dot = sse_add(sse_add(sse_mul(px, ox), sse_mul(py, oy)), sse_mul(pz, oz));
+      vsse c = sse_sub(sse_add(sse_set1(s->cc[i]), oo), sse_mul(two, dot));
+
+      vsse d = sse_sub(sse_mul(b, b), sse_mul(fourA, c));
+      // Most tests miss outright; skip the square root and divides then.
+      if (sse_movemask(sse_cmpge(d, zero)) == 0) {
+        continue;
+      }
+      vsse root = sse_sqrt(d);
+      vsse negB = sse_xor(b, sign);
+      vsse t0 = sse_div(sse_sub(negB, root), twoA);
+      vsse t1 = sse_div(sse_add(negB, root), twoA);
+
+      // t0 if it is in front, else t1 if that is, else -1.
+      vsse use0 = sse_cmpgt(t0, zero), use1 = sse_cmpgt(t1, zero);
+      vsse tVal = sse_or(sse_and(use1, t1), sse_andnot(use1, none));
+      tVal = sse_or(sse_and(use0, t0), sse_andnot(use0, tVal));
+      vsse hit = sse_andnot(sse_cmplt(d, zero),
+        sse_and(sse_cmplt(tVal, best), sse_cmpneq(tVal, none)));
+
+      int mask = sse_movemask(hit);
+      if (mask) {
+        best = sse_or(sse_and(hit, tVal), sse_andnot(hit, best));
+        for (lane = 0; lane < SSE_LANES; lane++) {
+          if (mask & (1 << lane)) p->prim[base + lane] = i;
+        }
+      }
+    }
+    sse_store(p->t + base, best);
+  }
+}
+
+static void planes_sse2(PlaneSet* planes, int first, RayPacket* p) {
+  vsse none = sse_set1(-1), zero = sse_setzero();
+  vsse sign = sse_set1(-0.0);
+  int base, i, lane;
+
+  for (base = 0; base < PACKET_SIZE; base += SSE_LANES) {
+    vsse ox = sse_load(p->ox + base), oy = sse_load(p->oy + base), oz = sse_load(p->oz + base);
+    vsse dx = sse_load(p->dx + base), dy = sse_load(p->dy + base), dz = sse_load(p->dz + base);
+    vsse best = sse_load(p->t + base);
+
+    for (i = 0; i < planes->count; i++) {
+      vsse nx = sse_set1(planes->nx[i]), ny = sse_set1(planes->ny[i]), nz = sse_set1(planes->nz[i]);
+      vsse dist = sse_add(sse_add(sse_mul(nx, ox), sse_mul(ny, oy)), sse_mul(nz, oz));
+      dist = sse_sub(dist, sse_set1(planes->d[i]));
+      vsse denom = sse_add(sse_add(sse_mul(nx, dx), sse_mul(ny, dy)), sse_mul(nz, dz));
+      dist = sse_xor(sse_div(dist, denom), sign);
+
+      vsse front = sse_cmpgt(dist, zero);
+      vsse tVal = sse_or(sse_and(front, dist), sse_andnot(front, none));
+      vsse hit = sse_and(sse_cmplt(tVal, best), sse_cmpneq(tVal, none));
+
+      int mask = sse_movemask(hit);
+      if (mask) {
+        best = sse_or(sse_and(hit, tVal), sse_andnot(hit, best));
+        for (lane = 0; lane < SSE_LANES; lane++) {
+          if (mask & (1 << lane)) p->prim[base + lane] = first + i;
+        }
+      }
+    }
+    sse_store(p->t + base, best);
+  }
+}
+
+static void packet_cast_sse2(Scene* scene, RayPacket* p) {
+  packet_traverse(scene, p, box_sse2, spheres_sse2, planes_sse2);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+#ifndef RT_FLOAT
+
+// AVX2 kernels, all four lanes per instruction. FMA is deliberately left
+// off so the rounding matches the scalar code. A float build already has
+// the whole packet in one SSE register, so these are only built for double.
+
+AVX2 static int box_avx2(BvhNode* n, RayPacket* p, double* tNear) {
+  __m256d o = _mm256_load_pd(p->ox), inv = _mm256_load_pd(p->ix);
+  __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(n->min[0]), o), inv);
+  __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(n->max[0]), o), inv);
+  __m256d lo = _mm256_min_pd(t0, t1);
+  __m256d hi = _mm256_max_pd(t0, t1);
+
+  o = _mm256_load_pd(p->oy);
+  inv = _mm256_load_pd(p->iy);
+  t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(n->min[1]), o), inv);
+  t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(n->max[1]), o), inv);
+  lo = _mm256_max_pd(lo, _mm256_min_pd(t0, t1));
+  hi = _mm256_min_pd(hi, _mm256_max_pd(t0, t1));
+
+  o = _mm256_load_pd(p->oz);
+  inv = _mm256_load_pd(p->iz);
+  t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(n->min[2]), o), inv);
+  t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(n->max[2]), o), inv);
+  lo = _mm256_max_pd(lo, _mm256_min_pd(t0, t1));
+  hi = _mm256_min_pd(hi, _mm256_max_pd(t0, t1));
+
+  __m256d miss = _mm256_or_pd(_mm256_cmp_pd(hi, lo, _CMP_LT_OQ),
+    _mm256_or_pd(_mm256_cmp_pd(hi, _mm256_setzero_pd(), _CMP_LT_OQ),
+      _mm256_cmp_pd(lo, _mm256_load_pd(p->t), _CMP_GT_OQ)));
+  int mask = ~_mm256_movemask_pd(miss) & 15;
+  int lane;
+
+  *tNear = INFINITY;
+  if (mask) {
+    double near[PACKET_SIZE];
+    _mm256_storeu_pd(near, lo);
+    for (lane = 0; lane < PACKET_SIZE; lane++) {
+      if ((mask & (1 << lane)) && near[lane] < *tNear) {
+        *tNear = near[lane];
+      }
+    }
+  }
+  return mask;
+}
+
+AVX2 static void spheres_avx2(SphereSet* s, int start, int end, RayPacket* p) {
+  __m256d two = _mm256_set1_pd(2), four = _mm256_set1_pd(4);
+  __m256d none = _mm256_set1_pd(-1), zero = _mm256_setzero_pd();
+  __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d ox = _mm256_load_pd(p->ox), oy = _mm256_load_pd(p->oy), oz = _mm256_load_pd(p->oz);
+  __m256d dx = _mm256_load_pd(p->dx), dy = _mm256_load_pd(p->dy), dz = _mm256_load_pd(p->dz);
+  __m256d best = _mm256_load_pd(p->t);
+  int i, lane;
+
+  // The parts of the quadratic that only depend on the ray.
+  __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+  __m256d twoA = _mm256_mul_pd(two, a), fourA = _mm256_mul_pd(four, a);
+  __m256d tdx = _mm256_mul_pd(two, dx), tdy = _mm256_mul_pd(two, dy), tdz = _mm256_mul_pd(two, dz);
+  __m256d oo = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ox, ox), _mm256_mul_pd(oy, oy)), _mm256_mul_pd(oz, oz));
+
+  for (i = start; i < end; i++) {
+    __m256d px = _mm256_set1_pd(s->cx[i]), py = _mm256_set1_pd(s->cy[i]), pz = _mm256_set1_pd(s->cz[i]);
+    __m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tdx, _mm256_sub_pd(ox, px)),
+      _mm256_mul_pd(tdy, _mm256_sub_pd(oy, py))), _mm256_mul_pd(tdz, _mm256_sub_pd(oz, pz)));
+    __m256d dot = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, ox), _mm256_mul_pd(py, oy)), _mm256_mul_pd(pz, oz));
+    __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_set1_pd(s->cc[i]), oo), _mm256_mul_pd(two, dot));
+
+    __m256d d = _mm256_sub_pd(_mm256_mul_pd(b, b), _mm256_mul_pd(fourA, c));
+    if (_mm256_movemask_pd(_mm256_cmp_pd(d, zero, _CMP_GE_OQ)) == 0) {
+      continue;
+    }
+    __m256d root = _mm256_sqrt_pd(d);
+    __m256d negB = _mm256_xor_pd(b, sign);
+    __m256d t0 = _mm256_div_pd(_mm256_sub_pd(negB, root), twoA);
+    __m256d t1 = _mm256_div_pd(_mm256_add_pd(negB, root), twoA);
+
+    // t0 if it is in front, else t1 if that is, else -1.
+    __m256d tVal = _mm256_blendv_pd(none, t1, _mm256_cmp_pd(t1, zero, _CMP_GT_OQ));
+    tVal = _mm256_blendv_pd(tVal, t0, _mm256_cmp_pd(t0, zero, _CMP_GT_OQ));
+    __m256d hit = _mm256_andnot_pd(_mm256_cmp_pd(d, zero, _CMP_LT_OQ),
+      _mm256_and_pd(_mm256_cmp_pd(tVal, best, _CMP_LT_OQ), _mm256_cmp_pd(tVal, none, _CMP_NEQ_UQ)));
+
+    int mask = _mm256_movemask_pd(hit);
+    if (mask) {
+      best = _mm256_blendv_pd(best, tVal, hit);
+      for (lane = 0; lane < PACKET_SIZE; lane++) {
+        if (mask & (1 << lane)) p->prim[lane] = i;
+      }
+    }
+  }
+  _mm256_store_pd(p->t, best);
+}
+
+AVX2 static void planes_avx2(PlaneSet* planes, int first, RayPacket* p) {
+  __m256d none = _mm256_set1_pd(-1), zero = _mm256_setzero_pd();
+  __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d ox = _mm256_load_pd(p->ox), oy = _mm256_load_pd(p->oy), oz = _mm256_load_pd(p->oz);
+  __m256d dx = _mm256_load_pd(p->dx), dy = _mm256_load_pd(p->dy), dz = _mm256_load_pd(p->dz);
+  __m256d best = _mm256_load_pd(p->t);
+  int i, lane;
+
+  for (i = 0; i < planes->count; i++) {
+    __m256d nx = _mm256_set1_pd(planes->nx[i]), ny = _mm256_set1_pd(planes->ny[i]), nz = _mm256_set1_pd(planes->nz[i]);
+    __m256d dist = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, ox), _mm256_mul_pd(ny, oy)), _mm256_mul_pd(nz, oz));
+    dist = _mm256_sub_pd(dist, _mm256_set1_pd(planes->d[i]));
+    __m256d denom = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, dx), _mm256_mul_pd(ny, dy)), _mm256_mul_pd(nz, dz));
+    dist = _mm256_xor_pd(_mm256_div_pd(dist, denom), sign);
+
+    __m256d tVal = _mm256_blendv_pd(none, dist, _mm256_cmp_pd(dist, zero, _CMP_GT_OQ));
+    __m256d hit = _mm256_and_pd(_mm256_cmp_pd(tVal, best, _CMP_LT_OQ), _mm256_cmp_pd(tVal, none, _CMP_NEQ_UQ));
+
+    int mask = _mm256_movemask_pd(hit);
+    if (mask) {
+      best = _mm256_blendv_pd(best, tVal, hit);
+      for (lane = 0; lane < PACKET_SIZE; lane++) {
+        if (mask & (1 << lane)) p->prim[lane] = first + i;
+      }
+    }
+  }
+  _mm256_store_pd(p->t, best);
+}
+
+AVX2 static void packet_cast_avx2(Scene* scene, RayPacket* p) {
+  packet_traverse(scene, p, box_avx2, spheres_avx2, planes_avx2);
+}
+
+#else
+
+// The SSE kernels, built again for AVX2 so they get the VEX encodings. A
+// float packet is exactly one 128-bit register, so wider ones don't help.
+AVX2 static void packet_cast_avx2(Scene* scene, RayPacket* p) {
+  packet_traverse(scene, p, box_sse2, spheres_sse2, planes_sse2);
+}
+
+#endif
+
+#endif
+
+// Returns the packet kernel called name: "avx2", "sse2", "scalar", or
+// "auto" for the widest one this CPU runs. NULL when the name is unknown or
+// the CPU lacks the instructions.
+PacketCast packet_kernel(char* name) {
+  int autoPick = strcmp(name, "auto") == 0;
+
+#ifdef PACKET_X86
+  __builtin_cpu_init();
+  if (autoPick || strcmp(name, "avx2") == 0) {
+    if (__builtin_cpu_supports("avx2")) {
+      return packet_cast_avx2;
+    }
+    if (!autoPick) {
+      return NULL;
+    }
+  }
+  if (autoPick || strcmp(name, "sse2") == 0) {
+    return packet_cast_sse2;
+  }
+#endif
+  if (autoPick || strcmp(name, "scalar") == 0) {
+    return packet_cast_scalar;
+  }
+  return NULL;
+}
@@ -1,57 +1,138 @@
 #include "header.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Objects and their vectors are carved out of blocks this size instead of
+// being malloc'd one at a time.
+#define ARENA_BLOCK (1 << 20)
+
+// The scene file is mapped into memory and parsed in one pass with a cursor.
+typedef struct {
+  const char* cur;
+  const char* end;
+  int line;
+  char* block;
+  size_t blockLeft;
+  const char* dir;  // the file's directory, with its '/', for relative paths
+  int dirLen;
+} Parser;
+
+// A string token. It points straight into the mapped file.
+typedef struct {
+  const char* s;
+  int len;
+} Token;
+
+static void* arena_alloc(Parser* p, size_t size) {
+  // Keeping every allocation 8-byte aligned for the doubles.
+  size = (size + 7) & ~(size_t)7;
+  if (size > p->blockLeft) {
+    p->block = malloc(ARENA_BLOCK);
+    if (p->block == NULL) {
+      fprintf(stderr, "Error: Out of memory while reading the scene.\n");
+      exit(1);
+    }
+    p->blockLeft = ARENA_BLOCK;
+  }
+  void* mem = p->block;
+  p->block += size;
+  p->blockLeft -= size;
+  return mem;
+}
 
-int line = 1;
-
-// next_c() wraps the getc() function and provides error checking and line
-// number maintenance
+// Growable NULL-terminated array of objects.
+typedef struct {
+  Obj** items;
+  int count;
+  int capacity;
+} ObjList;
+
+static void list_init(ObjList* list) {
+  list->count = 0;
+  list->capacity = 64;
+  list->items = malloc(sizeof(Obj*) * list->capacity);
+  if (list->items == NULL) {
+    fprintf(stderr, "Error: Out of memory while reading the scene.\n");
+    exit(1);
+  }
+  list->items[0] = NULL;
+}
 
-int next_c(FILE *fput) {
-  int c = fgetc(fput);
-#ifdef DEBUG
-  printf("next_c: '%c'\n", c);
-#endif
-  if (c == '\n') {
-    line += 1;
+static void list_push(ObjList* list, Obj* obj) {
+  // One slot is always kept free for the NULL terminator.
+  if (list->count + 1 >= list->capacity) {
+    list->capacity *= 2;
+    list->items = realloc(list->items, sizeof(Obj*) * list->capacity);
+    if (list->items == NULL) {
+      fprintf(stderr, "Error: Out of memory while reading the scene.\n");
+      exit(1);
+    }
   }
-  if (c == EOF) {
-    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
+  list->items[list->count++] = obj;
+  list->items[list->count] = NULL;
+}
+
+// next_c() returns the next character and provides error checking and line
+// number maintenance
+static int next_c(Parser* p) {
+  if (p->cur >= p->end) {
+    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", p->line);
     exit(1);
   }
+  int c = (unsigned char)*p->cur++;
+  if (c == '\n') {
+    p->line += 1;
+  }
   return c;
 }
 
 // expect_c() checks that the next character is d.  If it is not it emits
 // an error.
-void expect_c(FILE *fput, int d) {
-  int c = next_c(fput);
+static void expect_c(Parser* p, int d) {
+  int c = next_c(p);
   if (c == d)
     return;
-  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
+  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, p->line);
   exit(1);
 }
 
+static inline int is_ws(int c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static inline int is_digit(int c) {
+  return (unsigned)(c - '0') < 10;
+}
+
 // skip_ws() skips white space in the file.
-void skip_ws(FILE *fput) {
-  int c = next_c(fput);
-  while (isspace(c)) {
-    c = next_c(fput);
+static void skip_ws(Parser* p) {
+  while (p->cur < p->end && is_ws(*p->cur)) {
+    if (*p->cur == '\n') {
+      p->line += 1;
+    }
+    p->cur++;
   }
-  ungetc(c, fput);
 }
 
-// next_string() gets the next string from the file handle and emits an error
+// next_string() gets the next string from the buffer and emits an error
 // if a string can not be obtained.
-char *next_string(FILE *fput) {
-  char buffer[129];
-  int c = next_c(fput);
-  if (c != '"') {
-    fprintf(stderr, "Error: Expected string on line %d.\n", line);
+static Token next_string(Parser* p) {
+  Token tok;
+  if (next_c(p) != '"') {
+    fprintf(stderr, "Error: Expected string on line %d.\n", p->line);
     exit(1);
   }
-  c = next_c(fput);
-  int i = 0;
+  tok.s = p->cur;
+  // Scanning the common case directly; next_c() handles the end of file.
+  while (p->cur < p->end && *p->cur != '"' && *p->cur >= 32 && *p->cur <= 126 &&
+         *p->cur != '\\' && p->cur - tok.s < 128) {
+    p->cur++;
+  }
+  int c = next_c(p);
   while (c != '"') {
-    if (i >= 128) {
+    if (p->cur - tok.s > 128) {
       fprintf(stderr, "Error: Strings longer than 128 characters in length are "
               "not supported.\n");
       exit(1);
@@ -64,240 +145,543 @@ char *next_string(FILE *fput) {
       fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
       exit(1);
     }
-    buffer[i] = c;
-    i += 1;
-    c = next_c(fput);
+    c = next_c(p);
+  }
+  tok.len = (int)(p->cur - tok.s - 1);
+  return tok;
+}
+
+static int token_is(Token tok, const char* s) {
+  return (int)strlen(s) == tok.len && memcmp(tok.s, s, tok.len) == 0;
+}
+
+static const double pow10s[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parses a JSON number straight out of the buffer at *cur, leaving *cur
+// after it. When the digits fit in a double and the power of ten is exact,
+// one multiply or divide gives the correctly rounded value; anything else
+// goes to strtod(). Returns NULL, or what was wrong with the number. Mesh
+// files are read with it too.
+const char* scan_number(const char** cur, const char* end, double* value) {
+  const char* s = *cur;
+  const char* start = s;
+  uint64_t mant = 0;
+  int digits = 0, exp10 = 0, neg = 0;
+
+  if (s < end && (*s == '-' || *s == '+')) {
+    neg = *s == '-';
+    s++;
+  }
+  if (s >= end || !(is_digit(*s) || *s == '.')) {
+    return "Expected a number";
+  }
+  while (s < end && is_digit(*s)) {
+    if (digits < 19) {
+      mant = mant * 10 + (*s - '0');
+      if (mant != 0) digits++;
+    } else {
+      exp10++;
+      digits++;
+    }
+    s++;
   }
-  buffer[i] = 0;
-  return strdup(buffer);
+  if (s < end && *s == '.') {
+    s++;
+    while (s < end && is_digit(*s)) {
+      if (digits < 19) {
+        mant = mant * 10 + (*s - '0');
+        if (mant != 0) digits++;
+        exp10--;
+      } else {
+        digits++;
+      }
+      s++;
+    }
+  }
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    int eneg = 0, e = 0;
+    s++;
+    if (s < end && (*s == '-' || *s == '+')) {
+      eneg = *s == '-';
+      s++;
+    }
+    if (s >= end || !is_digit(*s)) {
+      return "Malformed number";
+    }
+    while (s < end && is_digit(*s)) {
+      if (e < 10000) e = e * 10 + (*s - '0');
+      s++;
+    }
+    exp10 += eneg ? -e : e;
+  }
+  *cur = s;
+
+  if (digits <= 19 && mant <= ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 22) {
+    double v = (double)mant;
+    v = exp10 < 0 ? v / pow10s[-exp10] : v * pow10s[exp10];
+    *value = neg ? -v : v;
+  } else {
+    char buffer[128];
+    int len = (int)(s - start);
+    if (len >= (int)sizeof(buffer)) {
+      return "Number too long";
+    }
+    memcpy(buffer, start, len);
+    buffer[len] = 0;
+    *value = strtod(buffer, NULL);
+  }
+  return NULL;
 }
 
-double next_number(FILE *fput) {
+static double next_number(Parser* p) {
   double value;
-  fscanf(fput, "%lf", &value);
-  // Error check this..
+  const char* error = scan_number(&p->cur, p->end, &value);
+  if (error != NULL) {
+    fprintf(stderr, "Error: %s on line %d.\n", error, p->line);
+    exit(1);
+  }
   return value;
 }
 
-double *next_vector(FILE *fput) {
-  double *v = malloc(3 * sizeof(double));
-  expect_c(fput, '[');
-  skip_ws(fput);
-  v[0] = next_number(fput);
-  skip_ws(fput);
-  expect_c(fput, ',');
-  skip_ws(fput);
-  v[1] = next_number(fput);
-  skip_ws(fput);
-  expect_c(fput, ',');
-  skip_ws(fput);
-  v[2] = next_number(fput);
-  skip_ws(fput);
-  expect_c(fput, ']');
+// Reads a string naming a file. A relative path is taken from the directory
+// of the file being read, so a scene can be rendered from anywhere.
+static char* next_path(Parser* p) {
+  Token tok = next_string(p);
+  int prefix = (tok.len > 0 && tok.s[0] == '/') ? 0 : p->dirLen;
+  char* path = arena_alloc(p, prefix + tok.len + 1);
+  memcpy(path, p->dir, prefix);
+  memcpy(path + prefix, tok.s, tok.len);
+  path[prefix + tok.len] = 0;
+  return path;
+}
+
+static double* next_vector(Parser* p) {
+  double *v = arena_alloc(p, 3 * sizeof(double));
+  expect_c(p, '[');
+  skip_ws(p);
+  v[0] = next_number(p);
+  skip_ws(p);
+  expect_c(p, ',');
+  skip_ws(p);
+  v[1] = next_number(p);
+  skip_ws(p);
+  expect_c(p, ',');
+  skip_ws(p);
+  v[2] = next_number(p);
+  skip_ws(p);
+  expect_c(p, ']');
   return v;
 }
 
+static void set_width(Obj* obj, double v) { obj->Camera.width = v; }
+static void set_height(Obj* obj, double v) { obj->Camera.height = v; }
+static void set_max_depth(Obj* obj, double v) { obj->Camera.maxDepth = v; }
+static void set_min_weight(Obj* obj, double v) { obj->Camera.minWeight = v; }
+static void set_radius(Obj* obj, double v) { obj->Sphere.radius = v; }
+static void set_theta(Obj* obj, double v) { obj->Light.theta = v; }
+static void set_radial_a2(Obj* obj, double v) { obj->Light.radial_a2 = v; }
+static void set_radial_a1(Obj* obj, double v) { obj->Light.radial_a1 = v; }
+static void set_radial_a0(Obj* obj, double v) { obj->Light.radial_a0 = v; }
+static void set_angular_a0(Obj* obj, double v) { obj->Light.angular_a0 = v; }
+static void set_refractivity(Obj* obj, double v) { obj->refractivity = v; }
+static void set_reflectivity(Obj* obj, double v) { obj->reflectivity = v; }
+static void set_ior(Obj* obj, double v) { obj->refracIndex = v; }
+
+static void set_diffuse(Obj* obj, double* v) { obj->diffuse = v; }
+static void set_specular(Obj* obj, double* v) { obj->specular = v; }
+static void set_direction(Obj* obj, double* v) { obj->Light.direct = v; }
+static void set_normal(Obj* obj, double* v) { obj->Plane.normal = v; }
+
+static void set_file(Obj* obj, char* path) { obj->Mesh.file = path; }
+
+static void set_position(Obj* obj, double* v) {
+  if (obj->type == 1) {
+    obj->Sphere.position = v;
+  } else if (obj->type == 2) {
+    obj->Plane.position = v;
+  } else if (obj->type == 3) {
+    obj->Light.position = v;
+  } else if (obj->type == 5) {
+    obj->Mesh.position = v;
+  }
+}
+
+static void set_rotation(Obj* obj, double* v) { obj->Mesh.rotation = v; }
+static void set_scale(Obj* obj, double* v) { obj->Mesh.scale = v; }
+
+// Every property the scene format knows, with the setter that stores it
+// and the object types it applies to, one bit per type. Exactly one of
+// number, vector and path is set. The setters write into the Obj union, so
+// a property must never reach an object of a type it isn't for.
+typedef struct {
+  const char* key;
+  int len;
+  int types;
+  void (*number)(Obj* obj, double v);
+  void (*vector)(Obj* obj, double* v);
+  void (*path)(Obj* obj, char* path);
+} KeyHandler;
+
+#define NUMBER_KEY(k, t, fn) {k, sizeof(k) - 1, t, fn, NULL, NULL}
+#define VECTOR_KEY(k, t, fn) {k, sizeof(k) - 1, t, NULL, fn, NULL}
+#define PATH_KEY(k, t, fn) {k, sizeof(k) - 1, t, NULL, NULL, fn}
+
+#define CAMERA (1 << 0)
+#define SPHERE (1 << 1)
+#define PLANE (1 << 2)
+#define LIGHT (1 << 3)
+#define MESH (1 << 4)
+#define INSTANCE (1 << 5)
+#define SURFACE (SPHERE | PLANE | MESH | INSTANCE)
+
+static const char* typeNames[] = {"camera", "sphere", "plane", "light", "mesh", "instance"};
+
+static const KeyHandler keys[] = {
+  NUMBER_KEY("width", CAMERA, set_width),
+  NUMBER_KEY("height", CAMERA, set_height),
+  NUMBER_KEY("max_depth", CAMERA, set_max_depth),
+  NUMBER_KEY("min_weight", CAMERA, set_min_weight),
+  NUMBER_KEY("radius", SPHERE, set_radius),
+  NUMBER_KEY("theta", LIGHT, set_theta),
+  NUMBER_KEY("radial-a2", LIGHT, set_radial_a2),
+  NUMBER_KEY("radial-a1", LIGHT, set_radial_a1),
+  NUMBER_KEY("radial-a0", LIGHT, set_radial_a0),
+  NUMBER_KEY("angular_a0", LIGHT, set_angular_a0),
+  NUMBER_KEY("refractivity", SURFACE, set_refractivity),
+  NUMBER_KEY("reflectivity", SURFACE, set_reflectivity),
+  NUMBER_KEY("ior", SURFACE, set_ior),
+  VECTOR_KEY("diffuse_color", SURFACE | LIGHT, set_diffuse),
+  VECTOR_KEY("color", SURFACE | LIGHT, set_diffuse),
+  VECTOR_KEY("specular_color", SURFACE | LIGHT, set_specular),
+  VECTOR_KEY("direction", LIGHT, set_direction),
+  VECTOR_KEY("normal", PLANE, set_normal),
+  VECTOR_KEY("position", SPHERE | PLANE | LIGHT | INSTANCE, set_position),
+  VECTOR_KEY("rotation", INSTANCE, set_rotation),
+  VECTOR_KEY("scale", INSTANCE, set_scale),
+  PATH_KEY("file", MESH | INSTANCE, set_file),
+};
+
+static const KeyHandler* find_key(Token tok) {
+  size_t i;
+  for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    if (keys[i].len == tok.len && keys[i].key[0] == tok.s[0] &&
+        memcmp(keys[i].key, tok.s, tok.len) == 0) {
+      return &keys[i];
+    }
+  }
+  return NULL;
+}
+
+// Maps the scene file read-only. The mapping stays alive for the rest of
+// the run.
+static void map_file(Parser* p, char* filename) {
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  if (st.st_size == 0) {
+    fprintf(stderr, "Error: Scene file \"%s\" is empty.\n", filename);
+    exit(1);
+  }
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not map file \"%s\"\n", filename);
+    exit(1);
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  p->cur = data;
+  p->end = p->cur + st.st_size;
+  p->line = 1;
+  p->block = NULL;
+  p->blockLeft = 0;
+  const char* slash = strrchr(filename, '/');
+  p->dir = filename;
+  p->dirLen = slash != NULL ? (int)(slash - filename) + 1 : 0;
+}
+
+static Obj* parse_object(Parser* p, ObjList* objs, ObjList* lights) {
+  skip_ws(p);
+
+  // Parse the obj
+  Token key = next_string(p);
+  if (!token_is(key, "type")) {
+    fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", p->line);
+    exit(1);
+  }
+
+  skip_ws(p);
+  expect_c(p, ':');
+  skip_ws(p);
+
+  Token value = next_string(p);
+
+  Obj* obj = arena_alloc(p, sizeof(Obj));
+  memset(obj, 0, sizeof(Obj));
+  obj->refractivity = 0;
+  obj->reflectivity = 0;
+  obj->refracIndex = 1;
+
+  if (token_is(value, "camera")) {
+    obj->type = 0;
+    obj->Camera.maxDepth = -1;
+    obj->Camera.minWeight = -1;
+    list_push(objs, obj);
+  } else if (token_is(value, "sphere")) {
+    obj->type = 1;
+    list_push(objs, obj);
+  } else if (token_is(value, "plane")) {
+    obj->type = 2;
+    list_push(objs, obj);
+  } else if (token_is(value, "light")) {
+    obj->type = 3;
+    obj->Light.direct = NULL;
+    list_push(lights, obj);
+  } else if (token_is(value, "mesh")) {
+    obj->type = 4;
+    list_push(objs, obj);
+  } else if (token_is(value, "instance")) {
+    obj->type = 5;
+    list_push(objs, obj);
+  } else {
+    fprintf(stderr, "Error: Unknown type, \"%.*s\", on line number %d.\n", value.len, value.s, p->line);
+    exit(1);
+  }
+
+  skip_ws(p);
+
+  while (1) {
+    // , }
+    int c = next_c(p);
+    if (c == '}') {
+      // stop parsing this obj
+      return obj;
+    } else if (c != ',') {
+      fprintf(stderr, "Error: Unexpected value on line %d\n", p->line);
+      exit(1);
+    }
+
+    // read another field
+    skip_ws(p);
+    key = next_string(p);
+    skip_ws(p);
+    expect_c(p, ':');
+    skip_ws(p);
+
+    const KeyHandler* handler = find_key(key);
+    if (handler == NULL) {
+      fprintf(stderr, "Error: Unknown property, \"%.*s\", on line %d.\n",
+              key.len, key.s, p->line);
+      exit(1);
+    } else if (!(handler->types & (1 << obj->type))) {
+      fprintf(stderr, "Error: Property \"%.*s\" does not apply to a %s, on line %d.\n",
+              key.len, key.s, typeNames[obj->type], p->line);
+      exit(1);
+    } else if (handler->number != NULL) {
+      handler->number(obj, next_number(p));
+    } else if (handler->vector != NULL) {
+      handler->vector(obj, next_vector(p));
+    } else {
+      handler->path(obj, next_path(p));
+    }
+    skip_ws(p);
+  }
+}
+
 /**
  * Procedure to parse JSON and store them
  * in an object array.
  *
- * Returns: Array of Object types
+ * Returns: NULL-terminated array of Object types. The lights go into a
+ * separate NULL-terminated array returned through light. Both grow as
+ * needed.
+ */
+Obj** read_scene(char* filename, Obj*** light) {
+  Parser p;
+  ObjList objs, lights;
+
+  map_file(&p, filename);
+  list_init(&objs);
+  list_init(&lights);
+
+  skip_ws(&p);
+
+  // Find the beginning of the list
+  expect_c(&p, '[');
+
+  skip_ws(&p);
+
+  // Find the objects
+  while (1) {
+    int c = next_c(&p);
+    if (c == ']') {
+      fprintf(stderr, "Error: This is the worst scene file EVER.\n");
+      return NULL;
+    }
+    if (c != '{') {
+      fprintf(stderr, "Error: Expected '{' on line %d.\n", p.line);
+      exit(1);
+    }
+
+    parse_object(&p, &objs, &lights);
+
+    skip_ws(&p);
+    c = next_c(&p);
+    if (c == ',') {
+      // noop
+      skip_ws(&p);
+    } else if (c == ']') {
+      *light = lights.items;
+      return objs.items;
+    } else {
+      fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", p.line);
+      exit(1);
+    }
+  }
+}
+
+// Reads one track entry, after its '{'. Fields may come in any order.
+static void parse_key(Parser* p, Keyframe* key, int number) {
+  int hasFrame = 0, hasPosition = 0, hasLookAt = 0;
+  double* v;
+
+  key->type = -1;
+  key->object = 0;
+  skip_ws(p);
+  while (1) {
+    Token name = next_string(p);
+    skip_ws(p);
+    expect_c(p, ':');
+    skip_ws(p);
+
+    if (token_is(name, "type")) {
+      Token value = next_string(p);
+      if (token_is(value, "camera")) {
+        key->type = 0;
+      } else if (token_is(value, "sphere")) {
+        key->type = 1;
+      } else if (token_is(value, "light")) {
+        key->type = 3;
+      } else {
+        fprintf(stderr, "Error: Keyframes can't move a \"%.*s\", on line %d.\n",
+                value.len, value.s, p->line);
+        exit(1);
+      }
+    } else if (token_is(name, "object")) {
+      key->object = next_number(p);
+    } else if (token_is(name, "frame")) {
+      double frame = next_number(p);
+      if (!(frame >= 0) || frame != (int)frame) {
+        fprintf(stderr, "Error: Keyframe %d needs a whole, non-negative \"frame\".\n", number);
+        exit(1);
+      }
+      key->frame = frame;
+      hasFrame = 1;
+    } else if (token_is(name, "position")) {
+      v = next_vector(p);
+      memcpy(key->position, v, sizeof(key->position));
+      hasPosition = 1;
+    } else if (token_is(name, "look_at")) {
+      v = next_vector(p);
+      memcpy(key->lookAt, v, sizeof(key->lookAt));
+      hasLookAt = 1;
+    } else {
+      fprintf(stderr, "Error: Unknown property, \"%.*s\", on line %d.\n",
+              name.len, name.s, p->line);
+      exit(1);
+    }
+
+    skip_ws(p);
+    int c = next_c(p);
+    if (c == '}') {
+      break;
+    } else if (c != ',') {
+      fprintf(stderr, "Error: Unexpected value on line %d\n", p->line);
+      exit(1);
+    }
+    skip_ws(p);
+  }
+
+  if (key->type < 0) {
+    fprintf(stderr, "Error: Keyframe %d has no \"type\".\n", number);
+    exit(1);
+  }
+  if (!hasFrame) {
+    fprintf(stderr, "Error: Keyframe %d has no \"frame\".\n", number);
+    exit(1);
+  }
+  if (!hasPosition) {
+    fprintf(stderr, "Error: Keyframe %d has no \"position\".\n", number);
+    exit(1);
+  }
+  if (key->type == 0 && !hasLookAt) {
+    fprintf(stderr, "Error: Keyframe %d has no \"look_at\".\n", number);
+    exit(1);
+  }
+  if (key->type != 0 && key->object < 1) {
+    fprintf(stderr, "Error: Keyframe %d needs an \"object\" number from 1.\n", number);
+    exit(1);
+  }
+}
+
+/**
+ * Reads an animation track: a JSON array of keyframes such as
+ *
+ *   {"type": "camera", "frame": 0, "position": [0, 1, -5], "look_at": [0, 0, 10]}
+ *   {"type": "sphere", "object": 2, "frame": 30, "position": [1, 0, 12]}
+ *
+ * Keys are numbered from 1 in file order in error messages. Whether the
+ * objects exist is for the caller to check against the scene.
  */
- Obj** read_scene(char* filename, Obj** light) {
-   int lightIndex = 0;
-   int index = 0;
-   int c;
-   FILE* json = fopen(filename, "r");
-
-   if (json == NULL) {
-     fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
-     exit(1);
-   }
-   Obj** objs = malloc(sizeof(Obj*)*128);
-
-   objs[127] = NULL;
-   light[127] = NULL;
-   Obj* obj;
-
-   skip_ws(json);
-
-   // Find the beginning of the list
-   expect_c(json, '[');
-
-   skip_ws(json);
-
-   // Find the objects
-
-   while (1) {
-     c = fgetc(json);
-     if (c == ']') {
-       fprintf(stderr, "Error: This is the worst scene file EVER.\n");
-       fclose(json);
-       return NULL;
-     }
-     if (c == '{') {
-       skip_ws(json);
-
-       // Parse the obj
-       char* key = next_string(json);
-       if (strcmp(key, "type") != 0) {
- 	fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
- 	exit(1);
-       }
-
-       skip_ws(json);
-
-       expect_c(json, ':');
-
-       skip_ws(json);
-
-       char* value = next_string(json);
-
-       obj = malloc(sizeof(Obj));
-       obj->refractivity = 0;
-       obj->reflectivity = 0;
-       obj->refracIndex = 1;
-
-       if (strcmp(value, "camera") == 0) {
-         obj->type = 0;
-         objs[index++] = obj;
-       } else if (strcmp(value, "sphere") == 0) {
-         obj->type = 1;
-         objs[index++] = obj;
-       } else if (strcmp(value, "plane") == 0) {
-         obj->type = 2;
-         objs[index++] = obj;
-       } else if(strcmp(value, "light") == 0) {
-         obj->type = 3;
-         obj->Light.direct = NULL;
-         light[lightIndex++] = obj;
-       }
-         else {
- 	       fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
- 	       exit(1);
-       }
-
-       skip_ws(json);
-
-       while (1) {
- 	// , }
- 	c = next_c(json);
- 	if (c == '}') {
- 	  // stop parsing this obj
- 	  break;
-
- 	} else if (c == ',') {
- 	  // read another field
- 	  skip_ws(json);
- 	  char* key = next_string(json);
- 	  skip_ws(json);
- 	  expect_c(json, ':');
- 	  skip_ws(json);
-
- 	  if ((strcmp(key, "width") == 0) ||
- 	      (strcmp(key, "height") == 0) ||
- 	      (strcmp(key, "radius") == 0) ||
-         (strcmp(key, "theta") == 0) ||
-         (strcmp(key, "radial-a2") == 0) ||
-         (strcmp(key, "radial-a1") == 0) ||
-         (strcmp(key, "radial-a0") == 0) ||
-         (strcmp(key, "angular_a0") == 0)||
-         (strcmp(key, "refractivity") == 0) ||
-         (strcmp(key, "reflectivity") == 0) ||
-         (strcmp(key, "ior") == 0)) {
- 	         double value = next_number(json);
-
-           if(strcmp(key, "width") == 0) {
-             obj->Camera.width = value;
-
-         } else if(strcmp(key, "height") == 0) {
-             obj->Camera.height = value;
-
-         } else if(strcmp(key, "reflectivity") == 0) {
-             obj->reflectivity = value;
-
-         } else if(strcmp(key, "refractivity") == 0) {
-             obj->refractivity = value;
-
-         } else if(strcmp(key, "ior") == 0) {
-             obj->refracIndex = value;
-
-         } else if(strcmp(key, "radius") == 0) {
-             obj->Sphere.radius = value;
-
-         } else if(strcmp(key, "theta") == 0) {
-             obj->Light.theta = value;
-
-         }  else if(strcmp(key, "radial-a2") == 0) {
-             obj->Light.radial_a2 = value;
-
-         } else if(strcmp(key, "radial-a1") == 0) {
-             obj->Light.radial_a1 = value;
-
-         } else if(strcmp(key, "radial-a0") == 0) {
-             obj->Light.radial_a0 = value;
-
-         } else if(strcmp(key, "angular_a0") == 0) {
-             obj->Light.angular_a0 = value;
-         }
- 	  } else if ((strcmp(key, "diffuse_color") == 0) ||
- 		     (strcmp(key, "position") == 0) ||
- 		     (strcmp(key, "normal") == 0) ||
-          (strcmp(key, "color") == 0) ||
-          (strcmp(key, "specular_color") == 0) ||
-          (strcmp(key, "direction") == 0)) {
-           double* value = next_vector(json);
-
-           if(strcmp(key, "diffuse_color") == 0) {
-             obj->diffuse = value;
-
-         } else if(strcmp(key, "direction") == 0) {
-             //printf("Got direct damn\n");
-             obj->Light.direct = value;
-
-         } else if(strcmp(key, "specular_color") == 0) {
-             obj->specular = value;
-
-         } else if(strcmp(key, "color") == 0) {
-             obj->diffuse = value;
-
-         } else if(strcmp(key, "position") == 0 && obj->type == 2) {
-             obj->Plane.position = value;
-
-         } else if(strcmp(key, "position") == 0 && obj->type == 1) {
-             obj->Sphere.position = value;
-
-         } else if(strcmp(key, "position") == 0 && obj->type == 3) {
-             obj->Light.position = value;
-
-         } else if(strcmp(key, "normal") == 0) {
-             obj->Plane.normal = value;
-         }
- 	  } else {
- 	    fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
- 		    key, line);
- 	    //char* value = next_string(json);
- 	  }
- 	  skip_ws(json);
- 	} else {
- 	  fprintf(stderr, "Error: Unexpected value on line %d\n", line);
- 	  exit(1);
- 	}
-       }
-       skip_ws(json);
-       c = next_c(json);
-       if (c == ',') {
- 	// noop
- 	    skip_ws(json);
-       } else if (c == ']') {
- 	        fclose(json);
-           objs[index] = NULL;
-           light[lightIndex] = NULL;
- 	        return objs;
-       } else {
- 	       fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
- 	       exit(1);
-       }
-     }
-   }
- }
+Track* read_track(char* filename) {
+  Parser p;
+  Track* track = malloc(sizeof(Track));
+  int capacity = 16;
+
+  map_file(&p, filename);
+  track->count = 0;
+  track->keys = malloc(sizeof(Keyframe) * capacity);
+  if (track->keys == NULL) {
+    fprintf(stderr, "Error: Out of memory while reading the track.\n");
+    exit(1);
+  }
+
+  skip_ws(&p);
+  expect_c(&p, '[');
+  skip_ws(&p);
+  if (p.cur < p.end && *p.cur == ']') {
+    fprintf(stderr, "Error: Track \"%s\" has no keyframes.\n", filename);
+    exit(1);
+  }
+
+  while (1) {
+    expect_c(&p, '{');
+    if (track->count == capacity) {
+      capacity *= 2;
+      track->keys = realloc(track->keys, sizeof(Keyframe) * capacity);
+      if (track->keys == NULL) {
+        fprintf(stderr, "Error: Out of memory while reading the track.\n");
+        exit(1);
+      }
+    }
+    parse_key(&p, &track->keys[track->count], track->count + 1);
+    track->count++;
+
+    skip_ws(&p);
+    int c = next_c(&p);
+    if (c == ']') {
+      return track;
+    } else if (c != ',') {
+      fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", p.line);
+      exit(1);
+    }
+    skip_ws(&p);
+  }
+}
@@ -0,0 +1,73 @@
+#include "header.h"
+
+// Formats one row of pixels as P3 text into out. Returns the byte count.
+static size_t ascii_row(Color* row, int width, char* out) {
+  size_t n = 0;
+  int i, c;
+  for (i = 0; i < width; i++) {
+    unsigned char v[3] = {row[i].r, row[i].g, row[i].b};
+    for (c = 0; c < 3; c++) {
+      if (v[c] >= 100) out[n++] = '0' + v[c] / 100;
+      if (v[c] >= 10) out[n++] = '0' + v[c] / 10 % 10;
+      out[n++] = '0' + v[c] % 10;
+      out[n++] = (c == 2 && i == width - 1) ? '\n' : ' ';
+    }
+  }
+  return n;
+}
+
+static void sink_write(PpmSink* sink, void* data, size_t n) {
+  if (fwrite(data, 1, n, sink->output) != n) {
+    fprintf(stderr, "Error: Failed to write the image.\n");
+    exit(1);
+  }
+}
+
+// Writes the header. Rows must then arrive top to bottom through ppm_rows().
+void ppm_begin(PpmSink* sink, FILE* output, int width, int height, int ascii) {
+  sink->output = output;
+  sink->width = width;
+  sink->height = height;
+  sink->ascii = ascii;
+  sink->nextRow = 0;
+  // Every channel takes at most three digits and a separator.
+  sink->text = ascii ? malloc((size_t)width * 3 * 4) : NULL;
+  fprintf(output, "P%i\n%i %i\n%i\n", ascii ? 3 : 6, width, height, 255);
+}
+
+// Appends count finished rows. Binary rows go out in one write; P3 text is
+// formatted a scanline at a time into the sink's buffer.
+void ppm_rows(PpmSink* sink, Color* rows, int count) {
+  int y;
+  if (sink->nextRow + count > sink->height) {
+    fprintf(stderr, "Error: Too many rows written to the image.\n");
+    exit(1);
+  }
+  if (!sink->ascii) {
+    sink_write(sink, rows, (size_t)sink->width * count * sizeof(Color));
+  } else {
+    for (y = 0; y < count; y++) {
+      size_t n = ascii_row(rows + (size_t)y * sink->width, sink->width, sink->text);
+      sink_write(sink, sink->text, n);
+    }
+  }
+  sink->nextRow += count;
+}
+
+void ppm_end(PpmSink* sink) {
+  if (sink->nextRow != sink->height) {
+    fprintf(stderr, "Error: Image ended after %i of %i rows.\n", sink->nextRow, sink->height);
+    exit(1);
+  }
+  fflush(sink->output);
+  free(sink->text);
+  sink->text = NULL;
+}
+
+// Creates the output.ppm file from a finished frame.
+void ppmMaker(Color* buff, int width, int height, int ascii, FILE *output) {
+  PpmSink sink;
+  ppm_begin(&sink, output, width, height, ascii);
+  ppm_rows(&sink, buff, height);
+  ppm_end(&sink);
+}
@@ -1,84 +1,133 @@
 #include "header.h"
 #include "vector_math.h"
 
-double sphere_intersection(double *Ro, double *Rd, Obj* obj) {
-  double r = obj->Sphere.radius;
-  double* pos = obj->Sphere.position;
-
-  double valueA = (sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
-  double valueB = 2 * Rd[0] * (Ro[0] - pos[0]) + 2 * Rd[1] * (Ro[1] - pos[1]) + 2 * Rd[2] * (Ro[2] - pos[2]);
-  double valueC = sqr(pos[0]) + sqr(pos[1]) + sqr(pos[2]) + sqr(Ro[0]) + sqr(Ro[1]) + sqr(Ro[2]) -2 * (pos[0] * Ro[0] + pos[1] * Ro[1] + pos[2] * Ro[2]) - sqr(r);
-
-  double d = sqr(valueB) - 4 * valueA * valueC;
-  if(d < 0)
-    return -1;
+// Closest hit along the ray. Returns the primitive number (see Scene), or
+// -1 with *t set to -1 when nothing is hit. skip is a primitive to ignore,
+// or -1.
+int rayCast(real* t, Scene* scene, int skip, real* Ro, real* Rd) {
+  PlaneSet* planes = &scene->planes;
+  SphereSet* spheres = &scene->spheres;
+  real tNew = INFINITY, tVal;
+  int best = -1;
+  int i;
+
+  // Planes are unbounded, so every ray tests all of them.
+  threadRays.planeTests += planes->count;
+  for(i = 0; i < planes->count; i++) {
+    tVal = plane_intersection(planes, i, Ro, Rd);
+    if(tVal < tNew && tVal != -1 && spheres->count + i != skip) {
+      tNew = tVal;
+      best = spheres->count + i;
+    }
+  }
 
-  double t0 = (-valueB - sqrt(d)) / (2*valueA);
-  if (t0 > 0)
-    return t0;
+  if(scene->bvh != NULL) {
+    bvh_cast(scene, skip, Ro, Rd, &tNew, &best);
+  } else {
+    threadRays.sphereTests += spheres->count;
+    for(i = 0; i < spheres->count; i++) {
+      tVal = sphere_intersection(spheres, i, Ro, Rd);
+      if(tVal < tNew && tVal != -1 && i != skip) {
+        tNew = tVal;
+        best = i;
+      }
+    }
+  }
 
-  double t1 = (-valueB + sqrt(d)) / (2*valueA);
-  if (t1 > 0)
-    return t1;
+  // Mesh instances have a tree of their own, searched only where it can
+  // still beat the closest hit so far.
+  bvh_cast_instances(scene, skip, Ro, Rd, &tNew, &best);
 
-  return -1;
+  *t = (best < 0) ? -1 : tNew;
+  return best;
 }
 
-double plane_intersection(double *Ro, double *Rd, Obj* obj) {
-  double *pos = obj->Plane.position;
-  double *norm = obj->Plane.normal;
-
-  V3 v = malloc(sizeof(double) * 3);
-  v3_subtract(Ro, pos, v);
-
-  double dist = v3_dot(norm, v);
-  double denom = v3_dot(norm, Rd);
-
-  dist = -(dist / denom);
-  if (dist > 0)
-    return dist;
-
-  return 0;
-}
+// Whether anything lies on the ray closer than maxT. Stops at the first
+// blocker it finds, so it is much cheaper than rayCast() for shadow rays.
+// skip is a primitive to ignore, or -1.
+int rayOccluded(Scene* scene, int skip, real* Ro, real* Rd, real maxT) {
+  PlaneSet* planes = &scene->planes;
+  SphereSet* spheres = &scene->spheres;
+  real tVal;
+  int i;
+
+  for(i = 0; i < planes->count; i++) {
+    threadRays.planeTests++;
+    tVal = plane_intersection(planes, i, Ro, Rd);
+    if(tVal < maxT && tVal != -1 && spheres->count + i != skip) {
+      return 1;
+    }
+  }
 
-double intersection_dist(V3 Ro, V3 Rd, Obj* obj) {
-  double t = INFINITY;
-
-  switch (obj->type) {
-    case 2:
-      t = plane_intersection(Ro, Rd, obj);
-      break;
-    case 1:
-      t = sphere_intersection(Ro, Rd, obj);
-      break;
-    case 0:
-      t = INFINITY;
-      break;
-    case 3:
-      t = INFINITY;
-      break;
-    default:
-      // Error checking if the type if incorrect.
-      fprintf(stderr, "Error: The type is incorrect, please enter a correct type.\n");
-      exit(1);
+  if(scene->bvh != NULL) {
+    if(bvh_occluded(scene, skip, Ro, Rd, maxT)) {
+      return 1;
+    }
+  } else {
+    for(i = 0; i < spheres->count; i++) {
+      threadRays.sphereTests++;
+      tVal = sphere_intersection(spheres, i, Ro, Rd);
+      if(tVal < maxT && tVal != -1 && i != skip) {
+        return 1;
+      }
+    }
   }
 
-  return t;
+  return bvh_occluded_instances(scene, skip, Ro, Rd, maxT);
 }
 
-
-void get_sphere_normal(Obj* obj, double* val_intersect, double* norm){
-    v3_subtract(val_intersect, obj->Sphere.position, norm);
+void get_sphere_normal(SphereSet* s, int i, real* val_intersect, real* norm){
+    norm[0] = val_intersect[0] - s->cx[i];
+    norm[1] = val_intersect[1] - s->cy[i];
+    norm[2] = val_intersect[2] - s->cz[i];
     normalize(norm);
 }
 
-void get_plane_normal(Obj* obj, double* norm) {
-   memcpy(norm, obj->Plane.normal, sizeof(double)*3);
-   normalize(norm);
+// Plane normals are stored normalized.
+void get_plane_normal(PlaneSet* p, int i, real* norm) {
+   norm[0] = p->nx[i];
+   norm[1] = p->ny[i];
+   norm[2] = p->nz[i];
+}
+
+// Unit normal of any primitive at the point intersect, hit by a ray going
+// along Rd. Triangles have two sides, so theirs is turned to face the ray.
+// A normal goes from an instance's mesh space to the world through the
+// transpose of toObject.
+void prim_normal(Scene* scene, int prim, real* intersect, real* Rd, real* norm) {
+  if(prim_is_sphere(scene, prim)) {
+    get_sphere_normal(&scene->spheres, prim, intersect, norm);
+  } else if(!prim_is_triangle(scene, prim)) {
+    get_plane_normal(&scene->planes, prim - scene->spheres.count, norm);
+  } else {
+    Instance* inst = prim_instance(scene, prim);
+    Mesh* mesh = inst->mesh;
+    uint32_t* v = &mesh->index[3 * (size_t)(prim - inst->firstPrim)];
+    real* a = &mesh->verts[3 * (size_t)v[0]];
+    real* b = &mesh->verts[3 * (size_t)v[1]];
+    real* c = &mesh->verts[3 * (size_t)v[2]];
+    real e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    real e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    norm[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    norm[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    norm[2] = e1[0] * e2[1] - e1[1] * e2[0];
+    if(!inst->identity) {
+      real* m = inst->toObject;
+      real n[3] = {norm[0], norm[1], norm[2]};
+      int a;
+      for(a = 0; a < 3; a++) {
+        norm[a] = m[a] * n[0] + m[4 + a] * n[1] + m[8 + a] * n[2];
+      }
+    }
+    normalize(norm);
+    if(v3_dot(norm, Rd) > 0) {
+      v3_scale(norm, -1, norm);
+    }
+  }
 }
 
-void diffuse(double* totalDiffuse, double* norm, double* lightDirect, Obj* obj, double* lightCol) {
-  double dot = v3_dot(lightDirect, norm);
+void diffuse(real* totalDiffuse, real* norm, real* lightDirect, Material* mat, real* lightCol) {
+  real dot = v3_dot(lightDirect, norm);
 
   if(dot <= 0) {
     dot = 0;
@@ -86,30 +135,37 @@ void diffuse(double* totalDiffuse, double* norm, double* lightDirect, Obj* obj,
     //printf("%lf\n", dot);
   }
 
-  v3_scale(obj->diffuse, dot, totalDiffuse);
+  v3_scale(mat->diffuse, dot, totalDiffuse);
   v3_multi(lightCol, totalDiffuse, totalDiffuse);
   //printf("%lf %lf %lf\n", totalDiffuse[0], totalDiffuse[1], totalDiffuse[2]);
 
 }
 
-void specular(double* specColor, double* norm, double* lightDirect, Obj* obj, double* lightCol, double* Rd) {
-  double ns = 20.0;
-  double reflectLightDirect[3] = {0, 0, 0};
-  double negRd[3] = {0, 0, 0};
-  double dot = 0;
+// x^20, the shininess exponent, by squaring. Much cheaper than pow().
+static inline real shine(real x) {
+  real x2 = x * x;
+  real x5 = x2 * x2 * x;
+  real x10 = x5 * x5;
+  return x10 * x10;
+}
+
+void specular(real* specColor, real* norm, real* lightDirect, Material* mat, real* lightCol, real* Rd) {
+  real reflectLightDirect[3] = {0, 0, 0};
+  real negRd[3] = {0, 0, 0};
+  real dot = 0;
 
   reflection_vector(lightDirect, norm, reflectLightDirect);
   v3_scale(Rd, 1, negRd);
 
   //Returns the bigger value of the two (makes vector non-negative)
   dot = maxVal(v3_dot(reflectLightDirect, negRd), 0);
-  dot = pow(dot, ns);
+  dot = shine(dot);
   v3_scale(lightCol, dot, specColor);
-  v3_multi(specColor, obj->specular, specColor);
+  v3_multi(specColor, mat->specular, specColor);
 }
 
-void normalize(double *v) {
-  double length = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
+void normalize(real *v) {
+  real length = real_sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
   v[0] /= length;
   v[1] /= length;
   v[2] /= length;
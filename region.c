@@ -0,0 +1,140 @@
+#include "header.h"
+
+// Rendering only some rectangles of a frame. Each pixel is traced with
+// exactly the ray it gets in the full width x height image, so a region
+// rendered on its own matches the same pixels of a full render. The result
+// is either a cropped image or a patch written over an existing PPM.
+
+static Color* region_pixels(Tile* region) {
+  Color* pixels = malloc(sizeof(Color) * (size_t)(region->x1 - region->x0) *
+    (region->y1 - region->y0));
+  if (pixels == NULL) {
+    fprintf(stderr, "Error: Not enough memory for a %ix%i region.\n", region->x1 - region->x0,
+      region->y1 - region->y0);
+    exit(1);
+  }
+  return pixels;
+}
+
+static void add_counts(RayCounts* total, RayCounts* counts) {
+  size_t i;
+  for (i = 0; i < sizeof(RayCounts) / sizeof(long); i++) {
+    ((long*)total)[i] += ((long*)counts)[i];
+  }
+}
+
+// Renders the regions and writes the smallest image holding all of them.
+// Pixels between the regions are left black. opts->rays ends up with the
+// counts of every region together.
+void regions_crop(Scene* scene, int height, int width, RenderOptions* opts, Tile* regions,
+  int count, int ascii, FILE* output) {
+  Tile box = regions[0];
+  RayCounts total;
+  int i, y;
+
+  for (i = 1; i < count; i++) {
+    if (regions[i].x0 < box.x0) box.x0 = regions[i].x0;
+    if (regions[i].y0 < box.y0) box.y0 = regions[i].y0;
+    if (regions[i].x1 > box.x1) box.x1 = regions[i].x1;
+    if (regions[i].y1 > box.y1) box.y1 = regions[i].y1;
+  }
+  int boxW = box.x1 - box.x0, boxH = box.y1 - box.y0;
+  Color* image = region_pixels(&box);
+  memset(image, 0, sizeof(Color) * (size_t)boxW * boxH);
+  memset(&total, 0, sizeof(RayCounts));
+
+  for (i = 0; i < count; i++) {
+    Tile* r = &regions[i];
+    int w = r->x1 - r->x0;
+    Color* pixels = region_pixels(r);
+    sceneRegion(scene, height, width, opts, r, pixels);
+    add_counts(&total, &opts->rays);
+    for (y = r->y0; y < r->y1; y++) {
+      memcpy(image + (size_t)(y - box.y0) * boxW + (r->x0 - box.x0),
+        pixels + (size_t)(y - r->y0) * w, sizeof(Color) * w);
+    }
+    free(pixels);
+  }
+
+  ppmMaker(image, boxW, boxH, ascii, output);
+  free(image);
+  opts->rays = total;
+}
+
+// Next header field of a PPM, skipping white space and # comments.
+static int header_number(FILE* f) {
+  int c, value = 0, digits = 0;
+  while ((c = getc(f)) != EOF) {
+    if (c == '#') {
+      while ((c = getc(f)) != EOF && c != '\n');
+    } else if (c < '0' || c > '9') {
+      if (digits > 0) {
+        return value;
+      }
+      if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+        return -1;
+      }
+    } else {
+      value = value * 10 + (c - '0');
+      digits++;
+    }
+  }
+  return digits > 0 ? value : -1;
+}
+
+// Renders the regions straight into filename, an existing binary PPM of
+// the full frame. Only the regions' pixels are written; the rest of the
+// file is left as it was.
+void regions_patch(Scene* scene, int height, int width, RenderOptions* opts, Tile* regions,
+  int count, char* filename) {
+  RayCounts total;
+  int i, y;
+
+  FILE* f = fopen(filename, "r+b");
+  if (f == NULL) {
+    fprintf(stderr, "Error: Failed to open file %s\n", filename);
+    exit(1);
+  }
+  // header_number() reads the one white space character after the maximum
+  // value, so the pixels start right where it stops.
+  if (getc(f) != 'P' || getc(f) != '6') {
+    fprintf(stderr, "Error: Only a binary (P6) image can be patched, \"%s\" isn't one.\n",
+      filename);
+    exit(1);
+  }
+  int fileW = header_number(f), fileH = header_number(f), maxval = header_number(f);
+  if (fileW != width || fileH != height || maxval != 255) {
+    fprintf(stderr, "Error: \"%s\" isn't a %ix%i image with 8-bit color.\n", filename, width,
+      height);
+    exit(1);
+  }
+  long start = ftell(f);
+  if (fseek(f, 0, SEEK_END) != 0 || ftell(f) < start + (long)width * height * (long)sizeof(Color)) {
+    fprintf(stderr, "Error: \"%s\" is truncated.\n", filename);
+    exit(1);
+  }
+  memset(&total, 0, sizeof(RayCounts));
+
+  for (i = 0; i < count; i++) {
+    Tile* r = &regions[i];
+    int w = r->x1 - r->x0;
+    Color* pixels = region_pixels(r);
+    sceneRegion(scene, height, width, opts, r, pixels);
+    add_counts(&total, &opts->rays);
+    for (y = r->y0; y < r->y1; y++) {
+      long at = start + ((long)y * width + r->x0) * (long)sizeof(Color);
+      if (fseek(f, at, SEEK_SET) != 0 ||
+          fwrite(pixels + (size_t)(y - r->y0) * w, sizeof(Color), w, f) != (size_t)w) {
+        fprintf(stderr, "Error: Failed to write the image.\n");
+        exit(1);
+      }
+    }
+    free(pixels);
+  }
+
+  if (fclose(f) != 0) {
+    fprintf(stderr, "Error: Failed to write the image.\n");
+    exit(1);
+  }
+  opts->rays = total;
+}
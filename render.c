@@ -0,0 +1,560 @@
+#include "header.h"
+
+__thread RayCounts threadRays;
+
+float clamp(float v) {
+  if (v < 0.0) {
+    return 0;
+  }
+  else if (v > 1) {
+    return 1.0;
+  }
+  else {
+    return v;
+  }
+}
+
+void currentIntersect(real* intersect, real* Ro, real* Rd, real t) {
+  intersect[0] = t*Rd[0] + Ro[0];
+  intersect[1] = t*Rd[1] + Ro[1];
+  intersect[2] = t*Rd[2] + Ro[2];
+}
+
+// Builds the mirrored ray leaving the hit at distance t.
+void reflection(RayTask* ray, real* reflectObjNorm, real* Ro, real* Rd, real t) {
+  currentIntersect(ray->Ro, Ro, Rd, t - RAY_EPSILON);
+  reflection_vector(Rd, reflectObjNorm, ray->Rd);
+}
+
+// Builds the ray transmitted through primitive check, hit at distance t.
+void refraction(RayTask* ray, real ior, real* refractNorm, int check,
+  real* Ro, real* Rd, Scene* scene, real t) {
+
+  // Used to store new values of Ro, Rd, and t
+  real* tempRo = ray->Ro;
+  real* tempRd = ray->Rd;
+  real tNew;
+
+  currentIntersect(tempRo, Ro, Rd, t + RAY_EPSILON);
+  refraction_vector(Rd, refractNorm, tempRd, ior);
+
+  // Bending the ray again where it leaves the sphere. A plane or a triangle
+  // has no far side, so the ray carries on as it entered.
+  if(prim_is_sphere(scene, check)) {
+    SphereSet* s = &scene->spheres;
+    tNew = sphere_intersection(s, check, tempRo, tempRd);
+
+    if(tNew != -1 && tNew != INFINITY) {
+      currentIntersect(tempRo, tempRo, tempRd, tNew + RAY_EPSILON);
+      refractNorm[0] = s->cx[check] - tempRo[0];
+      refractNorm[1] = s->cy[check] - tempRo[1];
+      refractNorm[2] = s->cz[check] - tempRo[2];
+      normalize(refractNorm);
+      refraction_vector(tempRd, refractNorm, tempRd, (1 / ior));
+    }
+  }
+}
+
+// Unit direction and distance from a hit to the light.
+void lightRay(SceneLight* light, real* intersect, real* lightDirect, real* mag) {
+  v3_subtract(light->position, intersect, lightDirect);
+  *mag = real_sqrt(sqr(lightDirect[0]) + sqr(lightDirect[1]) + sqr(lightDirect[2]));
+  normalize(lightDirect);
+}
+
+// Diffuse and specular light reaches the hit with, if nothing blocks it.
+// lights_reach() has already checked the hit is in range and in the cone.
+void lightShare(SceneLight* light, Material* mat, real* Norm, real* lightDirect, real mag,
+  real* Rd, real* diffColor, real* specColor) {
+  real lightColor[3] = {0, 0, 0};
+
+  // Less light as it is farther away
+  real radA = 1/(sqr(mag)*(light->radial_a2) + (light->radial_a1)*mag + light->radial_a0);
+  v3_scale(light->color, radA, lightColor);
+
+  // Getting the diffuse color
+  diffuse(diffColor, Norm, lightDirect, mat, lightColor);
+
+  // Getting the specular color
+  specular(specColor, Norm, lightDirect, mat, lightColor, Rd);
+}
+
+// Direct light at a hit: diffuse and specular from every light that
+// reaches it and isn't blocked.
+static void lightColor(Scene* scene, int prim, real* intersect, real* Norm, real* Rd,
+  real* col) {
+  Material* mat = prim_material(scene, prim);
+
+  // Setting up the lighting for diffuse and specular
+  real diffColor[3] = {0, 0, 0};
+  real totalDiff[3] = {0, 0, 0};
+  real specColor[3] = {0, 0, 0};
+  real totalSpec[3] = {0, 0, 0};
+  int count, k;
+  int* near = lights_near(scene, intersect, &count);
+
+  for(k = 0; k < count; k++) {
+    int i = near != NULL ? near[k] : k;
+    SceneLight* light = &scene->lights[i];
+    real lightDirect[3] = {0, 0, 0};
+    real mag;
+
+    lightRay(light, intersect, lightDirect, &mag);
+    if(!lights_reach(scene, i, lightDirect, mag)) {
+      threadRays.culled++;
+      continue;
+    }
+
+    // Testing the shadows: anything between the point and the light blocks it
+    threadRays.shadow++;
+    if(rayOccluded(scene, prim, intersect, lightDirect, mag)) {
+      threadRays.shadowHits++;
+      continue;
+    }
+    lightShare(light, mat, Norm, lightDirect, mag, Rd, diffColor, specColor);
+    v3_add(diffColor, totalDiff, totalDiff);
+    v3_add(specColor, totalSpec, totalSpec);
+  }
+
+  v3_add(totalDiff, totalSpec, col);
+}
+
+// Traces one ray and writes its color into the caller's col.
+void renderColor(RenderOptions* opts, Scene* scene, real* Ro, real* Rd, real* col) {
+  real t = 0;
+  int prim = rayCast(&t, scene, -1, Ro, Rd);
+  shadeColor(opts, scene, Ro, Rd, prim, t, col);
+}
+
+// Colors a ray whose closest hit is already known: primitive prim at
+// distance t, or prim -1 for a miss.
+//
+// The ray tree is walked with an explicit stack. Every ray carries the
+// share of the pixel it contributes, its weight: the product of the
+// reflectivities and refractivities along the way. A reflected or refracted
+// ray is only traced when its weight is above opts->minWeight, so branches
+// that can't change the pixel, such as reflections off a matte surface,
+// are never cast. Each level down the tree holds at most one pending ray,
+// so the stack never grows past opts->maxDepth + 1 entries.
+void shadeColor(RenderOptions* opts, Scene* scene, real* Ro, real* Rd, int prim, real t,
+  real* col) {
+  RayTask ray;
+  v3_cpy(ray.Ro, Ro);
+  v3_cpy(ray.Rd, Rd);
+  ray.weight = 1;
+  ray.dp = opts->maxDepth;
+  shadeRay(opts, scene, &ray, prim, t, col);
+}
+
+// shadeColor() for a ray partway down the tree: its color is scaled by
+// start's weight and it bounces at most start->dp more times.
+void shadeRay(RenderOptions* opts, Scene* scene, RayTask* start, int prim, real t, real* col) {
+  RayTask stack[MAX_TRACE_DEPTH + 1];
+  RayTask ray = *start;
+  int top = 0;
+
+  // Initializing the color
+  col[0] = 0;
+  col[1] = 0;
+  col[2] = 0;
+
+  while (1) {
+    threadRays.depth[opts->maxDepth - ray.dp]++;
+    if(prim >= 0) {
+      Material* mat = prim_material(scene, prim);
+      real intersect[3] = {0, 0, 0};
+      real Norm[3] = {0, 0 ,0};
+      real local[3];
+      currentIntersect(intersect, ray.Ro, ray.Rd, t);
+
+      prim_normal(scene, prim, intersect, ray.Rd, Norm);
+
+      lightColor(scene, prim, intersect, Norm, ray.Rd, local);
+
+      // The last level keeps all of its own color, the others give up what
+      // they reflect and transmit.
+      real keep = 1;
+      if(ray.dp > 0) {
+        keep = 1 - (mat->reflectivity + mat->refractivity);
+      }
+      v3_scale(local, ray.weight * keep, local);
+      v3_add(col, local, col);
+
+      if(ray.dp > 0) {
+        real weight = ray.weight * mat->reflectivity;
+        if(weight > opts->minWeight) {
+          RayTask* next = &stack[top++];
+          reflection(next, Norm, ray.Ro, ray.Rd, t);
+          next->weight = weight;
+          next->dp = ray.dp - 1;
+          threadRays.reflection++;
+        } else {
+          threadRays.pruned++;
+        }
+
+        weight = ray.weight * mat->refractivity;
+        if(weight > opts->minWeight) {
+          RayTask* next = &stack[top++];
+          refraction(next, mat->refracIndex, Norm, prim, ray.Ro, ray.Rd, scene, t);
+          next->weight = weight;
+          next->dp = ray.dp - 1;
+          threadRays.refraction++;
+        } else {
+          threadRays.pruned++;
+        }
+      }
+    }
+
+    if(top == 0) {
+      break;
+    }
+    ray = stack[--top];
+    threadRays.traced++;
+    prim = rayCast(&t, scene, -1, ray.Ro, ray.Rd);
+  }
+}
+
+// Read-only state shared by every render thread.
+typedef struct {
+  Scene* scene;
+  RenderOptions* opts;
+  int M;
+  int N;
+  double h;
+  double w;
+  int x0;        // corner of the region the tiles are numbered from
+  int y0;
+  ScreenBins* bins;  // NULL casts primary rays with rayCast()
+} Frame;
+
+static void storeColor(Color* color, real* col) {
+  color->r = (unsigned char)(clamp(col[0])*255);
+  color->g = (unsigned char)(clamp(col[1])*255);
+  color->b = (unsigned char)(clamp(col[2])*255);
+}
+
+// Primary ray direction through the center of pixel (x, y). The image
+// plane sits one unit along the view's forward vector.
+static void primaryRay(Frame* frame, int x, int y, real* Rd) {
+  View* view = &frame->scene->view;
+  double h = frame->h;
+  double w = frame->w;
+  double imgH = h / frame->M;
+  double imgW = w / frame->N;
+
+  double px = -(w / 2) + imgW * (x + 0.5);
+  double py = -(-(h / 2) + imgH * (y + 0.5));
+  int i;
+  for (i = 0; i < 3; i++) {
+    Rd[i] = px * view->right[i] + py * view->up[i] + view->forward[i];
+  }
+  normalize(Rd);
+}
+
+// Closest hit of the primary ray Rd through pixel (x, y).
+static int primaryCast(Frame* frame, int x, int y, real* Rd, real* t) {
+  real* Ro = frame->scene->view.eye;
+  if (frame->bins != NULL) {
+    return bins_cast(frame->bins, frame->scene, x, y, Ro, Rd, t);
+  }
+  return rayCast(t, frame->scene, -1, Ro, Rd);
+}
+
+// Renders the tile in 2x2 pixel blocks. The four primary rays of a block
+// find their hits together as one packet, then each is shaded on its own,
+// since reflected, refracted and shadow rays no longer stay together.
+static void renderTilePackets(Tile* tile, Color* out, int stride, Frame* frame) {
+  static const int laneX[PACKET_SIZE] = {0, 1, 0, 1};
+  static const int laneY[PACKET_SIZE] = {0, 0, 1, 1};
+  GBuffer* gbuffer = frame->opts->gbuffer;
+  RayPacket packet;
+  real col[3];
+  int y, x, lane;
+
+  for (y = tile->y0; y < tile->y1; y += 2) {
+    for (x = tile->x0; x < tile->x1; x += 2) {
+      real* Ro = frame->scene->view.eye;
+      real Rd[PACKET_SIZE][3];
+
+      for (lane = 0; lane < PACKET_SIZE; lane++) {
+        int px = x + laneX[lane], py = y + laneY[lane];
+        // Blocks hanging over the tile edge repeat the first ray.
+        if (px >= tile->x1 || py >= tile->y1) {
+          px = x;
+          py = y;
+        }
+        primaryRay(frame, px, py, Rd[lane]);
+        packet.ox[lane] = Ro[0];
+        packet.oy[lane] = Ro[1];
+        packet.oz[lane] = Ro[2];
+        packet.dx[lane] = Rd[lane][0];
+        packet.dy[lane] = Rd[lane][1];
+        packet.dz[lane] = Rd[lane][2];
+      }
+      frame->opts->packets(frame->scene, &packet);
+
+      for (lane = 0; lane < PACKET_SIZE; lane++) {
+        int px = x + laneX[lane], py = y + laneY[lane];
+        if (px >= tile->x1 || py >= tile->y1) {
+          continue;
+        }
+        if (gbuffer != NULL) {
+          gbuffer->prim[(size_t)py * frame->N + px] = packet.prim[lane];
+          gbuffer->t[(size_t)py * frame->N + px] = packet.t[lane];
+        }
+        shadeColor(frame->opts, frame->scene, Ro, Rd[lane], packet.prim[lane], packet.t[lane],
+          col);
+        storeColor(&out[(py - tile->y0)*stride + (px - tile->x0)], col);
+      }
+    }
+  }
+}
+
+// Each render thread's wavefront queues, made at its first tile and freed
+// by mergeCounts() after its last.
+static __thread Wavefront* threadWave;
+
+// Renders the tile as one wavefront batch.
+static void renderTileWave(Tile* tile, Color* out, int stride, Frame* frame) {
+  Wavefront* w = threadWave;
+  GBuffer* gbuffer = frame->opts->gbuffer;
+  static const int laneX[PACKET_SIZE] = {0, 1, 0, 1};
+  static const int laneY[PACKET_SIZE] = {0, 0, 1, 1};
+  int known = frame->opts->reshade;
+  int tileW = tile->x1 - tile->x0;
+  int y, x, lane, i = 0;
+
+  // Primary rays are queued in 2x2 blocks, the way renderTilePackets()
+  // casts them, which is already as coherent as sorting could make them.
+  for (y = tile->y0; y < tile->y1; y += 2) {
+    for (x = tile->x0; x < tile->x1; x += 2) {
+      for (lane = 0; lane < PACKET_SIZE; lane++) {
+        int px = x + laneX[lane], py = y + laneY[lane];
+        if (px >= tile->x1 || py >= tile->y1) {
+          continue;
+        }
+        WaveRay* r = &w->rays[i++];
+        size_t pixel = (size_t)py * frame->N + px;
+        v3_cpy(r->Ro, frame->scene->view.eye);
+        primaryRay(frame, px, py, r->Rd);
+        r->weight = 1;
+        r->dp = frame->opts->maxDepth;
+        r->pixel = (py - tile->y0) * tileW + (px - tile->x0);
+        if (frame->opts->reshade) {
+          r->prim = gbuffer->prim[pixel];
+          r->t = gbuffer->t[pixel];
+        } else if (gbuffer != NULL || frame->bins != NULL) {
+          // Cast here so the hits can be kept in the frame's pixel order,
+          // or found from the bins.
+          r->prim = primaryCast(frame, px, py, r->Rd, &r->t);
+          if (gbuffer != NULL) {
+            gbuffer->prim[pixel] = r->prim;
+            gbuffer->t[pixel] = r->t;
+          }
+          known = 1;
+        }
+      }
+    }
+  }
+  w->count = i;
+  wavefront_run(w, frame->scene, frame->opts, known);
+
+  for (y = tile->y0; y < tile->y1; y++) {
+    for (x = tile->x0; x < tile->x1; x++) {
+      storeColor(&out[(y - tile->y0)*stride + (x - tile->x0)],
+        &w->color[3 * ((y - tile->y0) * tileW + (x - tile->x0))]);
+    }
+  }
+}
+
+// Renders one tile of the frame into out. Tiles never overlap, so threads
+// only ever write their own pixels.
+static void renderTile(Tile* region, Color* out, int stride, void* data) {
+  Frame* frame = data;
+  Tile shifted = {region->x0 + frame->x0, region->y0 + frame->y0,
+    region->x1 + frame->x0, region->y1 + frame->y0};
+  Tile* tile = &shifted;
+  GBuffer* gbuffer = frame->opts->gbuffer;
+  real col[3];
+  real t;
+
+  int y, x, prim;
+  if (frame->opts->wavefront) {
+    int pixels = (tile->x1 - tile->x0) * (tile->y1 - tile->y0);
+    if (threadWave == NULL || threadWave->maxPixels < pixels) {
+      wavefront_free(threadWave);
+      threadWave = wavefront_create(pixels);
+    }
+  }
+
+  RENDER_ALLOC_BEGIN();
+  if (frame->opts->wavefront) {
+    renderTileWave(tile, out, stride, frame);
+  } else if (frame->opts->packets != NULL && !frame->opts->reshade && frame->bins == NULL) {
+    renderTilePackets(tile, out, stride, frame);
+  } else {
+    for (y = tile->y0; y < tile->y1; y++) {
+      for (x = tile->x0; x < tile->x1; x++) {
+        real* Ro = frame->scene->view.eye;
+        real Rd[3];
+        size_t pixel = (size_t)y * frame->N + x;
+        primaryRay(frame, x, y, Rd);
+        // Reshading takes the first hit from the G-buffer instead of
+        // casting for it.
+        if (frame->opts->reshade) {
+          prim = gbuffer->prim[pixel];
+          t = gbuffer->t[pixel];
+        } else {
+          prim = primaryCast(frame, x, y, Rd, &t);
+          if (gbuffer != NULL) {
+            gbuffer->prim[pixel] = prim;
+            gbuffer->t[pixel] = t;
+          }
+        }
+        shadeColor(frame->opts, frame->scene, Ro, Rd, prim, t, col);
+
+        // Setting the color and getting it's values
+        storeColor(&out[(y - tile->y0)*stride + (x - tile->x0)], col);
+      }
+    }
+  }
+  RENDER_ALLOC_END();
+}
+
+// Adds this thread's counts into the frame's total. Runs once per thread,
+// after its last tile.
+static void mergeCounts(void* data) {
+  Frame* frame = data;
+  long* total = (long*)&frame->opts->rays;
+  long* mine = (long*)&threadRays;
+  size_t i;
+
+  for (i = 0; i < sizeof(RayCounts) / sizeof(long); i++) {
+    __atomic_fetch_add(&total[i], mine[i], __ATOMIC_RELAXED);
+  }
+  memset(&threadRays, 0, sizeof(RayCounts));
+  wavefront_free(threadWave);
+  threadWave = NULL;
+}
+
+// A wavefront wants bigger batches than a tile to find coherent rays in.
+static int tileSize(RenderOptions* opts) {
+  return opts->wavefront ? WAVE_TILE_SIZE : TILE_SIZE;
+}
+
+static void initFrame(Frame* frame, Scene* scene, int height, int width, RenderOptions* opts) {
+  // Getting the color width and height
+  frame->scene = scene;
+  frame->opts = opts;
+  frame->h = scene->objs[0]->Camera.height;
+  frame->w = scene->objs[0]->Camera.width;
+  frame->M = height;
+  frame->N = width;
+  frame->x0 = 0;
+  frame->y0 = 0;
+  frame->bins = NULL;
+}
+
+// Screen bins for region of the frame, when the options ask for them.
+// Reshading casts no primary rays, so it has no use for them.
+static ScreenBins* frameBins(Scene* scene, int height, int width, RenderOptions* opts,
+  Tile* region) {
+  if (!opts->binning || opts->reshade) {
+    return NULL;
+  }
+  return bins_build(scene, height, width, region);
+}
+
+// The scene as a frame renders it: a copy with the lights gridded for
+// opts->lightCutoff. Lights move between frames, so each frame grids them
+// afresh; the copy leaves the caller's scene as it was.
+static void litScene(Scene* lit, Scene* scene, RenderOptions* opts) {
+  *lit = *scene;
+  lit->lightGrid = lights_build(scene, opts->lightCutoff);
+}
+
+// Renders the whole frame. With opts->workers set the tiles go out to
+// that many worker processes instead of this process's threads.
+Color* sceneMaker(Scene* scene, int height, int width, RenderOptions* opts) {
+  Frame frame;
+  Scene lit;
+  litScene(&lit, scene, opts);
+  if (opts->workers > 0) {
+    Color* buff = workers_render(&lit, height, width, opts);
+    lights_free(lit.lightGrid);
+    return buff;
+  }
+  initFrame(&frame, &lit, height, width, opts);
+  memset(&opts->rays, 0, sizeof(RayCounts));
+
+  Color* buff = malloc((size_t)height * width * sizeof(Color));
+  if (buff == NULL) {
+    fprintf(stderr, "Error: Not enough memory for a %ix%i image.\n", width, height);
+    exit(1);
+  }
+
+  Tile all = {0, 0, width, height};
+  frame.bins = frameBins(scene, height, width, opts, &all);
+  tile_pool_run(width, height, tileSize(opts), opts->threads, buff, renderTile, mergeCounts,
+    &frame);
+  bins_free(frame.bins);
+  lights_free(lit.lightGrid);
+  return buff;
+}
+
+// Renders only the pixels of tile, on the calling thread, into out, which
+// is one tile-wide row after another. The counts are added to opts->rays
+// without clearing it first, so a worker can total up every tile it does.
+// scene is the frame's lit copy and bins its screen bins, or NULL.
+void sceneTile(Scene* scene, int height, int width, RenderOptions* opts, ScreenBins* bins,
+  Tile* tile, Color* out) {
+  Frame frame;
+  initFrame(&frame, scene, height, width, opts);
+  frame.bins = bins;
+  renderTile(tile, out, tile->x1 - tile->x0, &frame);
+  mergeCounts(&frame);
+}
+
+// Renders region of the width x height frame on opts->threads threads into
+// out, one region-wide row after another.
+void sceneRegion(Scene* scene, int height, int width, RenderOptions* opts, Tile* region,
+  Color* out) {
+  Frame frame;
+  Scene lit;
+  litScene(&lit, scene, opts);
+  initFrame(&frame, &lit, height, width, opts);
+  frame.x0 = region->x0;
+  frame.y0 = region->y0;
+  memset(&opts->rays, 0, sizeof(RayCounts));
+  frame.bins = frameBins(scene, height, width, opts, region);
+  tile_pool_run(region->x1 - region->x0, region->y1 - region->y0, tileSize(opts), opts->threads,
+    out, renderTile, mergeCounts, &frame);
+  bins_free(frame.bins);
+  lights_free(lit.lightGrid);
+}
+
+// The PPM has no way to seek back, so rows must come in exactly in order.
+static void sinkRows(Color* rows, int y, int count, void* data) {
+  PpmSink* sink = data;
+  if (y != sink->nextRow) {
+    fprintf(stderr, "Error: Image row %i arrived where row %i was expected.\n", y, sink->nextRow);
+    exit(1);
+  }
+  ppm_rows(sink, rows, count);
+}
+
+// Streams the frame into the sink band by band instead of holding the
+// whole image in memory.
+void sceneStreamer(Scene* scene, int height, int width, RenderOptions* opts, PpmSink* sink) {
+  Frame frame;
+  Scene lit;
+  litScene(&lit, scene, opts);
+  initFrame(&frame, &lit, height, width, opts);
+  memset(&opts->rays, 0, sizeof(RayCounts));
+  Tile all = {0, 0, width, height};
+  frame.bins = frameBins(scene, height, width, opts, &all);
+  tile_stream_run(width, height, TILE_SIZE, opts->threads, renderTile, mergeCounts, &frame,
+    sinkRows, sink);
+  bins_free(frame.bins);
+  lights_free(lit.lightGrid);
+}
@@ -0,0 +1,427 @@
+#include "header.h"
+#include <limits.h>
+
+// Alignment of every render-time array, one cache line.
+#define SCENE_ALIGN 64
+
+static real* scene_array(int count) {
+  size_t size = sizeof(real) * (count > 0 ? count : 1);
+  // aligned_alloc() wants the size to be a multiple of the alignment.
+  size = (size + SCENE_ALIGN - 1) / SCENE_ALIGN * SCENE_ALIGN;
+  real* a = aligned_alloc(SCENE_ALIGN, size);
+  if (a == NULL) {
+    fprintf(stderr, "Error: Out of memory while building the scene.\n");
+    exit(1);
+  }
+  return a;
+}
+
+// Parsed vectors are always double, the render-time ones are real.
+static void copy_vec(real* to, double* from) {
+  to[0] = from[0];
+  to[1] = from[1];
+  to[2] = from[2];
+}
+
+static void copy_material(Material* mat, Obj* obj) {
+  copy_vec(mat->diffuse, obj->diffuse);
+  copy_vec(mat->specular, obj->specular);
+  mat->reflectivity = obj->reflectivity;
+  mat->refractivity = obj->refractivity;
+  mat->refracIndex = obj->refracIndex;
+}
+
+// Puts the sphere in array slot i at position. The parsed object is left
+// alone, it may live in a read-only mapping.
+void scene_move_sphere(Scene* scene, int i, double* pos, double r) {
+  SphereSet* s = &scene->spheres;
+  s->cx[i] = pos[0];
+  s->cy[i] = pos[1];
+  s->cz[i] = pos[2];
+  s->cc[i] = pos[0] * pos[0] + pos[1] * pos[1] + pos[2] * pos[2] - r * r;
+}
+
+static void add_sphere(Scene* scene, int i, Obj* obj) {
+  scene_move_sphere(scene, i, obj->Sphere.position, obj->Sphere.radius);
+  copy_material(&scene->mats[i], obj);
+}
+
+static void missing(const char* kind, int number, const char* field) {
+  fprintf(stderr, "Error: %s %d has no \"%s\".\n", kind, number, field);
+  exit(1);
+}
+
+// Checks that every object has what rendering will read, so a bad scene
+// stops here instead of crashing halfway through a frame. Objects are
+// numbered from 1 per kind, in file order.
+void scene_validate(Obj** objs, Obj** light) {
+  int spheres = 0, planes = 0, meshes = 0, instances = 0, lights = 0;
+  int i;
+
+  if (objs == NULL || objs[0] == NULL || objs[0]->type != 0) {
+    fprintf(stderr, "Error: The scene must start with the camera.\n");
+    exit(1);
+  }
+  if (!(objs[0]->Camera.width > 0) || !(objs[0]->Camera.height > 0)) {
+    fprintf(stderr, "Error: The camera needs a positive width and height.\n");
+    exit(1);
+  }
+
+  for (i = 1; objs[i] != NULL; i++) {
+    Obj* obj = objs[i];
+    if (obj->type == 0) {
+      fprintf(stderr, "Error: The scene has more than one camera.\n");
+      exit(1);
+    } else if (obj->type == 1) {
+      spheres++;
+      if (obj->diffuse == NULL) missing("Sphere", spheres, "diffuse_color");
+      if (obj->specular == NULL) missing("Sphere", spheres, "specular_color");
+      if (obj->Sphere.position == NULL) missing("Sphere", spheres, "position");
+      if (!(obj->Sphere.radius > 0)) {
+        fprintf(stderr, "Error: Sphere %d needs a positive \"radius\".\n", spheres);
+        exit(1);
+      }
+    } else if (obj->type == 2) {
+      planes++;
+      if (obj->diffuse == NULL) missing("Plane", planes, "diffuse_color");
+      if (obj->specular == NULL) missing("Plane", planes, "specular_color");
+      if (obj->Plane.position == NULL) missing("Plane", planes, "position");
+      if (obj->Plane.normal == NULL) missing("Plane", planes, "normal");
+      double* n = obj->Plane.normal;
+      if (n[0] * n[0] + n[1] * n[1] + n[2] * n[2] == 0) {
+        fprintf(stderr, "Error: Plane %d has a zero \"normal\".\n", planes);
+        exit(1);
+      }
+    } else if (obj->type == 4) {
+      meshes++;
+      if (obj->diffuse == NULL) missing("Mesh", meshes, "diffuse_color");
+      if (obj->specular == NULL) missing("Mesh", meshes, "specular_color");
+      if (obj->Mesh.file == NULL) missing("Mesh", meshes, "file");
+    } else if (obj->type == 5) {
+      instances++;
+      if (obj->diffuse == NULL) missing("Instance", instances, "diffuse_color");
+      if (obj->specular == NULL) missing("Instance", instances, "specular_color");
+      if (obj->Mesh.file == NULL) missing("Instance", instances, "file");
+      double* s = obj->Mesh.scale;
+      if (s != NULL && (s[0] == 0 || s[1] == 0 || s[2] == 0)) {
+        fprintf(stderr, "Error: Instance %d needs a non-zero \"scale\".\n", instances);
+        exit(1);
+      }
+    }
+  }
+
+  for (i = 0; light[i] != NULL; i++) {
+    lights++;
+    if (light[i]->diffuse == NULL) missing("Light", lights, "color");
+    if (light[i]->Light.position == NULL) missing("Light", lights, "position");
+  }
+}
+
+static void add_light(SceneLight* l, Obj* obj) {
+  copy_vec(l->position, obj->Light.position);
+  copy_vec(l->color, obj->diffuse);
+  l->spot = obj->Light.direct != NULL;
+  if (l->spot) {
+    copy_vec(l->direct, obj->Light.direct);
+    l->spotCutoff = sin(obj->Light.theta * M_PI / 180);
+  } else {
+    l->direct[0] = l->direct[1] = l->direct[2] = 0;
+    l->spotCutoff = 0;
+  }
+  l->radial_a0 = obj->Light.radial_a0;
+  l->radial_a1 = obj->Light.radial_a1;
+  l->radial_a2 = obj->Light.radial_a2;
+}
+
+void scene_move_light(Scene* scene, int i, double* pos) {
+  copy_vec(scene->lights[i].position, pos);
+}
+
+static void cross(double* a, double* b, double* out) {
+  out[0] = a[1] * b[2] - a[2] * b[1];
+  out[1] = a[2] * b[0] - a[0] * b[2];
+  out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static double unit(double* v) {
+  double len = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+  if (len > 0) {
+    v[0] /= len;
+    v[1] /= len;
+    v[2] /= len;
+  }
+  return len;
+}
+
+// Moves the camera to eye and turns it toward target, keeping +y up. Looking
+// straight up or down, +z stands in for up instead.
+void scene_look_at(Scene* scene, double* eye, double* target) {
+  double forward[3] = {target[0] - eye[0], target[1] - eye[1], target[2] - eye[2]};
+  double worldUp[3] = {0, 1, 0};
+  double right[3], up[3];
+
+  if (unit(forward) == 0) {
+    fprintf(stderr, "Error: The camera can't look at the point it stands on.\n");
+    exit(1);
+  }
+  cross(worldUp, forward, right);
+  if (unit(right) < 1e-9) {
+    double back[3] = {0, 0, forward[1] > 0 ? -1 : 1};
+    cross(back, forward, right);
+    unit(right);
+  }
+  cross(forward, right, up);
+
+  copy_vec(scene->view.eye, eye);
+  copy_vec(scene->view.right, right);
+  copy_vec(scene->view.up, up);
+  copy_vec(scene->view.forward, forward);
+}
+
+// Rows of the 3x4 affine map taking an instance's mesh to the world: scale,
+// then rotate about x, y and z, then move. A mesh object is left where its
+// file put it.
+static void instance_to_world(Obj* obj, double* w) {
+  double angle[3] = {0, 0, 0}, scale[3] = {1, 1, 1}, move[3] = {0, 0, 0};
+  int a, b;
+
+  if (obj->type == 5) {
+    for (a = 0; a < 3; a++) {
+      if (obj->Mesh.rotation != NULL) angle[a] = obj->Mesh.rotation[a] * M_PI / 180;
+      if (obj->Mesh.scale != NULL) scale[a] = obj->Mesh.scale[a];
+      if (obj->Mesh.position != NULL) move[a] = obj->Mesh.position[a];
+    }
+  }
+  double cx = cos(angle[0]), sx = sin(angle[0]);
+  double cy = cos(angle[1]), sy = sin(angle[1]);
+  double cz = cos(angle[2]), sz = sin(angle[2]);
+  // Rz * Ry * Rx, so x turns first.
+  double r[3][3] = {
+    {cz * cy, cz * sy * sx - sz * cx, cz * sy * cx + sz * sx},
+    {sz * cy, sz * sy * sx + cz * cx, sz * sy * cx - cz * sx},
+    {-sy, cy * sx, cy * cx}
+  };
+  for (a = 0; a < 3; a++) {
+    for (b = 0; b < 3; b++) {
+      w[4 * a + b] = r[a][b] * scale[b];
+    }
+    w[4 * a + 3] = move[a];
+  }
+}
+
+// Inverse of the affine map w, whose linear part was checked to be
+// invertible when the scale was.
+static void affine_invert(double* w, double* inv) {
+  double c[3][3];
+  int a, b;
+
+  // Cofactors, transposed as the adjugate is.
+  for (a = 0; a < 3; a++) {
+    for (b = 0; b < 3; b++) {
+      int a1 = (a + 1) % 3, a2 = (a + 2) % 3, b1 = (b + 1) % 3, b2 = (b + 2) % 3;
+      c[b][a] = w[4 * a1 + b1] * w[4 * a2 + b2] - w[4 * a1 + b2] * w[4 * a2 + b1];
+    }
+  }
+  double det = w[0] * c[0][0] + w[1] * c[1][0] + w[2] * c[2][0];
+  for (a = 0; a < 3; a++) {
+    for (b = 0; b < 3; b++) {
+      inv[4 * a + b] = c[a][b] / det;
+    }
+    inv[4 * a + 3] = -(inv[4 * a] * w[3] + inv[4 * a + 1] * w[7] + inv[4 * a + 2] * w[11]);
+  }
+}
+
+static int affine_is_identity(double* w) {
+  static const double identity[12] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0};
+  int i;
+  for (i = 0; i < 12; i++) {
+    if (w[i] != identity[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void* mesh_array(size_t size) {
+  void* a = malloc(size > 0 ? size : 1);
+  if (a == NULL) {
+    fprintf(stderr, "Error: Out of memory while building the scene.\n");
+    exit(1);
+  }
+  return a;
+}
+
+// Loads every mesh file once and places the count mesh and instance
+// objects, in the leaf order of a tree over their world bounds. Their
+// materials follow the planes' in that order.
+static void add_meshes(Scene* scene, int count) {
+  MeshSet* m = &scene->meshes;
+  Obj** objs = scene->objs;
+  int first = scene->spheres.count + scene->planes.count;
+  Obj** placed = mesh_array(sizeof(Obj*) * count);
+  Mesh** meshOf = mesh_array(sizeof(Mesh*) * count);
+  double* toWorld = mesh_array(sizeof(double) * 12 * count);
+  double* bounds = mesh_array(sizeof(double) * 6 * count);
+  char** files = mesh_array(sizeof(char*) * count);
+  int i, j, k = 0, a, corner;
+
+  m->items = mesh_array(sizeof(Mesh) * count);
+  m->count = 0;
+  for (i = 0; objs[i] != NULL; i++) {
+    if (objs[i]->type != 4 && objs[i]->type != 5) {
+      continue;
+    }
+    // Copies name the same file, and share what was loaded from it.
+    for (j = 0; j < m->count && strcmp(files[j], objs[i]->Mesh.file) != 0; j++);
+    if (j == m->count) {
+      mesh_load(&m->items[j], objs[i]->Mesh.file);
+      files[m->count++] = objs[i]->Mesh.file;
+    }
+    meshOf[k] = &m->items[j];
+    placed[k] = objs[i];
+
+    // World bounds are the mesh's box with its corners carried over.
+    double* w = &toWorld[12 * (size_t)k];
+    double* box = &bounds[6 * (size_t)k];
+    BvhNode* root = &meshOf[k]->bvh->nodes[0];
+    instance_to_world(objs[i], w);
+    for (a = 0; a < 3; a++) {
+      box[a] = INFINITY;
+      box[3 + a] = -INFINITY;
+    }
+    for (corner = 0; corner < 8; corner++) {
+      double p[3] = {corner & 1 ? root->max[0] : root->min[0],
+        corner & 2 ? root->max[1] : root->min[1], corner & 4 ? root->max[2] : root->min[2]};
+      for (a = 0; a < 3; a++) {
+        double v = w[4 * a] * p[0] + w[4 * a + 1] * p[1] + w[4 * a + 2] * p[2] + w[4 * a + 3];
+        box[a] = fmin(box[a], v);
+        box[3 + a] = fmax(box[3 + a], v);
+      }
+    }
+    k++;
+  }
+
+  m->bvh = bvh_build_boxes(bounds, count);
+  m->instances = mesh_array(sizeof(Instance) * count);
+  m->instanceCount = count;
+  m->triCount = 0;
+  for (k = 0; k < count; k++) {
+    int src = m->bvh->prims[k];
+    Instance* inst = &m->instances[k];
+    double inv[12];
+
+    inst->mesh = meshOf[src];
+    inst->identity = affine_is_identity(&toWorld[12 * (size_t)src]);
+    affine_invert(&toWorld[12 * (size_t)src], inv);
+    for (a = 0; a < 12; a++) {
+      inst->toObject[a] = inv[a];
+    }
+    if (inst->mesh->triCount > INT_MAX / 2 - first - m->triCount) {
+      fprintf(stderr, "Error: The scene has too many triangles.\n");
+      exit(1);
+    }
+    inst->firstPrim = first + m->triCount;
+    m->triCount += inst->mesh->triCount;
+    copy_material(&scene->mats[first + k], placed[src]);
+  }
+
+  // The order is in instances now, the tree doesn't need its own copy.
+  free(m->bvh->prims);
+  m->bvh->prims = NULL;
+  free(placed);
+  free(meshOf);
+  free(toWorld);
+  free(bounds);
+  free(files);
+}
+
+// Lays the validated objects out for rendering and works out everything
+// that stays fixed for the frame: unit plane normals, the constant term of
+// each sphere's quadratic, spotlight cutoffs. With a BVH the spheres follow
+// its leaf order, so every leaf is one contiguous run of the arrays. Meshes
+// are loaded here, each with its own BVH whatever the spheres use, and
+// placed under a tree of their own. The camera starts at the origin looking
+// down +z.
+void scene_build(Scene* scene) {
+  Obj** objs = scene->objs;
+  SphereSet* s = &scene->spheres;
+  PlaneSet* p = &scene->planes;
+  int i, spheres = 0, planes = 0, meshes = 0;
+
+  for (i = 0; objs[i] != NULL; i++) {
+    if (objs[i]->type == 1) {
+      spheres++;
+    } else if (objs[i]->type == 2) {
+      planes++;
+    } else if (objs[i]->type == 4 || objs[i]->type == 5) {
+      meshes++;
+    }
+  }
+
+  s->count = spheres;
+  s->cx = scene_array(spheres);
+  s->cy = scene_array(spheres);
+  s->cz = scene_array(spheres);
+  s->cc = scene_array(spheres);
+  p->count = planes;
+  p->nx = scene_array(planes);
+  p->ny = scene_array(planes);
+  p->nz = scene_array(planes);
+  p->d = scene_array(planes);
+  int mats = spheres + planes + meshes;
+  scene->mats = malloc(sizeof(Material) * (mats > 0 ? mats : 1));
+  if (scene->mats == NULL) {
+    fprintf(stderr, "Error: Out of memory while building the scene.\n");
+    exit(1);
+  }
+
+  if (scene->bvh != NULL) {
+    for (i = 0; i < scene->bvh->primCount; i++) {
+      add_sphere(scene, i, objs[scene->bvh->prims[i]]);
+    }
+  } else {
+    spheres = 0;
+    for (i = 0; objs[i] != NULL; i++) {
+      if (objs[i]->type == 1) {
+        add_sphere(scene, spheres++, objs[i]);
+      }
+    }
+  }
+
+  planes = 0;
+  for (i = 0; objs[i] != NULL; i++) {
+    if (objs[i]->type == 2) {
+      // Normalized in double, before anything is rounded to real.
+      double* normal = objs[i]->Plane.normal;
+      double* pos = objs[i]->Plane.position;
+      double len = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+      double n[3] = {normal[0] / len, normal[1] / len, normal[2] / len};
+      p->nx[planes] = n[0];
+      p->ny[planes] = n[1];
+      p->nz[planes] = n[2];
+      p->d[planes] = n[0] * pos[0] + n[1] * pos[1] + n[2] * pos[2];
+      copy_material(&scene->mats[s->count + planes], objs[i]);
+      planes++;
+    }
+  }
+
+  add_meshes(scene, meshes);
+
+  for (i = 0; scene->light[i] != NULL; i++);
+  scene->lightCount = i;
+  scene->lights = malloc(sizeof(SceneLight) * (i > 0 ? i : 1));
+  if (scene->lights == NULL) {
+    fprintf(stderr, "Error: Out of memory while building the scene.\n");
+    exit(1);
+  }
+  for (i = 0; i < scene->lightCount; i++) {
+    add_light(&scene->lights[i], scene->light[i]);
+  }
+  scene->lightGrid = NULL;
+
+  View* v = &scene->view;
+  memset(v, 0, sizeof(View));
+  v->right[0] = 1;
+  v->up[1] = 1;
+  v->forward[2] = 1;
+}
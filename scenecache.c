@@ -0,0 +1,497 @@
+#include "header.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Compiled scenes are a header followed by flat, pointer-free tables. The
+// loader maps the file and points the objects straight at its vector table,
+// so nothing is parsed and nothing is allocated per object. Mesh files are
+// named once each in a table of strings, however many objects use them; the
+// meshes themselves are loaded from there when the scene is laid out.
+#define CACHE_MAGIC "RTSC"
+#define CACHE_VERSION 5
+#define CACHE_BYTE_ORDER 0x01020304u
+
+// Sections start on this boundary so the mapped arrays are aligned.
+#define CACHE_ALIGN 64
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t scalarSize;  // sizeof(real) of the build, which the BVH nodes use
+  uint32_t objCount;
+  uint32_t lightCount;
+  uint32_t vecCount;
+  uint32_t nodeCount;
+  uint32_t primCount;
+  uint32_t bvhDepth;
+  uint32_t strSize;
+  uint32_t pad;
+  uint64_t recordOffset;
+  uint64_t vecOffset;
+  uint64_t nodeOffset;
+  uint64_t primOffset;
+  uint64_t strOffset;
+  uint64_t size;
+} CacheHeader;
+
+// One Obj with its vector pointers replaced by indices into the vector
+// table (-1 when unset), and a mesh's file by the offset of its name in the
+// string table. The scalars follow the union member for the type.
+typedef struct {
+  int32_t type;
+  int32_t diffuse;
+  int32_t specular;
+  int32_t position;
+  int32_t normal;
+  int32_t direct;
+  int32_t rotation;
+  int32_t scale;
+  int32_t file;
+  int32_t pad;
+  double refractivity;
+  double reflectivity;
+  double refracIndex;
+  double scalar[5];
+} CacheRecord;
+
+typedef struct {
+  FILE* out;
+  uint64_t offset;
+  int32_t vecCount;
+  uint32_t strSize;
+  char** files;  // each distinct mesh path, in string table order
+  uint32_t* fileOffsets;
+  int fileCount;
+} CacheWriter;
+
+static void cache_write(CacheWriter* w, const void* data, size_t size) {
+  if (size > 0 && fwrite(data, 1, size, w->out) != size) {
+    fprintf(stderr, "Error: Failed to write the compiled scene.\n");
+    exit(1);
+  }
+  w->offset += size;
+}
+
+static uint64_t cache_align(CacheWriter* w) {
+  static const char zeros[CACHE_ALIGN] = {0};
+  size_t pad = (CACHE_ALIGN - w->offset % CACHE_ALIGN) % CACHE_ALIGN;
+  cache_write(w, zeros, pad);
+  return w->offset;
+}
+
+// Hands out the next vector slot, or -1 for an unset vector.
+static int32_t vec_index(CacheWriter* w, double* v) {
+  return v == NULL ? -1 : w->vecCount++;
+}
+
+static void vec_write(CacheWriter* w, double* v) {
+  if (v != NULL) {
+    cache_write(w, v, 3 * sizeof(double));
+  }
+}
+
+// Offset of path in the string table, adding it the first time it's seen.
+// Paths were made canonical, so one file always gets the same string.
+static int32_t file_offset(CacheWriter* w, char* path) {
+  int i;
+  for (i = 0; i < w->fileCount; i++) {
+    if (strcmp(w->files[i], path) == 0) {
+      return w->fileOffsets[i];
+    }
+  }
+  w->files[w->fileCount] = path;
+  w->fileOffsets[w->fileCount++] = w->strSize;
+  w->strSize += strlen(path) + 1;
+  return w->fileOffsets[i];
+}
+
+static void to_record(CacheWriter* w, Obj* obj, CacheRecord* r) {
+  memset(r, 0, sizeof(*r));
+  r->type = obj->type;
+  r->refractivity = obj->refractivity;
+  r->reflectivity = obj->reflectivity;
+  r->refracIndex = obj->refracIndex;
+  r->diffuse = vec_index(w, obj->diffuse);
+  r->specular = vec_index(w, obj->specular);
+  r->position = r->normal = r->direct = r->rotation = r->scale = r->file = -1;
+
+  switch (obj->type) {
+    case 0:
+      r->scalar[0] = obj->Camera.width;
+      r->scalar[1] = obj->Camera.height;
+      r->scalar[2] = obj->Camera.maxDepth;
+      r->scalar[3] = obj->Camera.minWeight;
+      break;
+    case 1:
+      r->position = vec_index(w, obj->Sphere.position);
+      r->scalar[0] = obj->Sphere.radius;
+      break;
+    case 2:
+      r->position = vec_index(w, obj->Plane.position);
+      r->normal = vec_index(w, obj->Plane.normal);
+      break;
+    case 3:
+      r->position = vec_index(w, obj->Light.position);
+      r->direct = vec_index(w, obj->Light.direct);
+      r->scalar[0] = obj->Light.theta;
+      r->scalar[1] = obj->Light.angular_a0;
+      r->scalar[2] = obj->Light.radial_a0;
+      r->scalar[3] = obj->Light.radial_a1;
+      r->scalar[4] = obj->Light.radial_a2;
+      break;
+    case 5:
+      r->position = vec_index(w, obj->Mesh.position);
+      r->rotation = vec_index(w, obj->Mesh.rotation);
+      r->scale = vec_index(w, obj->Mesh.scale);
+      r->file = file_offset(w, obj->Mesh.file);
+      break;
+    case 4:
+      r->file = file_offset(w, obj->Mesh.file);
+      break;
+  }
+}
+
+// Vectors are written in the same order to_record() numbered them.
+static void obj_vectors(CacheWriter* w, Obj* obj) {
+  vec_write(w, obj->diffuse);
+  vec_write(w, obj->specular);
+  switch (obj->type) {
+    case 1:
+      vec_write(w, obj->Sphere.position);
+      break;
+    case 2:
+      vec_write(w, obj->Plane.position);
+      vec_write(w, obj->Plane.normal);
+      break;
+    case 3:
+      vec_write(w, obj->Light.position);
+      vec_write(w, obj->Light.direct);
+      break;
+    case 5:
+      vec_write(w, obj->Mesh.position);
+      vec_write(w, obj->Mesh.rotation);
+      vec_write(w, obj->Mesh.scale);
+      break;
+  }
+}
+
+// Parses a JSON scene and writes it out compiled, with its BVH when
+// withBvh is set.
+void scene_compile(char* input, char* output, int withBvh) {
+  Obj** light;
+  Obj** objs = read_scene(input, &light);
+  Bvh* bvh = NULL;
+  CacheHeader header;
+  CacheRecord record;
+  CacheWriter w;
+  int i;
+
+  if (objs == NULL) {
+    exit(1);
+  }
+  scene_validate(objs, light);
+  // Mesh paths are made absolute, so the compiled scene can be moved away
+  // from the files it names.
+  for (i = 0; objs[i] != NULL; i++) {
+    if (objs[i]->type == 4 || objs[i]->type == 5) {
+      char* path = realpath(objs[i]->Mesh.file, NULL);
+      if (path == NULL) {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", objs[i]->Mesh.file);
+        exit(1);
+      }
+      objs[i]->Mesh.file = path;
+    }
+  }
+  if (withBvh) {
+    bvh = bvh_build(objs);
+  }
+
+  w.out = fopen(output, "wb");
+  w.offset = 0;
+  w.vecCount = 0;
+  w.strSize = 0;
+  w.fileCount = 0;
+  if (w.out == NULL) {
+    fprintf(stderr, "Error: Failed to open file %s\n", output);
+    exit(1);
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, 4);
+  header.version = CACHE_VERSION;
+  header.byteOrder = CACHE_BYTE_ORDER;
+  header.scalarSize = sizeof(real);
+  for (i = 0; objs[i] != NULL; i++) header.objCount++;
+  w.files = malloc(sizeof(char*) * (header.objCount + 1));
+  w.fileOffsets = malloc(sizeof(uint32_t) * (header.objCount + 1));
+  if (w.files == NULL || w.fileOffsets == NULL) {
+    fprintf(stderr, "Error: Out of memory while compiling the scene.\n");
+    exit(1);
+  }
+  for (i = 0; light[i] != NULL; i++) header.lightCount++;
+  if (bvh != NULL) {
+    header.nodeCount = bvh->nodeCount;
+    header.primCount = bvh->primCount;
+    header.bvhDepth = bvh->depth;
+  }
+
+  // The header goes out twice: once to reserve its space, and again at the
+  // end once every offset is known.
+  cache_write(&w, &header, sizeof(header));
+
+  header.recordOffset = cache_align(&w);
+  for (i = 0; objs[i] != NULL; i++) {
+    to_record(&w, objs[i], &record);
+    cache_write(&w, &record, sizeof(record));
+  }
+  for (i = 0; light[i] != NULL; i++) {
+    to_record(&w, light[i], &record);
+    cache_write(&w, &record, sizeof(record));
+  }
+  header.vecCount = w.vecCount;
+  header.strSize = w.strSize;
+
+  header.vecOffset = cache_align(&w);
+  for (i = 0; objs[i] != NULL; i++) obj_vectors(&w, objs[i]);
+  for (i = 0; light[i] != NULL; i++) obj_vectors(&w, light[i]);
+
+  header.strOffset = cache_align(&w);
+  for (i = 0; i < w.fileCount; i++) {
+    cache_write(&w, w.files[i], strlen(w.files[i]) + 1);
+  }
+
+  if (bvh != NULL) {
+    header.nodeOffset = cache_align(&w);
+    cache_write(&w, bvh->nodes, sizeof(BvhNode) * bvh->nodeCount);
+    header.primOffset = cache_align(&w);
+    cache_write(&w, bvh->prims, sizeof(int) * bvh->primCount);
+  }
+  header.size = w.offset;
+
+  if (fseek(w.out, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Error: Failed to write the compiled scene.\n");
+    exit(1);
+  }
+  cache_write(&w, &header, sizeof(header));
+  fclose(w.out);
+  bvh_free(bvh);
+  for (i = 0; objs[i] != NULL; i++) {
+    if (objs[i]->type == 4 || objs[i]->type == 5) {
+      free(objs[i]->Mesh.file);
+    }
+  }
+  free(w.files);
+  free(w.fileOffsets);
+}
+
+static void cache_check(int ok, char* filename, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "Error: Compiled scene \"%s\" %s.\n", filename, what);
+    exit(1);
+  }
+}
+
+// Whether bytes bytes from offset lie inside a file of size bytes, written
+// so that no offset or length can wrap around.
+static int in_file(uint64_t offset, uint64_t bytes, size_t size) {
+  return offset <= size && bytes <= size - offset;
+}
+
+static double* vec_at(double* vecs, uint32_t count, int32_t index, char* filename) {
+  if (index < 0) {
+    return NULL;
+  }
+  cache_check((uint32_t)index < count, filename, "has a bad vector index");
+  return vecs + 3 * (size_t)index;
+}
+
+// The strings were checked to end in a NUL, so any offset inside the table
+// starts a terminated string.
+static char* str_at(char* strs, uint32_t size, int32_t offset, char* filename) {
+  cache_check(offset >= 0 && (uint32_t)offset < size, filename, "has a bad file name");
+  return strs + offset;
+}
+
+static void from_record(CacheRecord* r, Obj* obj, double* vecs, uint32_t count, char* strs,
+  uint32_t strSize, char* filename) {
+  memset(obj, 0, sizeof(*obj));
+  obj->type = r->type;
+  obj->refractivity = r->refractivity;
+  obj->reflectivity = r->reflectivity;
+  obj->refracIndex = r->refracIndex;
+  obj->diffuse = vec_at(vecs, count, r->diffuse, filename);
+  obj->specular = vec_at(vecs, count, r->specular, filename);
+
+  switch (r->type) {
+    case 0:
+      obj->Camera.width = r->scalar[0];
+      obj->Camera.height = r->scalar[1];
+      obj->Camera.maxDepth = r->scalar[2];
+      obj->Camera.minWeight = r->scalar[3];
+      break;
+    case 1:
+      obj->Sphere.position = vec_at(vecs, count, r->position, filename);
+      obj->Sphere.radius = r->scalar[0];
+      break;
+    case 2:
+      obj->Plane.position = vec_at(vecs, count, r->position, filename);
+      obj->Plane.normal = vec_at(vecs, count, r->normal, filename);
+      break;
+    case 3:
+      obj->Light.position = vec_at(vecs, count, r->position, filename);
+      obj->Light.direct = vec_at(vecs, count, r->direct, filename);
+      obj->Light.theta = r->scalar[0];
+      obj->Light.angular_a0 = r->scalar[1];
+      obj->Light.radial_a0 = r->scalar[2];
+      obj->Light.radial_a1 = r->scalar[3];
+      obj->Light.radial_a2 = r->scalar[4];
+      break;
+    case 4:
+      obj->Mesh.file = str_at(strs, strSize, r->file, filename);
+      break;
+    case 5:
+      obj->Mesh.file = str_at(strs, strSize, r->file, filename);
+      obj->Mesh.position = vec_at(vecs, count, r->position, filename);
+      obj->Mesh.rotation = vec_at(vecs, count, r->rotation, filename);
+      obj->Mesh.scale = vec_at(vecs, count, r->scale, filename);
+      break;
+    default:
+      cache_check(0, filename, "has an object of unknown type");
+  }
+}
+
+// Maps a compiled scene and fills in scene from it. The vectors and the BVH
+// are used in place; the objects take one allocation for the whole scene.
+// The caller lays the scene out for rendering afterwards.
+static void load_compiled(char* filename, char* data, size_t size, Scene* scene, int useBvh) {
+  CacheHeader* h = (CacheHeader*)data;
+  uint32_t i;
+
+  cache_check(size >= sizeof(CacheHeader), filename, "is truncated");
+  cache_check(h->byteOrder == CACHE_BYTE_ORDER, filename, "was compiled for a different machine");
+  if (h->version != CACHE_VERSION) {
+    fprintf(stderr, "Error: Compiled scene \"%s\" is version %u, expected %u. Compile it again.\n",
+      filename, h->version, CACHE_VERSION);
+    exit(1);
+  }
+  // The BVH is mapped as is, so its nodes must be this build's reals.
+  if (h->scalarSize != sizeof(real)) {
+    fprintf(stderr, "Error: Compiled scene \"%s\" is for a %s build, this one is %s. Compile it again.\n",
+      filename, h->scalarSize == sizeof(float) ? "float" : "double", REAL_NAME);
+    exit(1);
+  }
+  cache_check(h->size == size, filename, "is truncated");
+  uint64_t total = (uint64_t)h->objCount + h->lightCount;
+  cache_check(in_file(h->recordOffset, total * sizeof(CacheRecord), size) &&
+    in_file(h->vecOffset, (uint64_t)h->vecCount * 3 * sizeof(double), size) &&
+    in_file(h->strOffset, h->strSize, size) &&
+    (h->strSize == 0 || data[h->strOffset + h->strSize - 1] == 0),
+    filename, "is corrupt");
+
+  CacheRecord* records = (CacheRecord*)(data + h->recordOffset);
+  double* vecs = (double*)(data + h->vecOffset);
+
+  Obj* pool = malloc(sizeof(Obj) * (total > 0 ? total : 1));
+  scene->objs = malloc(sizeof(Obj*) * ((size_t)h->objCount + 1));
+  scene->light = malloc(sizeof(Obj*) * ((size_t)h->lightCount + 1));
+  if (pool == NULL || scene->objs == NULL || scene->light == NULL) {
+    fprintf(stderr, "Error: Out of memory while loading the scene.\n");
+    exit(1);
+  }
+  for (i = 0; i < total; i++) {
+    from_record(&records[i], &pool[i], vecs, h->vecCount, data + h->strOffset, h->strSize,
+      filename);
+  }
+  for (i = 0; i < h->objCount; i++) {
+    scene->objs[i] = &pool[i];
+  }
+  scene->objs[h->objCount] = NULL;
+  for (i = 0; i < h->lightCount; i++) {
+    scene->light[i] = &pool[h->objCount + i];
+  }
+  scene->light[h->lightCount] = NULL;
+  scene_validate(scene->objs, scene->light);
+
+  scene->bvh = NULL;
+  if (!useBvh) {
+    return;
+  }
+  if (h->nodeCount == 0) {
+    scene->bvh = bvh_build(scene->objs);
+    return;
+  }
+
+  cache_check(in_file(h->nodeOffset, (uint64_t)h->nodeCount * sizeof(BvhNode), size) &&
+    in_file(h->primOffset, (uint64_t)h->primCount * sizeof(int), size),
+    filename, "has a corrupt BVH");
+  BvhNode* nodes = (BvhNode*)(data + h->nodeOffset);
+  int* prims = (int*)(data + h->primOffset);
+  uint32_t sphereCount = 0;
+  for (i = 0; i < h->objCount; i++) {
+    sphereCount += scene->objs[i]->type == 1;
+  }
+  cache_check(h->primCount == sphereCount && bvh_nodes_valid(nodes, h->nodeCount, h->primCount),
+    filename, "has a corrupt BVH");
+  // Every sphere has to be in the tree exactly once, since scene_build()
+  // lays the spheres out from prims.
+  char* seen = calloc(h->objCount > 0 ? h->objCount : 1, 1);
+  if (seen == NULL) {
+    fprintf(stderr, "Error: Out of memory while loading the scene.\n");
+    exit(1);
+  }
+  for (i = 0; i < h->primCount; i++) {
+    int p = prims[i];
+    cache_check(p >= 0 && (uint32_t)p < h->objCount && scene->objs[p]->type == 1 && !seen[p],
+      filename, "has a corrupt BVH");
+    seen[p] = 1;
+  }
+  free(seen);
+
+  scene->bvh = malloc(sizeof(Bvh));
+  scene->bvh->nodes = nodes;
+  scene->bvh->nodeCount = h->nodeCount;
+  scene->bvh->depth = h->bvhDepth;
+  scene->bvh->prims = prims;
+  scene->bvh->primCount = h->primCount;
+  scene->bvh->mapped = 1;
+}
+
+// Loads a scene from either a JSON file or a compiled scene, builds the BVH
+// when useBvh is set and the file doesn't already carry one, and lays the
+// scene out for rendering.
+void scene_load(char* filename, Scene* scene, int useBvh) {
+  struct stat st;
+  char magic[4] = {0};
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+
+  if (st.st_size < (off_t)sizeof(CacheHeader) || pread(fd, magic, 4, 0) != 4 ||
+      memcmp(magic, CACHE_MAGIC, 4) != 0) {
+    close(fd);
+    scene->objs = read_scene(filename, &scene->light);
+    if (scene->objs == NULL) {
+      exit(1);
+    }
+    scene_validate(scene->objs, scene->light);
+    // Building the hierarchy once, every ray after this goes through it.
+    scene->bvh = useBvh ? bvh_build(scene->objs) : NULL;
+    scene_build(scene);
+    return;
+  }
+
+  char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not map file \"%s\"\n", filename);
+    exit(1);
+  }
+  load_compiled(filename, data, st.st_size, scene, useBvh);
+  scene_build(scene);
+}
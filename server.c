@@ -0,0 +1,410 @@
+#include "header.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A render server. Scenes are loaded once and stay in memory, so a request
+// only pays for its own rays. Requests are lines of text, read from stdin
+// or from any number of connections to a Unix socket:
+//
+//   load <id> <scene.json|scene.rtsc>
+//   render <id> <width> <height> [region <x0> <y0> <x1> <y1>]
+//          [camera <ex> <ey> <ez> <tx> <ty> <tz>]
+//   quit
+//
+// load answers "ok <id>". render answers "image <width> <height> <bytes>"
+// on a line of its own, then that many bytes of binary PPM holding just
+// the region, the whole frame by default. camera puts the eye at e looking
+// at t for this request only. Anything that goes wrong answers "error" and
+// a message, and the connection carries on.
+//
+// Loaded scenes are never changed or freed, so any number of requests can
+// render the same one at once. Each request gets its own copy of the Scene
+// struct for its camera; the arrays behind it are shared.
+
+// Longest request line, and longest scene id.
+#define SERVE_LINE 4096
+#define SERVE_ID 64
+
+// Largest image a single request may ask for, in pixels.
+#define SERVE_MAX_PIXELS (1 << 26)
+
+typedef struct {
+  char id[SERVE_ID];
+  Scene scene;
+  int maxDepth;
+  double minWeight;
+} Loaded;
+
+typedef struct {
+  pthread_mutex_t lock;
+  Loaded** scenes;
+  int count;
+  int capacity;
+  RenderOptions opts;   // maxDepth and minWeight below 0 use the scene's own
+  int useBvh;
+} Server;
+
+typedef struct {
+  Server* server;
+  int fd;
+} Connection;
+
+static Loaded* find_scene(Server* server, char* id) {
+  Loaded* found = NULL;
+  int i;
+  pthread_mutex_lock(&server->lock);
+  for (i = 0; i < server->count; i++) {
+    if (strcmp(server->scenes[i]->id, id) == 0) {
+      found = server->scenes[i];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&server->lock);
+  return found;
+}
+
+// Loading stops the process on a bad scene, so the scene is read once in a
+// child first. Returns 1 when it loads; otherwise message gets the child's
+// error.
+static int check_scene(char* filename, int useBvh, char* message, size_t size) {
+  int pipefd[2];
+  size_t used = 0;
+  ssize_t n;
+  int status;
+
+  if (pipe(pipefd) != 0) {
+    snprintf(message, size, "Could not check the scene.");
+    return 0;
+  }
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+    snprintf(message, size, "Could not check the scene.");
+    return 0;
+  }
+  if (pid == 0) {
+    Scene scene;
+    close(pipefd[0]);
+    dup2(pipefd[1], 2);
+    scene_load(filename, &scene, useBvh);
+    _exit(0);
+  }
+
+  close(pipefd[1]);
+  while (used + 1 < size) {
+    n = read(pipefd[0], message + used, size - used - 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    used += n;
+  }
+  close(pipefd[0]);
+  message[used] = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    return 1;
+  }
+
+  // Just the first line, without the "Error: " every message starts with.
+  char* end = strchr(message, '\n');
+  if (end != NULL) {
+    *end = 0;
+  }
+  if (strncmp(message, "Error: ", 7) == 0) {
+    memmove(message, message + 7, strlen(message + 7) + 1);
+  }
+  if (message[0] == 0) {
+    snprintf(message, size, "Could not load \"%s\".", filename);
+  }
+  return 0;
+}
+
+static void reply_error(FILE* out, const char* message) {
+  fprintf(out, "error %s\n", message);
+  fflush(out);
+}
+
+static void serve_load(Server* server, FILE* out, char* id, char* filename) {
+  char message[512];
+
+  if (strlen(id) >= SERVE_ID) {
+    reply_error(out, "Scene ids are at most 63 characters.");
+    return;
+  }
+  if (find_scene(server, id) != NULL) {
+    reply_error(out, "That scene id is already loaded.");
+    return;
+  }
+  if (!check_scene(filename, server->useBvh, message, sizeof(message))) {
+    reply_error(out, message);
+    return;
+  }
+
+  Loaded* loaded = malloc(sizeof(Loaded));
+  if (loaded == NULL) {
+    reply_error(out, "Out of memory.");
+    return;
+  }
+  strcpy(loaded->id, id);
+  scene_load(filename, &loaded->scene, server->useBvh);
+
+  // The same precedence as the command line: the server's options, then
+  // the scene's camera, then the defaults.
+  Obj* camera = loaded->scene.objs[0];
+  loaded->maxDepth = server->opts.maxDepth;
+  if (loaded->maxDepth < 0) {
+    loaded->maxDepth = camera->Camera.maxDepth >= 0 ? (int)camera->Camera.maxDepth : DEFAULT_DEPTH;
+  }
+  if (loaded->maxDepth > MAX_TRACE_DEPTH) {
+    loaded->maxDepth = MAX_TRACE_DEPTH;
+  }
+  loaded->minWeight = server->opts.minWeight;
+  if (loaded->minWeight < 0) {
+    loaded->minWeight = camera->Camera.minWeight >= 0 ? camera->Camera.minWeight : DEFAULT_MIN_WEIGHT;
+  }
+
+  pthread_mutex_lock(&server->lock);
+  // Another connection may have taken the id while this one was loading.
+  int i, taken = 0;
+  for (i = 0; i < server->count; i++) {
+    taken |= strcmp(server->scenes[i]->id, id) == 0;
+  }
+  if (!taken) {
+    if (server->count == server->capacity) {
+      server->capacity = server->capacity > 0 ? server->capacity * 2 : 8;
+      server->scenes = realloc(server->scenes, sizeof(Loaded*) * server->capacity);
+      if (server->scenes == NULL) {
+        fprintf(stderr, "Error: Out of memory while loading a scene.\n");
+        exit(1);
+      }
+    }
+    server->scenes[server->count++] = loaded;
+  }
+  pthread_mutex_unlock(&server->lock);
+
+  if (taken) {
+    reply_error(out, "That scene id is already loaded.");
+  } else {
+    fprintf(out, "ok %s\n", id);
+    fflush(out);
+  }
+}
+
+// Reads count numbers from the request. Returns 0 if any is missing.
+static int next_numbers(char** save, double* values, int count) {
+  int i;
+  for (i = 0; i < count; i++) {
+    char* word = strtok_r(NULL, " \t\r\n", save);
+    char* end;
+    if (word == NULL) {
+      return 0;
+    }
+    values[i] = strtod(word, &end);
+    if (*end != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void serve_render(Server* server, FILE* out, char* id, char** save) {
+  double size[2], box[4], cam[6];
+  int hasCamera = 0;
+  char* word;
+
+  Loaded* loaded = find_scene(server, id);
+  if (loaded == NULL) {
+    reply_error(out, "No scene is loaded with that id.");
+    return;
+  }
+  if (!next_numbers(save, size, 2) || !(size[0] >= 1 && size[1] >= 1) ||
+      size[0] * size[1] > SERVE_MAX_PIXELS) {
+    reply_error(out, "render needs a width and height, at least 1 and 67108864 pixels in all.");
+    return;
+  }
+  int width = size[0], height = size[1];
+  Tile region = {0, 0, width, height};
+
+  while ((word = strtok_r(NULL, " \t\r\n", save)) != NULL) {
+    if (strcmp(word, "region") == 0) {
+      if (!next_numbers(save, box, 4) || box[0] < 0 || box[1] < 0 || box[2] > width ||
+          box[3] > height || !(box[0] < box[2]) || !(box[1] < box[3])) {
+        reply_error(out, "region needs x0 y0 x1 y1 inside the image.");
+        return;
+      }
+      region.x0 = box[0];
+      region.y0 = box[1];
+      region.x1 = box[2];
+      region.y1 = box[3];
+    } else if (strcmp(word, "camera") == 0) {
+      if (!next_numbers(save, cam, 6)) {
+        reply_error(out, "camera needs an eye and a target, six numbers.");
+        return;
+      }
+      if (cam[0] == cam[3] && cam[1] == cam[4] && cam[2] == cam[5]) {
+        reply_error(out, "The camera can't look at the point it stands on.");
+        return;
+      }
+      hasCamera = 1;
+    } else {
+      reply_error(out, "Unknown render option.");
+      return;
+    }
+  }
+
+  // The request's own view of the shared scene.
+  Scene scene = loaded->scene;
+  if (hasCamera) {
+    scene_look_at(&scene, cam, cam + 3);
+  }
+  RenderOptions opts = server->opts;
+  opts.maxDepth = loaded->maxDepth;
+  opts.minWeight = loaded->minWeight;
+
+  int regionW = region.x1 - region.x0, regionH = region.y1 - region.y0;
+  Color* pixels = malloc((size_t)regionW * regionH * sizeof(Color));
+  if (pixels == NULL) {
+    reply_error(out, "Not enough memory for that image.");
+    return;
+  }
+  sceneRegion(&scene, height, width, &opts, &region, pixels);
+
+  char header[64];
+  int headerSize = sprintf(header, "P6\n%d %d\n255\n", regionW, regionH);
+  size_t bytes = (size_t)regionW * regionH * sizeof(Color);
+  fprintf(out, "image %d %d %zu\n", regionW, regionH, headerSize + bytes);
+  fwrite(header, 1, headerSize, out);
+  fwrite(pixels, 1, bytes, out);
+  fflush(out);
+  free(pixels);
+}
+
+// Answers requests from in until it ends or asks to quit.
+static void serve_stream(Server* server, FILE* in, FILE* out) {
+  char line[SERVE_LINE];
+  char* save;
+
+  while (fgets(line, sizeof(line), in) != NULL) {
+    if (strchr(line, '\n') == NULL && !feof(in)) {
+      int c;
+      while ((c = fgetc(in)) != EOF && c != '\n');
+      reply_error(out, "Request line too long.");
+      continue;
+    }
+    char* command = strtok_r(line, " \t\r\n", &save);
+    if (command == NULL) {
+      continue;
+    }
+    char* id = strtok_r(NULL, " \t\r\n", &save);
+    if (strcmp(command, "quit") == 0) {
+      return;
+    } else if (strcmp(command, "load") == 0) {
+      char* filename = strtok_r(NULL, "\r\n", &save);
+      if (id == NULL || filename == NULL) {
+        reply_error(out, "load needs a scene id and a file.");
+      } else {
+        serve_load(server, out, id, filename);
+      }
+    } else if (strcmp(command, "render") == 0) {
+      if (id == NULL) {
+        reply_error(out, "render needs a scene id.");
+      } else {
+        serve_render(server, out, id, &save);
+      }
+    } else {
+      reply_error(out, "Unknown request.");
+    }
+    if (ferror(out)) {
+      break;
+    }
+  }
+}
+
+static void* serve_connection(void* data) {
+  Connection* c = data;
+  FILE* in = fdopen(c->fd, "r");
+  FILE* out = fdopen(dup(c->fd), "w");
+
+  if (in != NULL && out != NULL) {
+    // quit only closes this connection; the server keeps listening.
+    serve_stream(c->server, in, out);
+  }
+  if (out != NULL) fclose(out);
+  if (in != NULL) fclose(in);
+  free(c);
+  return NULL;
+}
+
+// Serves requests from stdin when address is "-", otherwise from
+// connections to a Unix socket at address, each on its own thread.
+void serve(char* address, RenderOptions* opts, int useBvh) {
+  Server server;
+  struct sockaddr_un addr;
+  struct stat st;
+
+  pthread_mutex_init(&server.lock, NULL);
+  server.scenes = NULL;
+  server.count = 0;
+  server.capacity = 0;
+  server.opts = *opts;
+  server.useBvh = useBvh;
+  // A client that hangs up shows up as a failed write instead.
+  signal(SIGPIPE, SIG_IGN);
+
+  if (strcmp(address, "-") == 0) {
+    serve_stream(&server, stdin, stdout);
+    return;
+  }
+
+  if (strlen(address) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: Socket path \"%s\" is too long.\n", address);
+    exit(1);
+  }
+  // A socket left behind by an earlier server is replaced, anything else
+  // at that path is left alone.
+  if (stat(address, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(address);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, address);
+  if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listener, 16) != 0) {
+    fprintf(stderr, "Error: Could not listen on \"%s\".\n", address);
+    exit(1);
+  }
+  fprintf(stderr, "Serving on %s\n", address);
+
+  while (1) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "Error: Stopped accepting connections on \"%s\".\n", address);
+      exit(1);
+    }
+    Connection* c = malloc(sizeof(Connection));
+    pthread_t thread;
+    c->server = &server;
+    c->fd = fd;
+    if (pthread_create(&thread, NULL, serve_connection, c) != 0) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
@@ -0,0 +1,312 @@
+#include "header.h"
+#include <pthread.h>
+#include <unistd.h>
+
+// Each worker owns a contiguous run of tile indices [head, tail). The owner
+// takes tiles from the head, thieves take the back half from the tail.
+typedef struct {
+  pthread_mutex_t lock;
+  int head;
+  int tail;
+} TileQueue;
+
+typedef struct {
+  TileQueue* queues;
+  int workers;
+  int tilesX;
+  int tileSize;
+  int width;
+  int height;
+  Color* buff;
+  TileFunc fn;
+  TileDone finish;
+  void* data;
+} TilePool;
+
+typedef struct {
+  TilePool* pool;
+  int id;
+} TileWorker;
+
+static void tile_bounds(TilePool* pool, int index, Tile* tile) {
+  tile->x0 = (index % pool->tilesX) * pool->tileSize;
+  tile->y0 = (index / pool->tilesX) * pool->tileSize;
+  tile->x1 = tile->x0 + pool->tileSize;
+  tile->y1 = tile->y0 + pool->tileSize;
+  if (tile->x1 > pool->width) tile->x1 = pool->width;
+  if (tile->y1 > pool->height) tile->y1 = pool->height;
+}
+
+// Moves the back half of the fullest other queue into this worker's queue.
+// Returns 0 once every queue is empty.
+static int steal_tiles(TilePool* pool, int id) {
+  int tries;
+  for (tries = 0; tries < pool->workers; tries++) {
+    int victim = -1, most = 0, i;
+
+    for (i = 0; i < pool->workers; i++) {
+      TileQueue* q = &pool->queues[i];
+      if (i == id) {
+        continue;
+      }
+      pthread_mutex_lock(&q->lock);
+      int left = q->tail - q->head;
+      pthread_mutex_unlock(&q->lock);
+      if (left > most) {
+        most = left;
+        victim = i;
+      }
+    }
+    if (victim < 0) {
+      return 0;
+    }
+
+    TileQueue* q = &pool->queues[victim];
+    int start = -1, end = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+      end = q->tail;
+      start = q->tail - (q->tail - q->head + 1) / 2;
+      q->tail = start;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (start >= 0) {
+      TileQueue* mine = &pool->queues[id];
+      pthread_mutex_lock(&mine->lock);
+      mine->head = start;
+      mine->tail = end;
+      pthread_mutex_unlock(&mine->lock);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void* tile_worker(void* arg) {
+  TileWorker* worker = arg;
+  TilePool* pool = worker->pool;
+  TileQueue* mine = &pool->queues[worker->id];
+  Tile tile;
+
+  while (1) {
+    int index = -1;
+
+    pthread_mutex_lock(&mine->lock);
+    if (mine->head < mine->tail) {
+      index = mine->head++;
+    }
+    pthread_mutex_unlock(&mine->lock);
+
+    if (index < 0) {
+      if (!steal_tiles(pool, worker->id)) {
+        break;
+      }
+      continue;
+    }
+
+    tile_bounds(pool, index, &tile);
+    pool->fn(&tile, pool->buff + (size_t)tile.y0 * pool->width + tile.x0, pool->width, pool->data);
+  }
+  pool->finish(pool->data);
+  return NULL;
+}
+
+int tile_thread_count(int requested) {
+  if (requested > 0) {
+    return requested;
+  }
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (int)cores : 1;
+}
+
+// Splits a width x height image into square tiles and has fn render every
+// tile exactly once into buff. Workers start with an even share of the
+// tiles and steal from each other when they run dry, so expensive regions
+// don't leave cores idle. With one thread fn runs on the calling thread.
+// done runs on each worker once the tiles are gone.
+void tile_pool_run(int width, int height, int tileSize, int threads, Color* buff,
+  TileFunc fn, TileDone done, void* data) {
+  TilePool pool;
+  int i;
+
+  pool.tileSize = tileSize;
+  pool.width = width;
+  pool.height = height;
+  pool.buff = buff;
+  pool.tilesX = (width + tileSize - 1) / tileSize;
+  pool.fn = fn;
+  pool.finish = done;
+  pool.data = data;
+
+  int tiles = pool.tilesX * ((height + tileSize - 1) / tileSize);
+  if (threads > tiles) {
+    threads = tiles;
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  pool.workers = threads;
+
+  pool.queues = malloc(sizeof(TileQueue) * threads);
+  for (i = 0; i < threads; i++) {
+    pthread_mutex_init(&pool.queues[i].lock, NULL);
+    pool.queues[i].head = (int)((long)tiles * i / threads);
+    pool.queues[i].tail = (int)((long)tiles * (i + 1) / threads);
+  }
+
+  TileWorker* workers = malloc(sizeof(TileWorker) * threads);
+  pthread_t* ids = malloc(sizeof(pthread_t) * threads);
+  for (i = 0; i < threads; i++) {
+    workers[i].pool = &pool;
+    workers[i].id = i;
+  }
+
+  // The calling thread works as worker 0.
+  for (i = 1; i < threads; i++) {
+    if (pthread_create(&ids[i], NULL, tile_worker, &workers[i]) != 0) {
+      fprintf(stderr, "Error: Could not start render thread %d.\n", i);
+      exit(1);
+    }
+  }
+  tile_worker(&workers[0]);
+  for (i = 1; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+  }
+
+  for (i = 0; i < threads; i++) {
+    pthread_mutex_destroy(&pool.queues[i].lock);
+  }
+  free(ids);
+  free(workers);
+  free(pool.queues);
+}
+
+// Streaming state. Finished bands wait in a ring of slots until every band
+// above them has been handed to the sink.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int width;
+  int height;
+  int bandHeight;
+  int bands;
+  int slots;
+  Color* ring;
+  char* done;
+  int nextBand;
+  int written;
+  TileFunc fn;
+  TileDone finish;
+  void* data;
+} TileStream;
+
+static void* stream_worker(void* arg) {
+  TileStream* st = arg;
+  Tile tile;
+
+  while (1) {
+    pthread_mutex_lock(&st->lock);
+    // A band may only start once its slot has been written out.
+    while (st->nextBand < st->bands && st->nextBand >= st->written + st->slots) {
+      pthread_cond_wait(&st->changed, &st->lock);
+    }
+    if (st->nextBand >= st->bands) {
+      pthread_mutex_unlock(&st->lock);
+      st->finish(st->data);
+      break;
+    }
+    int band = st->nextBand++;
+    pthread_mutex_unlock(&st->lock);
+
+    int slot = band % st->slots;
+    tile.x0 = 0;
+    tile.x1 = st->width;
+    tile.y0 = band * st->bandHeight;
+    tile.y1 = tile.y0 + st->bandHeight;
+    if (tile.y1 > st->height) tile.y1 = st->height;
+    st->fn(&tile, st->ring + (size_t)slot * st->bandHeight * st->width, st->width, st->data);
+
+    pthread_mutex_lock(&st->lock);
+    st->done[slot] = 1;
+    pthread_cond_broadcast(&st->changed);
+    pthread_mutex_unlock(&st->lock);
+  }
+  return NULL;
+}
+
+// Renders the image as bands of bandHeight full-width rows and passes them
+// to sink strictly top to bottom as soon as they are ready. Workers can run
+// ahead of the sink by at most two bands each, so memory depends on the
+// width of the image and the thread count, not on its area. The calling
+// thread runs the sink while the workers render, and done runs on each
+// worker after its last band.
+void tile_stream_run(int width, int height, int bandHeight, int threads, TileFunc fn,
+  TileDone done, void* data, RowSink sink, void* sinkData) {
+  TileStream st;
+  int band, i;
+
+  if (threads < 1) {
+    threads = 1;
+  }
+  st.width = width;
+  st.height = height;
+  st.bandHeight = bandHeight;
+  st.bands = (height + bandHeight - 1) / bandHeight;
+  st.slots = 2 * threads;
+  if (st.slots > st.bands) {
+    st.slots = st.bands > 0 ? st.bands : 1;
+  }
+  st.ring = malloc((size_t)st.slots * bandHeight * width * sizeof(Color));
+  st.done = calloc(st.slots, 1);
+  st.nextBand = 0;
+  st.written = 0;
+  st.fn = fn;
+  st.finish = done;
+  st.data = data;
+  if (st.ring == NULL || st.done == NULL) {
+    fprintf(stderr, "Error: Not enough memory for the stream buffer.\n");
+    exit(1);
+  }
+  pthread_mutex_init(&st.lock, NULL);
+  pthread_cond_init(&st.changed, NULL);
+
+  pthread_t* ids = malloc(sizeof(pthread_t) * threads);
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&ids[i], NULL, stream_worker, &st) != 0) {
+      fprintf(stderr, "Error: Could not start render thread %d.\n", i);
+      exit(1);
+    }
+  }
+
+  for (band = 0; band < st.bands; band++) {
+    int slot = band % st.slots;
+    int y = band * bandHeight;
+    int rows = (y + bandHeight > height) ? height - y : bandHeight;
+
+    pthread_mutex_lock(&st.lock);
+    while (!st.done[slot]) {
+      pthread_cond_wait(&st.changed, &st.lock);
+    }
+    pthread_mutex_unlock(&st.lock);
+
+    // The slot is not reused until written moves past it, so the sink can
+    // read it without holding the lock.
+    sink(st.ring + (size_t)slot * bandHeight * width, y, rows, sinkData);
+
+    pthread_mutex_lock(&st.lock);
+    st.done[slot] = 0;
+    st.written++;
+    pthread_cond_broadcast(&st.changed);
+    pthread_mutex_unlock(&st.lock);
+  }
+
+  for (i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  pthread_cond_destroy(&st.changed);
+  pthread_mutex_destroy(&st.lock);
+  free(ids);
+  free(st.done);
+  free(st.ring);
+}
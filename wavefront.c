@@ -0,0 +1,364 @@
+#include "header.h"
+
+// Wavefront tracing. shadeColor() follows one pixel's ray tree to the
+// bottom before it starts on the next pixel, so the reflections of two
+// neighbouring pixels are traced far apart in time. A wavefront instead
+// takes one bounce of a whole batch of pixels at once: cast every ray of
+// the bounce, send all of their shadow rays, then collect the reflected and
+// refracted rays as the queue for the next bounce. Each queue is sorted
+// before it is traced, so rays leaving the same place in the same direction
+// go one after another and find the BVH nodes they need still in cache.
+//
+// The colors are those of shadeColor() but for the order the terms are
+// added in, which now and then moves a channel by one level.
+
+// Bits of the sort key for each quantized direction component, and for
+// each axis of the origin.
+#define WAVE_DIR_BITS 4
+#define WAVE_POS_BITS 5
+
+static void* wave_array(size_t size) {
+  void* a = malloc(size > 0 ? size : 1);
+  if (a == NULL) {
+    fprintf(stderr, "Error: Out of memory for the wavefront queues.\n");
+    exit(1);
+  }
+  return a;
+}
+
+Wavefront* wavefront_create(int pixels) {
+  Wavefront* w = wave_array(sizeof(Wavefront));
+  w->maxPixels = pixels;
+  // Room for two bounced rays per pixel per level. Anything past that is
+  // rare, and is traced depth first rather than growing the queues.
+  w->capacity = 2 * pixels;
+  w->count = 0;
+  w->rays = wave_array(sizeof(WaveRay) * w->capacity);
+  w->next = wave_array(sizeof(WaveRay) * w->capacity);
+  w->shadows = wave_array(sizeof(WaveShadow) * w->capacity);
+  w->shadowsSorted = wave_array(sizeof(WaveShadow) * w->capacity);
+  w->keys = wave_array(sizeof(uint64_t) * w->capacity);
+  w->keysTemp = wave_array(sizeof(uint64_t) * w->capacity);
+  w->color = wave_array(sizeof(real) * 3 * pixels);
+  return w;
+}
+
+void wavefront_free(Wavefront* w) {
+  if (w == NULL) {
+    return;
+  }
+  free(w->rays);
+  free(w->next);
+  free(w->shadows);
+  free(w->shadowsSorted);
+  free(w->keys);
+  free(w->keysTemp);
+  free(w->color);
+  free(w);
+}
+
+// Spreads the low WAVE_POS_BITS bits of v out to every third bit.
+static uint32_t spread3(uint32_t v) {
+  uint32_t out = 0;
+  int b;
+  for (b = 0; b < WAVE_POS_BITS; b++) {
+    out |= ((v >> b) & 1) << (3 * b);
+  }
+  return out;
+}
+
+static uint32_t quantize(real v, real lo, real scale, int bits) {
+  int q = (int)((v - lo) * scale);
+  int top = (1 << bits) - 1;
+  return q < 0 ? 0 : q > top ? top : q;
+}
+
+// Morton code of an origin inside the box [lo, lo + 1/scale).
+static uint32_t origin_code(real* Ro, real* lo, real* scale) {
+  return spread3(quantize(Ro[0], lo[0], scale[0], WAVE_POS_BITS)) |
+    spread3(quantize(Ro[1], lo[1], scale[1], WAVE_POS_BITS)) << 1 |
+    spread3(quantize(Ro[2], lo[2], scale[2], WAVE_POS_BITS)) << 2;
+}
+
+// Quantizing scale for origins spread over [lo, hi].
+static void origin_scale(real* lo, real* hi, real* scale) {
+  int a;
+  for (a = 0; a < 3; a++) {
+    scale[a] = hi[a] > lo[a] ? (1 << WAVE_POS_BITS) / (hi[a] - lo[a]) : 0;
+  }
+}
+
+// Sorts the n keys on their upper 32 bits, one byte per pass. The sort is
+// stable, and a pass that would leave everything in place is skipped.
+static void sort_keys(Wavefront* w, int n) {
+  uint64_t* from = w->keys;
+  uint64_t* to = w->keysTemp;
+  int count[256];
+  int shift, i;
+
+  for (shift = 32; shift < 64; shift += 8) {
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+      count[(from[i] >> shift) & 0xff]++;
+    }
+    if (n == 0 || count[(from[0] >> shift) & 0xff] == n) {
+      continue;
+    }
+    int sum = 0;
+    for (i = 0; i < 256; i++) {
+      int c = count[i];
+      count[i] = sum;
+      sum += c;
+    }
+    for (i = 0; i < n; i++) {
+      to[count[(from[i] >> shift) & 0xff]++] = from[i];
+    }
+    uint64_t* swap = from;
+    from = to;
+    to = swap;
+  }
+  // The sorted keys always end up back in w->keys.
+  if (from != w->keys) {
+    memcpy(w->keys, from, sizeof(uint64_t) * n);
+  }
+}
+
+// Puts the ray queue in order of direction octant, then direction, then
+// origin.
+static void sort_rays(Wavefront* w, int n) {
+  real lo[3] = {INFINITY, INFINITY, INFINITY};
+  real hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+  real scale[3];
+  int i, a;
+
+  for (i = 0; i < n; i++) {
+    for (a = 0; a < 3; a++) {
+      lo[a] = real_fmin(lo[a], w->rays[i].Ro[a]);
+      hi[a] = real_fmax(hi[a], w->rays[i].Ro[a]);
+    }
+  }
+  origin_scale(lo, hi, scale);
+
+  for (i = 0; i < n; i++) {
+    real* Rd = w->rays[i].Rd;
+    uint32_t octant = (Rd[0] < 0) | (Rd[1] < 0) << 1 | (Rd[2] < 0) << 2;
+    uint32_t dir = quantize(Rd[0], -1, 1 << (WAVE_DIR_BITS - 1), WAVE_DIR_BITS) |
+      quantize(Rd[1], -1, 1 << (WAVE_DIR_BITS - 1), WAVE_DIR_BITS) << WAVE_DIR_BITS |
+      quantize(Rd[2], -1, 1 << (WAVE_DIR_BITS - 1), WAVE_DIR_BITS) << 2 * WAVE_DIR_BITS;
+    uint32_t key = octant << (3 * WAVE_DIR_BITS + 3 * WAVE_POS_BITS) |
+      dir << (3 * WAVE_POS_BITS) | origin_code(w->rays[i].Ro, lo, scale);
+    w->keys[i] = (uint64_t)key << 32 | (uint32_t)i;
+  }
+  sort_keys(w, n);
+
+  for (i = 0; i < n; i++) {
+    w->next[i] = w->rays[(uint32_t)w->keys[i]];
+  }
+  WaveRay* swap = w->rays;
+  w->rays = w->next;
+  w->next = swap;
+}
+
+// Closest hit of every ray in the queue.
+static void cast_rays(Wavefront* w, Scene* scene, RenderOptions* opts, int n) {
+  RayPacket packet;
+  int i, lane;
+
+  if (opts->packets == NULL) {
+    for (i = 0; i < n; i++) {
+      WaveRay* r = &w->rays[i];
+      r->prim = rayCast(&r->t, scene, -1, r->Ro, r->Rd);
+    }
+    return;
+  }
+
+  // Neighbours in the sorted queue are close enough to share a packet.
+  for (i = 0; i < n; i += PACKET_SIZE) {
+    for (lane = 0; lane < PACKET_SIZE; lane++) {
+      WaveRay* r = &w->rays[i + lane < n ? i + lane : i];
+      packet.ox[lane] = r->Ro[0];
+      packet.oy[lane] = r->Ro[1];
+      packet.oz[lane] = r->Ro[2];
+      packet.dx[lane] = r->Rd[0];
+      packet.dy[lane] = r->Rd[1];
+      packet.dz[lane] = r->Rd[2];
+    }
+    opts->packets(scene, &packet);
+    for (lane = 0; lane < PACKET_SIZE && i + lane < n; lane++) {
+      w->rays[i + lane].prim = packet.prim[lane];
+      w->rays[i + lane].t = packet.t[lane];
+    }
+  }
+}
+
+// Traces the n queued shadow rays, sorted by light and then by origin, and
+// adds the light of each one that gets through to its ray.
+static void cast_shadows(Wavefront* w, Scene* scene, int n) {
+  real lo[3] = {INFINITY, INFINITY, INFINITY};
+  real hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+  real scale[3];
+  int i, a;
+
+  for (i = 0; i < n; i++) {
+    for (a = 0; a < 3; a++) {
+      lo[a] = real_fmin(lo[a], w->shadows[i].Ro[a]);
+      hi[a] = real_fmax(hi[a], w->shadows[i].Ro[a]);
+    }
+  }
+  origin_scale(lo, hi, scale);
+  for (i = 0; i < n; i++) {
+    uint32_t key = (uint32_t)(w->shadows[i].light & 0xffff) << (3 * WAVE_POS_BITS) |
+      origin_code(w->shadows[i].Ro, lo, scale);
+    w->keys[i] = (uint64_t)key << 32 | (uint32_t)i;
+  }
+  sort_keys(w, n);
+  for (i = 0; i < n; i++) {
+    w->shadowsSorted[i] = w->shadows[(uint32_t)w->keys[i]];
+  }
+
+  for (i = 0; i < n; i++) {
+    WaveShadow* s = &w->shadowsSorted[i];
+    WaveRay* r = &w->rays[s->ray];
+    if (rayOccluded(scene, r->prim, s->Ro, s->Rd, s->maxT)) {
+      threadRays.shadowHits++;
+    } else {
+      v3_add(s->share, r->acc, r->acc);
+    }
+  }
+}
+
+// Hit point and surface normal of a ray that hit something.
+static void hit_point(Scene* scene, WaveRay* r, real* intersect, real* Norm) {
+  currentIntersect(intersect, r->Ro, r->Rd, r->t);
+  prim_normal(scene, r->prim, intersect, r->Rd, Norm);
+}
+
+// Queues a bounced ray for the next level, or traces its whole tree right
+// away when the queue is full.
+static void push_ray(Wavefront* w, Scene* scene, RenderOptions* opts, int* count, RayTask* task,
+  int pixel) {
+  if (*count < w->capacity) {
+    WaveRay* r = &w->next[(*count)++];
+    v3_cpy(r->Ro, task->Ro);
+    v3_cpy(r->Rd, task->Rd);
+    r->weight = task->weight;
+    r->dp = task->dp;
+    r->pixel = pixel;
+    return;
+  }
+  real col[3], t;
+  threadRays.traced++;
+  int prim = rayCast(&t, scene, -1, task->Ro, task->Rd);
+  shadeRay(opts, scene, task, prim, t, col);
+  v3_add(col, &w->color[3 * pixel], &w->color[3 * pixel]);
+}
+
+// Traces the w->count rays in w->rays to the bottom of their trees and
+// leaves each pixel's color in w->color. known says the rays' prim and t
+// are already filled in, so the first level isn't cast.
+void wavefront_run(Wavefront* w, Scene* scene, RenderOptions* opts, int known) {
+  int n = w->count, level, i;
+
+  memset(w->color, 0, sizeof(real) * 3 * n);
+  for (level = 0; n > 0; level++) {
+    // The caller queues primary rays in a coherent order already.
+    if (level > 0) {
+      sort_rays(w, n);
+      threadRays.traced += n;
+    }
+    if (level > 0 || !known) {
+      cast_rays(w, scene, opts, n);
+    }
+
+    // Every shadow ray of the level, a queue load at a time.
+    int shadows = 0;
+    for (i = 0; i < n; i++) {
+      WaveRay* r = &w->rays[i];
+      real intersect[3], Norm[3];
+      threadRays.depth[opts->maxDepth - r->dp]++;
+      r->acc[0] = r->acc[1] = r->acc[2] = 0;
+      if (r->prim < 0) {
+        continue;
+      }
+      hit_point(scene, r, intersect, Norm);
+      int count, k;
+      int* near = lights_near(scene, intersect, &count);
+      for (k = 0; k < count; k++) {
+        int l = near != NULL ? near[k] : k;
+        SceneLight* light = &scene->lights[l];
+        WaveShadow* s = &w->shadows[shadows];
+        real diffColor[3], specColor[3];
+        lightRay(light, intersect, s->Rd, &s->maxT);
+        if (!lights_reach(scene, l, s->Rd, s->maxT)) {
+          threadRays.culled++;
+          continue;
+        }
+        shadows++;
+        v3_cpy(s->Ro, intersect);
+        s->ray = i;
+        s->light = l;
+        lightShare(light, prim_material(scene, r->prim), Norm, s->Rd, s->maxT, r->Rd, diffColor,
+          specColor);
+        v3_add(diffColor, specColor, s->share);
+        threadRays.shadow++;
+        if (shadows == w->capacity) {
+          cast_shadows(w, scene, shadows);
+          shadows = 0;
+        }
+      }
+    }
+    cast_shadows(w, scene, shadows);
+
+    // Shading the hits and gathering the next level's rays.
+    int next = 0;
+    for (i = 0; i < n; i++) {
+      WaveRay* r = &w->rays[i];
+      Material* mat;
+      real intersect[3], Norm[3], local[3];
+      RayTask task;
+      if (r->prim < 0) {
+        continue;
+      }
+      mat = prim_material(scene, r->prim);
+      hit_point(scene, r, intersect, Norm);
+
+      // The last level keeps all of its own color, the others give up what
+      // they reflect and transmit.
+      real keep = 1;
+      if (r->dp > 0) {
+        keep = 1 - (mat->reflectivity + mat->refractivity);
+      }
+      v3_scale(r->acc, r->weight * keep, local);
+      v3_add(&w->color[3 * r->pixel], local, &w->color[3 * r->pixel]);
+
+      if (r->dp > 0) {
+        real weight = r->weight * mat->reflectivity;
+        if (weight > opts->minWeight) {
+          reflection(&task, Norm, r->Ro, r->Rd, r->t);
+          task.weight = weight;
+          task.dp = r->dp - 1;
+          threadRays.reflection++;
+          push_ray(w, scene, opts, &next, &task, r->pixel);
+        } else {
+          threadRays.pruned++;
+        }
+
+        weight = r->weight * mat->refractivity;
+        if (weight > opts->minWeight) {
+          refraction(&task, mat->refracIndex, Norm, r->prim, r->Ro, r->Rd, scene, r->t);
+          task.weight = weight;
+          task.dp = r->dp - 1;
+          threadRays.refraction++;
+          push_ray(w, scene, opts, &next, &task, r->pixel);
+        } else {
+          threadRays.pruned++;
+        }
+      }
+    }
+
+    WaveRay* swap = w->rays;
+    w->rays = w->next;
+    w->next = swap;
+    n = next;
+  }
+}
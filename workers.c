@@ -0,0 +1,398 @@
+#include "header.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Rendering a frame across worker processes on this machine. The
+// coordinator forks the workers once the scene is loaded, and talks to each
+// over a Unix stream socket. The scene, the RenderOptions and the screen
+// bins never go over the socket: each worker has them only because fork()
+// gave it a copy of the coordinator's memory. Workers on other machines
+// would first need all of that sent to them, so only local workers are
+// supported.
+//
+// Coordinator to worker: a job, which is one int tile index. Worker to
+// coordinator: the tile index, the RayCounts for that tile and the tile's
+// pixels, row after row. The worker exits when its socket closes. Both
+// ends are the same build, so everything goes in native byte order.
+//
+// A worker has one job at a time. When a worker dies its tile goes back in
+// the queue. Once the queue is empty, an idle worker gets a second copy of
+// the tile that has been out the longest and whichever copy comes back
+// first is kept, so one slow worker can't hold up the end of the frame.
+//
+// Results are read as they arrive, a piece at a time, into a buffer per
+// worker, so a worker that stalls halfway through sending a tile never
+// blocks the coordinator. One that sends nothing for WORKER_STALL seconds
+// after starting a result is given up on.
+
+// Edge length in pixels of one job. Much larger than TILE_SIZE so the round
+// trip is small next to the rendering.
+#define JOB_SIZE 64
+
+// How long poll() waits before the coordinator looks for stalled workers,
+// in milliseconds, and how long in seconds a half-sent result may sit.
+#define POLL_INTERVAL 100
+#define WORKER_STALL 10.0
+
+// A result is the tile index, the RayCounts and then the pixels.
+#define RESULT_HEADER (sizeof(int) + sizeof(RayCounts))
+
+typedef struct {
+  int fd;        // -1 once the worker is gone
+  pid_t pid;
+  int job;       // tile being rendered, or -1 when idle
+  double since;  // when job was handed out
+  char* result;  // result of job read so far
+  size_t got;
+  double heard;  // when the last bytes of the result arrived
+} Worker;
+
+// Where every tile of the frame stands.
+enum { JOB_WAITING, JOB_OUT, JOB_DONE };
+
+typedef struct {
+  int tiles;
+  int tilesX;
+  char* state;
+  int* copies;   // workers rendering each tile right now
+  int* retry;    // tiles given back by workers that died
+  int retries;
+  int next;      // first tile never handed out
+} JobQueue;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int read_full(int fd, void* buf, size_t size) {
+  char* p = buf;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 0;
+    }
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+// send() rather than write() so a peer that has gone away shows up as a
+// failed call instead of a SIGPIPE.
+static int write_full(int fd, void* buf, size_t size) {
+  char* p = buf;
+  while (size > 0) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 0;
+    }
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+static void job_bounds(int width, int height, int tilesX, int index, Tile* tile) {
+  tile->x0 = (index % tilesX) * JOB_SIZE;
+  tile->y0 = (index / tilesX) * JOB_SIZE;
+  tile->x1 = tile->x0 + JOB_SIZE;
+  tile->y1 = tile->y0 + JOB_SIZE;
+  if (tile->x1 > width) tile->x1 = width;
+  if (tile->y1 > height) tile->y1 = height;
+}
+
+// The worker side. Renders jobs until the coordinator goes away, then
+// leaves without running any of the parent's exit handlers.
+static void worker_main(int fd, Scene* scene, int height, int width, int tilesX,
+  RenderOptions* opts, ScreenBins* bins) {
+  Color* pixels = malloc(sizeof(Color) * JOB_SIZE * JOB_SIZE);
+  Tile tile;
+  int job;
+
+  while (read_full(fd, &job, sizeof(int))) {
+    job_bounds(width, height, tilesX, job, &tile);
+    memset(&opts->rays, 0, sizeof(RayCounts));
+    sceneTile(scene, height, width, opts, bins, &tile, pixels);
+    size_t size = sizeof(Color) * (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    if (!write_full(fd, &job, sizeof(int)) || !write_full(fd, &opts->rays, sizeof(RayCounts)) ||
+      !write_full(fd, pixels, size)) {
+      break;
+    }
+  }
+  _exit(0);
+}
+
+// Next tile for an idle worker: one given back by a dead worker, then one
+// never handed out, then a second copy of the oldest tile still out.
+// Returns -1 when there is nothing worth doing.
+static int next_job(JobQueue* q, Worker* workers, int count) {
+  while (q->retries > 0) {
+    int job = q->retry[--q->retries];
+    if (q->state[job] == JOB_WAITING) {
+      return job;
+    }
+  }
+  if (q->next < q->tiles) {
+    return q->next++;
+  }
+
+  int oldest = -1, i;
+  for (i = 0; i < count; i++) {
+    Worker* w = &workers[i];
+    if (w->fd < 0 || w->job < 0 || q->state[w->job] == JOB_DONE || q->copies[w->job] > 1) {
+      continue;
+    }
+    if (oldest < 0 || w->since < workers[oldest].since) {
+      oldest = i;
+    }
+  }
+  return oldest < 0 ? -1 : workers[oldest].job;
+}
+
+// Kills off a worker that stopped answering properly and puts its tile
+// back in the queue unless another copy of it is still out.
+static void worker_lost(JobQueue* q, Worker* w, int id) {
+  close(w->fd);
+  w->fd = -1;
+  kill(w->pid, SIGKILL);
+  waitpid(w->pid, NULL, 0);
+  if (w->job >= 0) {
+    q->copies[w->job]--;
+    if (q->state[w->job] != JOB_DONE && q->copies[w->job] == 0) {
+      q->state[w->job] = JOB_WAITING;
+      q->retry[q->retries++] = w->job;
+    }
+    fprintf(stderr, "Render worker %d stopped, tile %d goes to another worker.\n", id, w->job);
+    w->job = -1;
+  }
+}
+
+// Bytes in the result for job.
+static size_t result_size(JobQueue* q, int width, int height, int job) {
+  Tile tile;
+  job_bounds(width, height, q->tilesX, job, &tile);
+  return RESULT_HEADER + sizeof(Color) * (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+}
+
+// Reads whatever w has sent so far of its result, without waiting for the
+// rest. Once the whole tile is in, copies it into buff and adds its counts
+// to rays. The pixels of a tile that already came back from another worker
+// are dropped, though the work still counts. Returns 1 when a new tile was
+// finished.
+static int worker_result(JobQueue* q, Worker* w, int id, Color* buff, int height, int width,
+  RayCounts* rays) {
+  int job = w->job;
+  size_t size = result_size(q, width, height, job);
+  RayCounts counts;
+  Tile tile;
+  int sent, y;
+  size_t i;
+
+  ssize_t n = read(w->fd, w->result + w->got, size - w->got);
+  if (n < 0 && errno == EINTR) {
+    return 0;
+  }
+  if (n <= 0) {
+    worker_lost(q, w, id);
+    return 0;
+  }
+  w->got += n;
+  w->heard = now();
+  if (w->got >= sizeof(int)) {
+    memcpy(&sent, w->result, sizeof(int));
+    if (sent != job) {
+      worker_lost(q, w, id);
+      return 0;
+    }
+  }
+  if (w->got < size) {
+    return 0;
+  }
+
+  memcpy(&counts, w->result + sizeof(int), sizeof(RayCounts));
+  for (i = 0; i < sizeof(RayCounts) / sizeof(long); i++) {
+    ((long*)rays)[i] += ((long*)&counts)[i];
+  }
+  q->copies[job]--;
+  w->job = -1;
+  w->got = 0;
+  if (q->state[job] == JOB_DONE) {
+    return 0;
+  }
+  job_bounds(width, height, q->tilesX, job, &tile);
+  int tileW = tile.x1 - tile.x0;
+  char* pixels = w->result + RESULT_HEADER;
+  for (y = tile.y0; y < tile.y1; y++) {
+    memcpy(buff + (size_t)y * width + tile.x0, pixels + sizeof(Color) * (y - tile.y0) * tileW,
+      sizeof(Color) * tileW);
+  }
+  q->state[job] = JOB_DONE;
+  return 1;
+}
+
+// Closing the socket is the signal to stop. One still busy with a spare
+// copy of a tile is killed instead of waited for.
+static void worker_stop(Worker* w) {
+  close(w->fd);
+  if (w->job >= 0) {
+    kill(w->pid, SIGKILL);
+  }
+  waitpid(w->pid, NULL, 0);
+}
+
+// Renders the frame on opts->workers worker processes and returns it the
+// way sceneMaker() does. Each worker renders on a single thread.
+Color* workers_render(Scene* scene, int height, int width, RenderOptions* opts) {
+  JobQueue q;
+  int count = opts->workers;
+  int done = 0, alive, i;
+
+  q.tilesX = (width + JOB_SIZE - 1) / JOB_SIZE;
+  q.tiles = q.tilesX * ((height + JOB_SIZE - 1) / JOB_SIZE);
+  q.state = calloc(q.tiles > 0 ? q.tiles : 1, 1);
+  q.copies = calloc(q.tiles > 0 ? q.tiles : 1, sizeof(int));
+  q.retry = malloc(sizeof(int) * (q.tiles > 0 ? q.tiles : 1));
+  q.retries = 0;
+  q.next = 0;
+  if (count > q.tiles) {
+    count = q.tiles > 0 ? q.tiles : 1;
+  }
+
+  Color* buff = malloc((size_t)height * width * sizeof(Color));
+  Worker* workers = malloc(sizeof(Worker) * count);
+  struct pollfd* fds = malloc(sizeof(struct pollfd) * count);
+  int* polled = malloc(sizeof(int) * count);
+  if (buff == NULL) {
+    fprintf(stderr, "Error: Not enough memory for a %ix%i image.\n", width, height);
+    exit(1);
+  }
+  memset(&opts->rays, 0, sizeof(RayCounts));
+
+  // The screen bins are built once, here, and every worker inherits them.
+  Tile all = {0, 0, width, height};
+  ScreenBins* bins = opts->binning && !opts->reshade ? bins_build(scene, height, width, &all) :
+    NULL;
+
+  // Anything still buffered would otherwise be written again by every child.
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i < count; i++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+      fprintf(stderr, "Error: Could not open a socket to render worker %d.\n", i);
+      exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "Error: Could not start render worker %d.\n", i);
+      exit(1);
+    }
+    if (pid == 0) {
+      // Dropping the coordinator's ends, or the workers before this one
+      // would never see their socket close.
+      int j;
+      for (j = 0; j < i; j++) {
+        close(workers[j].fd);
+      }
+      close(sv[0]);
+      worker_main(sv[1], scene, height, width, q.tilesX, opts, bins);
+    }
+    close(sv[1]);
+    workers[i].fd = sv[0];
+    workers[i].pid = pid;
+    workers[i].job = -1;
+    workers[i].since = 0;
+    workers[i].result = malloc(RESULT_HEADER + sizeof(Color) * JOB_SIZE * JOB_SIZE);
+    workers[i].got = 0;
+    if (workers[i].result == NULL) {
+      fprintf(stderr, "Error: Out of memory while starting the render workers.\n");
+      exit(1);
+    }
+  }
+
+  while (done < q.tiles) {
+    // Giving every idle worker something to do.
+    alive = 0;
+    for (i = 0; i < count; i++) {
+      Worker* w = &workers[i];
+      if (w->fd >= 0 && w->job < 0) {
+        int job = next_job(&q, workers, count);
+        if (job >= 0) {
+          q.state[job] = JOB_OUT;
+          q.copies[job]++;
+          w->job = job;
+          w->since = now();
+          w->got = 0;
+          if (!write_full(w->fd, &job, sizeof(int))) {
+            worker_lost(&q, w, i);
+          }
+        }
+      }
+      if (w->fd >= 0) {
+        alive++;
+      }
+    }
+    if (alive == 0) {
+      fprintf(stderr, "Error: Every render worker has stopped.\n");
+      exit(1);
+    }
+
+    // Waiting for any of the busy ones to answer.
+    int n = 0;
+    for (i = 0; i < count; i++) {
+      if (workers[i].fd >= 0 && workers[i].job >= 0) {
+        fds[n].fd = workers[i].fd;
+        fds[n].events = POLLIN;
+        polled[n++] = i;
+      }
+    }
+    if (n == 0) {
+      continue;
+    }
+    if (poll(fds, n, POLL_INTERVAL) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error: Lost track of the render workers.\n");
+      exit(1);
+    }
+    double t = now();
+    for (i = 0; i < n; i++) {
+      Worker* w = &workers[polled[i]];
+      if (fds[i].revents != 0) {
+        done += worker_result(&q, w, polled[i], buff, height, width, &opts->rays);
+      } else if (w->got > 0 && t - w->heard > WORKER_STALL) {
+        worker_lost(&q, w, polled[i]);
+      }
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (workers[i].fd >= 0) {
+      worker_stop(&workers[i]);
+    }
+    free(workers[i].result);
+  }
+
+  bins_free(bins);
+  free(polled);
+  free(fds);
+  free(workers);
+  free(q.retry);
+  free(q.copies);
+  free(q.state);
+  return buff;
+}